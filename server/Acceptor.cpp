@@ -0,0 +1,265 @@
+#include "Acceptor.h"
+#include "Client.h"
+
+#include <fcntl.h>
+#include <poll.h>
+
+using namespace std;
+using namespace StorageCloud;
+
+atomic<size_t> Acceptor::activeConnections(0);
+
+static void configureSocket(int sock) {
+
+    int optval = 1;
+    socklen_t optlen = sizeof(optval);
+
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen);
+
+    optval = 2;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &optval, optlen);
+
+    optval = 10;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &optval, optlen);
+
+    optval = 5;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &optval, optlen);
+}
+
+Acceptor::Acceptor(int a_id, bool* s_e, Logger* logg, vector<Reactor*>* r) {
+    id = a_id;
+    should_exit = s_e;
+    logger = logg;
+    reactors = r;
+    nextReactor = (unsigned int) a_id;
+    pendingSize = 0;
+    l_id = "acceptor/" + to_string(id);
+}
+
+// connections still registered here are freed, their clients have to be closed before
+Acceptor::~Acceptor() {
+    join();
+
+    for(auto& p: pending) {
+        close(p.sock);
+        delete p.conn;
+    }
+
+    for(auto conn: connections) {
+        delete conn;
+    }
+
+    if(sock != -1) {
+        close(sock);
+    }
+}
+
+bool Acceptor::listenOn(int port) {
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(sock == -1) {
+        logger->err(l_id, "error while opening stream socket", errno);
+        return false;
+    }
+
+    int optval = 1;
+    socklen_t optlen = sizeof(optval);
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, optlen);
+
+    if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, optlen) == -1) {
+        logger->err(l_id, "error while setting SO_REUSEPORT", errno);
+        return false;
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(port);
+
+    if(bind(sock, (struct sockaddr *) &server, sizeof server) == -1) {
+        logger->err(l_id, "error while binding stream socket", errno);
+        return false;
+    }
+
+    if(listen(sock, LISTEN_BACKLOG) == -1) {
+        logger->err(l_id, "error while listening on socket", errno);
+        return false;
+    }
+
+    logger->log(l_id, "listening on port #" + to_string(port) + ", fd " + to_string(sock));
+    return true;
+}
+
+bool Acceptor::start() {
+    t = thread(&Acceptor::loop, this);
+    return true;
+}
+
+void Acceptor::join() {
+    if(t.joinable()) {
+        t.join();
+    }
+}
+
+void Acceptor::loop() {
+    logger->log(l_id, "started");
+
+    while(!(*should_exit)) {
+        struct pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        // waiting connections are admitted as soon as slots are freed
+        int rv = poll(&pfd, 1, pending.empty() ? 2000 : 100);
+
+        if(rv == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            logger->err(l_id, "error while waiting for connections", errno);
+            break;
+        }
+
+        if(rv > 0) {
+            acceptAll();
+        }
+
+        admitPending();
+    }
+
+    logger->log(l_id, "closed");
+}
+
+// accepts whole backlog at once, so reconnect storms are drained in few wakeups
+void Acceptor::acceptAll() {
+    while(!(*should_exit)) {
+        struct sockaddr_in clientaddr;
+        socklen_t len = sizeof(clientaddr);
+
+        int msgsock = accept4(sock, (struct sockaddr *) &clientaddr, &len, SOCK_CLOEXEC);
+
+        if(msgsock == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                logger->err(l_id, "error while accepting connection", errno);
+            }
+            return;
+        }
+
+        string conn(inet_ntoa(clientaddr.sin_addr));
+        logger->info(l_id, "accepted connection from " + conn + ":" + to_string(ntohs(clientaddr.sin_port)));
+
+        connection* new_connection = new connection;
+        new_connection->encryption = DEFAULT_ENCRYPTION_ALGORITHM;
+        new_connection->hash_algorithm = DEFAULT_HASHING_ALGORITHM;
+        conn.copy(new_connection->addr, conn.size());
+        new_connection->addr[conn.size()] = 0;
+        new_connection->port = (int) ntohs(clientaddr.sin_port);
+        new_connection->acceptor = this;
+
+        configureSocket(msgsock);
+
+        if(pending.empty() && tryReserveSlot()) {
+            admit(msgsock, new_connection);
+        } else if(pending.size() < MAX_PENDING_CONNECTIONS) {
+            logger->warn(l_id, "connection limit reached, " + conn + " waits for admission");
+            pending.push_back({msgsock, new_connection, time(nullptr)});
+            pendingSize = pending.size();
+        } else {
+            logger->warn(l_id, "admission queue full, rejecting " + conn);
+            reject(msgsock, "Server overloaded, try again later");
+            delete new_connection;
+        }
+    }
+}
+
+void Acceptor::admitPending() {
+    time_t now = time(nullptr);
+
+    while(!pending.empty()) {
+        pendingConnection& p = pending.front();
+
+        if(tryReserveSlot()) {
+            admit(p.sock, p.conn);
+        } else if(now - p.since >= ADMISSION_TIMEOUT) {
+            logger->warn(l_id, string("admission timed out for ") + p.conn->addr + ":" + to_string(p.conn->port));
+            reject(p.sock, "Server overloaded, try again later");
+            delete p.conn;
+        } else {
+            break;
+        }
+
+        pending.pop_front();
+        pendingSize = pending.size();
+    }
+}
+
+// limit is global, shared by all acceptors
+bool Acceptor::tryReserveSlot() {
+    if(activeConnections.fetch_add(1) < MAX_CONNECTIONS) {
+        return true;
+    }
+
+    activeConnections--;
+    return false;
+}
+
+void Acceptor::admit(int msgsock, connection* conn) {
+    {
+        lock_guard<mutex> lock(connections_mutex);
+        conn->registryPos = connections.insert(connections.end(), conn);
+    }
+
+    if(reactors->empty()) {
+        close(msgsock);
+        release(conn);
+        return;
+    }
+
+    // on failure socket is closed and connection released by the reactor
+    (*reactors)[nextReactor++ % reactors->size()]->addConnection(msgsock, conn);
+}
+
+// sends ERROR response and closes socket, used when connection can't be admitted
+void Acceptor::reject(int msgsock, const string& reason) {
+    ServerResponse res;
+    res.set_type(ResponseType::ERROR);
+    Param* p = res.add_params();
+    p->set_paramid("msg");
+    p->set_sparamval(reason);
+
+    PooledBuffer buf;
+
+    if(Client::encodeResponse(res, DEFAULT_HASHING_ALGORITHM, DEFAULT_ENCRYPTION_ALGORITHM, buf)) {
+        send(msgsock, buf.data(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    close(msgsock);
+}
+
+// called when client is closed, from any thread
+void Acceptor::release(connection* conn) {
+    {
+        lock_guard<mutex> lock(connections_mutex);
+        connections.erase(conn->registryPos);
+    }
+
+    logger->log(l_id, "connection removed");
+
+    delete conn;
+    activeConnections--;
+}
+
+void Acceptor::listConnections(vector<string>& out) {
+    lock_guard<mutex> lock(connections_mutex);
+
+    for(auto conn: connections) {
+        out.push_back(string(conn->addr) + ":" + to_string(conn->port));
+    }
+}
+
@@ -0,0 +1,57 @@
+#ifndef SERVER_ACCEPTOR_H
+#define SERVER_ACCEPTOR_H
+
+#include "main.h"
+#include "Logger.h"
+#include "Reactor.h"
+
+#include <atomic>
+#include <deque>
+
+// accepting thread with its own SO_REUSEPORT listening socket, kernel spreads incoming connections
+// between acceptors; each one owns its shard of the connection registry and admission queue
+class Acceptor {
+private:
+    struct pendingConnection {
+        int sock;
+        connection* conn;
+        time_t since;
+    };
+
+    int id;
+    int sock = -1;
+    std::thread t;
+    bool* should_exit;
+    Logger* logger;
+    std::vector<Reactor*>* reactors;
+    unsigned int nextReactor;
+    std::string l_id;
+
+    std::mutex connections_mutex;
+    std::list<connection*> connections;
+    // touched only by acceptor thread, pendingSize is for others
+    std::deque<pendingConnection> pending;
+    std::atomic<size_t> pendingSize;
+
+    static std::atomic<size_t> activeConnections;
+
+    void loop();
+    void acceptAll();
+    void admitPending();
+    bool tryReserveSlot();
+    void admit(int, connection*);
+    void reject(int, const std::string&);
+
+public:
+    Acceptor(int, bool*, Logger*, std::vector<Reactor*>*);
+    ~Acceptor();
+    bool listenOn(int);
+    bool start();
+    void join();
+    void release(connection*);
+    void listConnections(std::vector<std::string>&);
+    size_t pendingCount() { return pendingSize; };
+    static size_t connectionCount() { return activeConnections; };
+};
+
+#endif //SERVER_ACCEPTOR_H
@@ -0,0 +1,178 @@
+#include "BufferPool.h"
+
+using namespace std;
+
+static const size_t CLASS_SIZE[POOL_CLASSES] = {POOL_SMALL_SIZE, POOL_MEDIUM_SIZE, POOL_LARGE_SIZE};
+static const size_t THREAD_CACHE_LIMIT[POOL_CLASSES] = {64, 16, 2};
+static const size_t SHARED_LIMIT[POOL_CLASSES] = {1024, 256, 8};
+
+mutex BufferPool::shared_mutex;
+BufferPool::SharedFreeList BufferPool::shared;
+atomic<uint64_t> BufferPool::allocated[POOL_CLASSES];
+atomic<uint64_t> BufferPool::inUse[POOL_CLASSES];
+
+BufferPool::SharedFreeList::~SharedFreeList() {
+    for(int c=0; c<POOL_CLASSES; c++) {
+        for(auto buf: free[c]) {
+            delete[] buf;
+        }
+    }
+}
+
+struct BufferPoolThreadCache {
+    vector<uint8_t*> free[POOL_CLASSES];
+
+    ~BufferPoolThreadCache() {
+        for(int c=0; c<POOL_CLASSES; c++) {
+            for(auto buf: free[c]) {
+                BufferPool::releaseToShared(buf, c);
+            }
+        }
+    }
+};
+
+static thread_local BufferPoolThreadCache threadCache;
+
+int BufferPool::classFor(size_t size) {
+    for(int c=0; c<POOL_CLASSES; c++) {
+        if(size <= CLASS_SIZE[c]) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+size_t BufferPool::classSize(int c) {
+    return CLASS_SIZE[c];
+}
+
+uint8_t* BufferPool::acquire(int c) {
+    inUse[c]++;
+
+    auto& local = threadCache.free[c];
+
+    if(!local.empty()) {
+        uint8_t* buf = local.back();
+        local.pop_back();
+        return buf;
+    }
+
+    {
+        lock_guard<mutex> lock(shared_mutex);
+        if(!shared.free[c].empty()) {
+            uint8_t* buf = shared.free[c].back();
+            shared.free[c].pop_back();
+            return buf;
+        }
+    }
+
+    allocated[c]++;
+    return new uint8_t[CLASS_SIZE[c]];
+}
+
+void BufferPool::release(uint8_t* buf, int c) {
+    inUse[c]--;
+
+    auto& local = threadCache.free[c];
+
+    if(local.size() < THREAD_CACHE_LIMIT[c]) {
+        local.push_back(buf);
+        return;
+    }
+
+    releaseToShared(buf, c);
+}
+
+void BufferPool::releaseToShared(uint8_t* buf, int c) {
+    {
+        lock_guard<mutex> lock(shared_mutex);
+        if(shared.free[c].size() < SHARED_LIMIT[c]) {
+            shared.free[c].push_back(buf);
+            return;
+        }
+    }
+
+    allocated[c]--;
+    delete[] buf;
+}
+
+string BufferPool::stats() {
+    string res;
+    const char* names[POOL_CLASSES] = {"small", "medium", "large"};
+
+    for(int c=0; c<POOL_CLASSES; c++) {
+        if(!res.empty()) {
+            res += ", ";
+        }
+        res += string(names[c]) + ": " + to_string(inUse[c].load()) + "/" + to_string(allocated[c].load()) + " in use";
+    }
+
+    return res;
+}
+
+PooledBuffer::PooledBuffer(size_t size) {
+    resize(size);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) {
+    buf = other.buf;
+    len = other.len;
+    sizeClass = other.sizeClass;
+    other.buf = nullptr;
+    other.len = 0;
+    other.sizeClass = -1;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) {
+    if(this != &other) {
+        release();
+        buf = other.buf;
+        len = other.len;
+        sizeClass = other.sizeClass;
+        other.buf = nullptr;
+        other.len = 0;
+        other.sizeClass = -1;
+    }
+
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    release();
+}
+
+// keeps content, moves to bigger class if needed
+void PooledBuffer::resize(size_t size) {
+    if(buf != nullptr && sizeClass != -1 && size <= BufferPool::classSize(sizeClass)) {
+        len = size;
+        return;
+    }
+
+    int newClass = BufferPool::classFor(size);
+    uint8_t* newBuf = (newClass == -1) ? new uint8_t[size] : BufferPool::acquire(newClass);
+
+    if(buf != nullptr) {
+        memcpy(newBuf, buf, min(len, size));
+    }
+
+    release();
+
+    buf = newBuf;
+    len = size;
+    sizeClass = newClass;
+}
+
+void PooledBuffer::release() {
+    if(buf != nullptr) {
+        if(sizeClass == -1) {
+            delete[] buf;
+        } else {
+            BufferPool::release(buf, sizeClass);
+        }
+    }
+
+    buf = nullptr;
+    len = 0;
+    sizeClass = -1;
+}
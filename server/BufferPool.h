@@ -0,0 +1,66 @@
+#ifndef SERVER_BUFFERPOOL_H
+#define SERVER_BUFFERPOOL_H
+
+#include "main.h"
+
+#include <atomic>
+
+#define POOL_CLASS_SMALL 0
+#define POOL_CLASS_MEDIUM 1
+#define POOL_CLASS_LARGE 2
+#define POOL_CLASSES 3
+
+#define POOL_SMALL_SIZE 4096
+#define POOL_MEDIUM_SIZE 65536
+#define POOL_LARGE_SIZE (MAX_PACKET_SIZE)
+
+// size-classed buffers with per-thread caches, backed by a shared free list
+class BufferPool {
+private:
+    struct SharedFreeList {
+        std::vector<uint8_t*> free[POOL_CLASSES];
+        ~SharedFreeList();
+    };
+
+    static std::mutex shared_mutex;
+    static SharedFreeList shared;
+    static std::atomic<uint64_t> allocated[POOL_CLASSES];
+    static std::atomic<uint64_t> inUse[POOL_CLASSES];
+
+    friend struct BufferPoolThreadCache;
+
+    static void releaseToShared(uint8_t*, int);
+
+public:
+    static int classFor(size_t);
+    static size_t classSize(int);
+    static uint8_t* acquire(int);
+    static void release(uint8_t*, int);
+    static std::string stats();
+};
+
+// buffer taken from BufferPool, returned there when destroyed
+class PooledBuffer {
+private:
+    uint8_t* buf = nullptr;
+    size_t len = 0;
+    int sizeClass = -1;
+
+public:
+    PooledBuffer() {};
+    explicit PooledBuffer(size_t);
+    PooledBuffer(PooledBuffer&&);
+    PooledBuffer& operator=(PooledBuffer&&);
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    ~PooledBuffer();
+
+    void resize(size_t);
+    void release();
+    uint8_t* data() { return buf; };
+    size_t size() const { return len; };
+    bool empty() const { return len == 0; };
+    uint8_t& operator[](size_t i) { return buf[i]; };
+};
+
+#endif //SERVER_BUFFERPOOL_H
@@ -1,9 +1,18 @@
 #include "Client.h"
+#include "Acceptor.h"
+
+#include <fcntl.h>
 
 using namespace std;
 using namespace StorageCloud;
 
-Client::Client(int sock, connection* conn, bool* s_e, Logger* logg) {
+static void appendVarint(string& out, uint32_t value) {
+    uint8_t buf[5];
+    uint8_t* end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(value, buf);
+    out.append((char*) buf, end - buf);
+}
+
+Client::Client(int sock, connection* conn, bool* s_e, Logger* logg): io(sock) {
     socket = sock;
     this_connection = conn;
     should_exit = s_e;
@@ -12,6 +21,17 @@ Client::Client(int sock, connection* conn, bool* s_e, Logger* logg) {
     id += ":" + to_string(conn->port);
 }
 
+Client::~Client() {
+    logger->info(id, "closed connection, fd was " + to_string(socket));
+
+    // progress of interrupted upload is kept in memory until now, its quota reservation too
+    u.endUpload();
+
+    close(socket);
+
+    this_connection->acceptor->release(this_connection);
+}
+
 HashAlgorithm Client::getHashAlgorithm() {
     return this_connection->hash_algorithm;
 }
@@ -24,92 +44,7 @@ void Client::setEncryptionAlgorithm(EncryptionAlgorithm newAlgorithm) {
     this_connection->encryption = newAlgorithm;
 }
 
-bool Client::getNBytes(const int n, uint8_t buf[], bool& exitReason) {
-    struct epoll_event ev, events[1];
-    int epfd = epoll_create1(0), nfds;
-    ev.events = EPOLLIN;
-    ev.data.fd = socket;
-
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, socket, &ev) == -1) {
-        perror("epoll_ctl: listen_sock");
-        exitReason = R_ERROR;
-        return false;
-    }
-
-    int received = 0;
-    int last_received = 0;
-
-    while (received != n && !(*should_exit)) {
-        nfds = epoll_wait(epfd, events, 1, 1000);
-
-        if (nfds == -1) {
-            break;
-        }
-
-        if (nfds > 0) {
-            last_received = (int) recv(socket, buf+received, (size_t) (n - received), 0);
-            if (last_received == 0) {
-                logger->info(id, "no new data, closing");
-                exitReason = R_DISCONNECT;
-                break;
-            }
-
-            if (last_received < 0) {
-                logger->err(id, "error while reading from socket", errno);
-                exitReason = R_ERROR;
-                break;
-            }
-
-            received += last_received;
-        }
-    }
-
-    return (received == n);
-}
-
-bool Client::sendNBytes(const int n, uint8_t buf[]) {
-    struct epoll_event ev, events[1];
-    int epfd = epoll_create1(0), nfds;
-    ev.events = EPOLLOUT;
-    ev.data.fd = socket;
-
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, socket, &ev) == -1) {
-        perror("epoll_ctl: listen_sock");
-        return false;
-    }
-
-    int sent = 0;
-    int last_sent = 0;
-
-    while (sent != n && !(*should_exit)) {
-        nfds = epoll_wait(epfd, events, 1, 1000);
-
-        if (nfds == -1) {
-            break;
-        }
-
-        if (nfds > 0) {
-            last_sent = (int) send(socket, buf+sent, (size_t) (n - sent), MSG_DONTWAIT);
-            if (last_sent == 0) {
-                if(errno != EWOULDBLOCK || errno != EAGAIN) {
-                    logger->warn(id, "sent 0 bytes");
-                    break;
-                }
-            }
-
-            if (last_sent < 0) {
-                logger->err(id, "error while writing to socket", errno);
-                break;
-            }
-
-            sent += last_sent;
-        }
-    }
-
-    return (sent == n);
-}
-
-bool Client::processMessage(uint8_t buf[], int len) {
+bool Client::processMessage(const uint8_t buf[], int len) {
     MessageType msg_type;
 
     uint8_t* parsed_msg = nullptr;
@@ -140,7 +75,7 @@ bool Client::processMessage(uint8_t buf[], int len) {
     delete parsed_msg;
 }
 
-bool Client::parseMessage(uint8_t buf[], int len, MessageType* msg_type, uint8_t** parsed_data, uint32_t* parsed_len) {
+bool Client::parseMessage(const uint8_t buf[], int len, MessageType* msg_type, uint8_t** parsed_data, uint32_t* parsed_len) {
     EncodedMessage msg;
     msg.ParseFromArray(buf, len);
     logger->log(id, "Parsing message");
@@ -211,95 +146,381 @@ bool Client::sendServerResponse(const ServerResponse* res) {
     delete data;
 }
 
-bool Client::prepareDataToSend(uint8_t in_buf[], uint32_t len) {
+// SRV_DATA response whose data field is len bytes of the file, only for NOENCRYPTION
+// headers of both messages are built in memory (data is the last field in each of them),
+// file body is sent with sendfile, so it is never copied to user space nor hashed
+bool Client::sendFileSegment(const ServerResponse& head, std::shared_ptr<FileHandle> file, uint64_t offset, uint32_t len) {
+    string inner = head.SerializeAsString();
+    inner += (char) 0x32; // ServerResponse.data, length delimited
+    appendVarint(inner, len);
+
+    uint32_t innerLen = (uint32_t) inner.size() + len;
+
+    EncodedMessage msg;
+    msg.set_datasize(innerLen);
+    msg.set_hashalgorithm(HashAlgorithm::H_NOHASH);
+    msg.set_type(MessageType::SERVER_RESPONSE);
+
+    string outer = msg.SerializeAsString();
+    outer += (char) 0x2A; // EncodedMessage.data, length delimited
+    appendVarint(outer, innerLen);
+
+    uint32_t out_len = 4 + (uint32_t) outer.size() + innerLen;
+
+    if(out_len > MAX_PACKET_SIZE - 4) {
+        logger->warn(id, "response message too big (" + to_string(out_len) + ">" + to_string(MAX_PACKET_SIZE + 4) + ")");
+        return false;
+    }
+
+    PooledBuffer out_buf(4 + outer.size() + inner.size());
+
+    out_buf[3] = out_len & 0xFF;
+    out_buf[2] = (out_len >> 8) & 0xFF;
+    out_buf[1] = (out_len >> 16) & 0xFF;
+    out_buf[0] = (out_len >> 24) & 0xFF;
+
+    memcpy(out_buf.data() + 4, outer.data(), outer.size());
+    memcpy(out_buf.data() + 4 + outer.size(), inner.data(), inner.size());
+
+    logger->log(id, "queueing file response with size: " + to_string(out_len) + " (" + to_string(len) + " from file)");
+
+    io.queue(std::move(out_buf));
+    io.queueFile(std::move(file), (off_t) offset, len);
+
+    return true;
+}
+
+// integrity is checked by client against stored file hash, sent with the first chunk
+bool Client::sendFileChunkZeroCopy(bool withHash) {
+    std::shared_ptr<FileHandle> file;
+    uint64_t offset;
+    uint32_t len;
+    string hash = u.getCurrentOutFileMetadata().hash;
+
+    if(!u.getFileSegment(ZERO_COPY_CHUNK_SIZE, file, offset, len)) {
+        return false;
+    }
+
+    ServerResponse res;
+    res.set_type(ResponseType::SRV_DATA);
+
+    Param* p = res.add_params();
+    p->set_paramid("offset");
+    p->set_iparamval((int64_t) offset);
+
+    if(withHash) {
+        p = res.add_params();
+        p->set_paramid("file_hash");
+        p->set_bparamval(hash);
+    }
+
+    return sendFileSegment(res, file, offset, len);
+}
+
+// sends next chunk of current download, streamed chunks carry their offset
+bool Client::sendFileChunk(bool first, bool withOffset) {
+    if (zeroCopyDownload) {
+        return sendFileChunkZeroCopy(first);
+    }
+
+    uint64_t offset = u.getCurrentOutFileMetadata().lastValid;
+    string data;
+
+    if (!u.getFileChunk(data)) {
+        return false;
+    }
+
+    ServerResponse res;
+    res.set_type(ResponseType::SRV_DATA);
+    res.set_data(data);
+
+    if (withOffset) {
+        Param* p = res.add_params();
+        p->set_paramid("offset");
+        p->set_iparamval((int64_t) offset);
+    }
+
+    sendServerResponse(&res);
+    return true;
+}
+
+// out_len is set also when message is too big, out_buf is then left empty
+bool Client::encodeMessage(HashAlgorithm hashAlgorithm, EncryptionAlgorithm encryptionAlgorithm, const uint8_t in_buf[],
+                           uint32_t len, PooledBuffer& out_buf, uint32_t& out_len) {
     EncodedMessage msg;
 
     uint8_t* hash = nullptr;
     uint16_t hash_len;
     uint8_t* data = nullptr;
     uint32_t size = 0;
-    uint8_t* out_buf = nullptr;
-    uint32_t out_len = 0;
 
-    calculateHash(getHashAlgorithm(), in_buf, len, &hash, &hash_len);
+    calculateHash(hashAlgorithm, in_buf, len, &hash, &hash_len);
 
-    encrypt(getEncryptionAlgorithm(), in_buf, len, &data, &size);
+    encrypt(encryptionAlgorithm, in_buf, len, &data, &size);
 
     msg.set_hash((char*)hash, hash_len);
     msg.set_datasize(len);
     msg.set_data((char*)data, size);
     msg.set_type(MessageType::SERVER_RESPONSE);
-    msg.set_hashalgorithm(getHashAlgorithm());
+    msg.set_hashalgorithm(hashAlgorithm);
+
+    delete hash;
+    delete data;
 
     out_len = msg.ByteSize() + 4;
 
     if(out_len > MAX_PACKET_SIZE - 4) {
-        logger->warn(id, "response message too big (" + to_string(out_len) + ">" + to_string(MAX_PACKET_SIZE + 4) + ")");
-        delete hash;
-        delete data;
         return false;
     }
 
-    out_buf = new uint8_t[out_len];
-
-    msg.SerializeToArray(out_buf + 4, out_len - 4);
+    out_buf.resize(out_len);
 
-    logger->log(id, "sending response with size: " + to_string(out_len) + " (" + to_string(out_len-4) + "+4)");
+    msg.SerializeToArray(out_buf.data() + 4, out_len - 4);
 
     out_buf[3] = out_len & 0xFF;
     out_buf[2] = (out_len >> 8) & 0xFF;
     out_buf[1] = (out_len >> 16) & 0xFF;
     out_buf[0] = (out_len >> 24) & 0xFF;
 
-    if(sendNBytes(out_len, out_buf)) {
-        logger->log(id, "response sent successfully");
-        delete hash;
-        delete data;
+    return true;
+}
+
+bool Client::encodeResponse(const ServerResponse& res, HashAlgorithm hashAlgorithm, EncryptionAlgorithm encryptionAlgorithm,
+                            PooledBuffer& out_buf) {
+    PooledBuffer data(res.ByteSize());
+    res.SerializeToArray(data.data(), (int) data.size());
+
+    uint32_t out_len;
+
+    return encodeMessage(hashAlgorithm, encryptionAlgorithm, data.data(), (uint32_t) data.size(), out_buf, out_len);
+}
+
+bool Client::prepareDataToSend(uint8_t in_buf[], uint32_t len) {
+    PooledBuffer out_buf;
+    uint32_t out_len;
+
+    if(!encodeMessage(getHashAlgorithm(), getEncryptionAlgorithm(), in_buf, len, out_buf, out_len)) {
+        logger->warn(id, "response message too big (" + to_string(out_len) + ">" + to_string(MAX_PACKET_SIZE + 4) + ")");
+        return false;
+    }
+
+    logger->log(id, "queueing response with size: " + to_string(out_buf.size()) + " (" + to_string(out_buf.size()-4) + "+4)");
+
+    // sent together with other responses to this batch of frames
+    io.queue(std::move(out_buf));
+
+    return true;
+}
+
+bool Client::processInput() {
+    PooledBuffer frame;
+    uint32_t size;
+    IOStatus status;
+
+    while ((status = io.nextFrame(frame, size)) == IO_OK) {
+        logger->log(id, "got all data (" + to_string(size) + ")");
+
+        queuedFrames.emplace_back(std::move(frame));
+    }
+
+    if (status == IO_ERROR) {
+        if (size > MAX_PACKET_SIZE) {
+            logger->err(id, "incoming message too big (" + to_string(size) + ">" + to_string(MAX_PACKET_SIZE) + ")");
+        } else {
+            logger->err(id, "incoming message has invalid size (" + to_string(size) + ")");
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool Client::handleReadStatus(IOStatus status) {
+    if (status == IO_CLOSED) {
+        logger->info(id, "no new data, closing");
+        return false;
+    }
+
+    if (status == IO_ERROR) {
+        logger->err(id, "error while reading from socket", errno);
+        return false;
+    }
+
+    if (status == IO_AGAIN) {
         return true;
     }
 
-    logger->warn(id, "response not sent successfully");
-    delete hash;
-    delete data;
-    return false;
+    return processInput();
 }
 
-bool Client::getMessage() {
-    uint8_t msg_buf[MAX_PACKET_SIZE];
-    uint8_t size_buf[4];
-    bool lastReason;
+// reads available data, complete frames are queued for processQueuedFrames
+bool Client::onReadable() {
+    IOStatus status;
+
+    do {
+        status = io.readSome();
+
+        if (!handleReadStatus(status)) {
+            return false;
+        }
+    } while (status == IO_OK && io.mayHaveMore() && queuedFrames.empty() && !(*should_exit));
 
-    if(!getNBytes(4, size_buf, lastReason)) {
-        if(!(*should_exit) && lastReason == R_ERROR)
-            logger->warn(id, "connection error (size)");
+    return true;
+}
+
+bool Client::onWritable() {
+    if (io.flush() == IO_ERROR) {
+        logger->err(id, "error while writing to socket", errno);
         return false;
     }
 
-    uint32_t size = parseSize(size_buf);
+    return true;
+}
+
+// used by reactors submitting reads themselves (io_uring), err is errno of failed read
+bool Client::onReceived(ssize_t received, size_t requested, int err) {
+    errno = err;
+    return handleReadStatus(io.completeRead(received, requested, err));
+}
 
-    if(size > MAX_PACKET_SIZE) {
-        logger->err(id, "incoming message too big (" + to_string(size) + ">" + to_string(MAX_PACKET_SIZE) + ")");
+bool Client::onSent(ssize_t sent, int err) {
+    if (sent < 0 && err != EAGAIN && err != EINTR) {
+        errno = err;
+        logger->err(id, "error while writing to socket", errno);
         return false;
     }
 
-    if(!getNBytes(size - 4, msg_buf, lastReason)) {
-        if(!(*should_exit) && lastReason == R_ERROR)
-            logger->err(id, "connection error while getting message body");
+    if (sent > 0) {
+        io.completeWrite((size_t) sent);
+    }
+
+    return true;
+}
+
+// runs on worker thread, responses for whole batch are sent together
+bool Client::processQueuedFrames() {
+    while (!queuedFrames.empty() && !(*should_exit)) {
+        PooledBuffer frame = std::move(queuedFrames.front());
+        queuedFrames.pop_front();
+
+        processMessage(frame.data(), (int) frame.size());
+    }
+
+    queuedFrames.clear();
+
+    // one cumulative ack for pipelined chunks of the whole batch
+    if (unackedChunks > 0) {
+        sendUploadAck();
+    }
+
+    pushStreamChunks();
+
+    return onWritable();
+}
+
+void Client::sendUploadAck() {
+    ServerResponse res;
+    res.set_type(ResponseType::OK);
+
+    Param* p = res.add_params();
+    p->set_paramid("last_valid");
+    p->set_iparamval((int64_t) u.getCurrentInFileMetadata().lastValid);
+
+    unackedChunks = 0;
+    sendServerResponse(&res);
+}
+
+// FILES response with one page of directory, next holds continuation token (last name sent) or is empty after last page
+// page is also cut short when it would not fit into one message
+bool Client::sendFilesPage(const string& path, const string& after, uint32_t pageSize, string& next) {
+    vector<UFile> files;
+
+    // one more file tells whether there is next page
+    if(!u.listFilesinPath(path, files, after, pageSize + 1)) {
         return false;
     }
 
-    logger->log(id, "got all data (" + to_string(size) + ")");
+    ServerResponse res;
+    res.set_type(ResponseType::FILES);
+    next.clear();
+
+    uint32_t budget = MAX_PACKET_SIZE / 2;
+    uint32_t used = 0;
+    size_t count = 0;
+
+    for(auto &&file: files) {
+        if(count == pageSize || (count > 0 && used + file.filename.size() + file.owner_name.size() + file.hash.size() + 64 > budget)) {
+            next = files[count - 1].filename;
+            break;
+        }
+
+        File *tmp_file = res.add_filelist();
+        tmp_file->set_filename(file.filename);
+        tmp_file->set_filetype(file.type == FILE_REGULAR ? FileType::FILE : FileType::DIRECTORY);
+        tmp_file->set_size(file.size);
+        tmp_file->set_hash(file.hash);
+        tmp_file->set_owner(file.owner_name);
+        tmp_file->set_creationdate(file.creation_date);
+        tmp_file->set_isshared(file.isShared);
+
+        used += (uint32_t) tmp_file->ByteSize() + 4;
+        count++;
+    }
 
-    processMessage(msg_buf, size);
+    if(!next.empty()) {
+        Param* p = res.add_params();
+        p->set_paramid("continuation");
+        p->set_bparamval(next);
+    }
 
+    sendServerResponse(&res);
     return true;
 }
 
-void Client::loop() {
+// continues streaming download while client gives credit, output is filled only up to high water
+// streamed directory listing is continued the same way
+void Client::pushStreamChunks() {
+    while (listStream && io.pendingBytes() < STREAM_HIGH_WATER && !(*should_exit)) {
+        string next;
+
+        if (!sendFilesPage(listPath, listAfter, listPageSize, next)) {
+            ServerResponse res;
+            resError(res, "Internal error occured", "was listing files, but internal error occured");
+            sendServerResponse(&res);
+            next.clear();
+        }
 
-    while(!(*should_exit)) {
-        if (!getMessage()) {
+        listAfter = next;
+        listStream = !next.empty();
+    }
+
+    while (streamCredit > 0 && io.pendingBytes() < STREAM_HIGH_WATER && !(*should_exit)) {
+        if (!u.isCurrentOutFileValid()) {
+            streamCredit = 0;
+            break;
+        }
+
+        if (!sendFileChunk(false, true)) {
+            ServerResponse res;
+            resError(res, "Error occured", "was streaming file, but error occured");
+            sendServerResponse(&res);
+            streamCredit = 0;
             break;
         }
+
+        streamCredit--;
     }
-}
\ No newline at end of file
+}
+
+// used when worker pool is saturated
+void Client::rejectQueuedFrames() {
+    logger->warn(id, "server overloaded, rejecting " + to_string(queuedFrames.size()) + " messages");
+
+    for (size_t i=0; i<queuedFrames.size(); i++) {
+        ServerResponse res;
+        resError(res, "Server overloaded, try again later", "was rejected, server overloaded");
+        sendServerResponse(&res);
+    }
+
+    queuedFrames.clear();
+}
@@ -5,9 +5,16 @@
 #include "utils.h"
 #include "Logger.h"
 #include "User.h"
+#include "FramedIO.h"
 
-#define R_DISCONNECT true
-#define R_ERROR false
+#define UPLOAD_MAX_WINDOW 256
+
+// streaming download refills output when it drops below low water, up to high water
+#define STREAM_LOW_WATER (1024*1024)
+#define STREAM_HIGH_WATER (4*1024*1024)
+
+// most files in one page of LIST_FILES, also page size of streamed listing when client doesn't set it
+#define LIST_PAGE_MAX 1000
 
 using namespace std;
 using namespace StorageCloud;
@@ -22,25 +29,64 @@ private:
     std::string id;
     User u = User(UserManager::getInstance());
     string sessionId;
+    FramedIO io;
+    std::deque<PooledBuffer> queuedFrames;
+    // current download sends file body with sendfile, negotiated by DOWNLOAD "zero_copy" param
+    bool zeroCopyDownload = false;
+    // chunks of current download client allowed to be pushed without asking (DOWNLOAD "window", C_DOWNLOAD "credit")
+    uint64_t streamCredit = 0;
+    // chunks client keeps in flight while uploading (METADATA "window"), 0 - every USR_DATA is acked
+    uint32_t uploadWindow = 0;
+    uint32_t unackedChunks = 0;
+    // after failed chunk rest of the window is dropped, client resumes from reported offset
+    bool uploadFailed = false;
+    // chunks carry their offset and may come in any order, also over other connections (METADATA "parallel")
+    bool parallelUpload = false;
+    // directory listed page by page after the first page (LIST_FILES "stream"), listAfter is the last name sent
+    bool listStream = false;
+    string listPath;
+    string listAfter;
+    uint32_t listPageSize = 0;
 
     HashAlgorithm getHashAlgorithm();
     EncryptionAlgorithm getEncryptionAlgorithm();
     void setEncryptionAlgorithm(EncryptionAlgorithm);
-    bool getNBytes(int, uint8_t*, bool&);
-    bool sendNBytes(int, uint8_t*);
-    bool processMessage(uint8_t*, int);
-    bool parseMessage(uint8_t*, int, MessageType*, uint8_t**, uint32_t*);
+    bool processInput();
+    bool processMessage(const uint8_t*, int);
+    bool parseMessage(const uint8_t*, int, MessageType*, uint8_t**, uint32_t*);
     bool processCommand(Command*);
     bool processHandshake(Handshake*);
     bool sendServerResponse(const ServerResponse*);
     bool prepareDataToSend(uint8_t*, uint32_t);
-    bool getMessage();
+    bool sendFileSegment(const ServerResponse&, std::shared_ptr<FileHandle>, uint64_t, uint32_t);
+    bool sendFileChunkZeroCopy(bool);
+    bool sendFileChunk(bool, bool);
+    void sendUploadAck();
+    bool sendFilesPage(const string&, const string&, uint32_t, string&);
+    static bool encodeMessage(HashAlgorithm, EncryptionAlgorithm, const uint8_t*, uint32_t, PooledBuffer&, uint32_t&);
 
     void resError(ServerResponse&, string&&, string&&);
+    bool handleReadStatus(IOStatus);
 
 public:
     Client(int, connection*, bool*, Logger*);
-    void loop();
+    ~Client();
+    bool onReadable();
+    bool onWritable();
+    int readBuffers(struct iovec* iov, size_t& requested) { return io.readBuffers(iov, requested); };
+    bool onReceived(ssize_t, size_t, int);
+    int writeBuffers(struct iovec* iov, int max) { return io.writeBuffers(iov, max); };
+    bool frontFile(int& fd, off_t& offset, size_t& len) { return io.frontFile(fd, offset, len); };
+    void setFilesSentByReactor(bool v) { io.setFilesSentByReactor(v); };
+    bool onSent(ssize_t, int);
+    bool hasQueuedFrames() { return !queuedFrames.empty(); };
+    bool hasStreamWork() { return (streamCredit > 0 || listStream) && io.pendingBytes() < STREAM_LOW_WATER; };
+    bool hasWork() { return hasQueuedFrames() || hasStreamWork(); };
+    bool processQueuedFrames();
+    void rejectQueuedFrames();
+    void pushStreamChunks();
+    static bool encodeResponse(const ServerResponse&, HashAlgorithm, EncryptionAlgorithm, PooledBuffer&);
+    bool hasPendingOutput() { return io.hasPendingOutput(); };
 };
 
 #endif //SERVER_CLIENT_H
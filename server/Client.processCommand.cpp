@@ -161,13 +161,54 @@ bool Client::processCommand(Command* cmd) {
 
         sendServerResponse(&res);
     } else if (cmd->type() == CommandType::LIST_FILES) {
+        bool sent = false;
+
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to list files, but was not logged in");
         } else {
-            if(cmd->params_size() == 1 && cmd->params(0).paramid() == "path") {
+            string path, after;
+            uint32_t pageSize = 0;
+            bool stream = false;
+            bool hasPath = false;
+
+            for(auto& param: cmd->params()) {
+                if(param.paramid() == "path") {
+                    path = param.sparamval();
+                    hasPath = true;
+                } else if(param.paramid() == "page_size" && param.iparamval() > 0) {
+                    pageSize = (uint32_t) std::min<int64_t>(param.iparamval(), LIST_PAGE_MAX);
+                } else if(param.paramid() == "continuation") {
+                    after = param.bparamval();
+                } else if(param.paramid() == "stream") {
+                    stream = param.iparamval() != 0;
+                }
+            }
+
+            // new listing replaces one still being streamed
+            listStream = false;
+
+            if(hasPath && (stream || pageSize > 0 || !after.empty())) {
+                string next;
+
+                if(pageSize == 0) {
+                    pageSize = LIST_PAGE_MAX;
+                }
+
+                sent = sendFilesPage(path, after, pageSize, next);
+
+                if(!sent) {
+                    resError(res, "Internal error occured", "tried to list files, but internal error occured");
+                } else if(stream && !next.empty()) {
+                    // rest of pages is pushed by pushStreamChunks after this batch of commands
+                    listStream = true;
+                    listPath = path;
+                    listAfter = next;
+                    listPageSize = pageSize;
+                }
+            } else if(hasPath) {
                 vector<UFile> files;
 
-                if(!u.listFilesinPath(cmd->params(0).sparamval(), files)) {
+                if(!u.listFilesinPath(path, files)) {
                     resError(res, "Internal error occured", "tried to list files, but internal error occured");
                 } else {
 
@@ -190,17 +231,25 @@ bool Client::processCommand(Command* cmd) {
 
         }
 
-        sendServerResponse(&res);
+        if(!sent) {
+            sendServerResponse(&res);
+        }
     } else if (cmd->type() == CommandType::METADATA) {
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to add metadata, but was not logged in");
         } else {
             string path, hash;
             uint64_t size = 0;
+            uint64_t window = 0;
+            bool parallel = false;
             uint8_t validFields = 0;
 
             for(auto& param: cmd->params()) {
-                if(param.paramid() == "target_file_path") {
+                if(param.paramid() == "window" && param.iparamval() > 0) {
+                    window = (uint64_t) param.iparamval();
+                } else if(param.paramid() == "parallel") {
+                    parallel = param.iparamval() > 0;
+                } else if(param.paramid() == "target_file_path") {
                     path = param.sparamval();
                     validFields++;
                 } else if(param.paramid() == "file_checksum") {
@@ -229,7 +278,50 @@ bool Client::processCommand(Command* cmd) {
 
                 uint8_t wyn = u.addFile(file);
 
-                if(wyn == ADD_FILE_OK) {
+                uploadWindow = (uint32_t) min(window, (uint64_t) UPLOAD_MAX_WINDOW);
+                unackedChunks = 0;
+                uploadFailed = false;
+                parallelUpload = false;
+
+                if(wyn == ADD_FILE_OK || wyn == ADD_FILE_CONTINUE_OK) {
+                    if(parallel && size > 0) {
+                        parallelUpload = u.startParallelUpload();
+                        if(!parallelUpload) {
+                            wyn = ADD_FILE_SEQUENTIAL;
+                        }
+                    } else if(wyn == ADD_FILE_CONTINUE_OK && u.isParallelUpload()) {
+                        wyn = ADD_FILE_PARALLEL;
+                    } else if(wyn == ADD_FILE_CONTINUE_OK && !u.reconcileUpload()) {
+                        wyn = ADD_FILE_INTERNAL_ERROR;
+                    }
+
+                    // file was accepted by addFile, but can't be uploaded this way
+                    if(wyn != ADD_FILE_OK && wyn != ADD_FILE_CONTINUE_OK) {
+                        u.endUpload();
+                    }
+                }
+
+                if(uploadWindow > 0 && (wyn == ADD_FILE_OK || wyn == ADD_FILE_CONTINUE_OK)) {
+                    Param* tmp = res.add_params();
+                    tmp->set_paramid("window");
+                    tmp->set_iparamval(uploadWindow);
+                }
+
+                if(parallelUpload) {
+                    // client sends only blocks missing in the bitmap
+                    res.set_type(ResponseType::CAN_SEND);
+                    string ranges;
+                    u.getReceivedRanges(ranges);
+                    Param* tmp = res.add_params();
+                    tmp->set_paramid("starting_chunk");
+                    tmp->set_iparamval(u.getCurrentInFileMetadata().lastValid);
+                    tmp = res.add_params();
+                    tmp->set_paramid("block_size");
+                    tmp->set_iparamval(PARALLEL_BLOCK_SIZE);
+                    tmp = res.add_params();
+                    tmp->set_paramid("ranges");
+                    tmp->set_bparamval(ranges);
+                } else if(wyn == ADD_FILE_OK) {
                     res.set_type(ResponseType::CAN_SEND);
                     Param* tmp = res.add_params();
                     tmp->set_paramid("starting_chunk");
@@ -256,6 +348,10 @@ bool Client::processCommand(Command* cmd) {
                         resError(res, "File already exists", "tried to add metadata, but filename already exists");
                     } else if(wyn == ADD_FILE_NO_SPACE) {
                         resError(res, "Not enough space left", "tried to add metadata, but doesn't have enough free space");
+                    } else if(wyn == ADD_FILE_SEQUENTIAL) {
+                        resError(res, "File upload was started sequentially", "tried to add metadata in parallel mode, but upload was started sequentially");
+                    } else if(wyn == ADD_FILE_PARALLEL) {
+                        resError(res, "File upload was started in parallel mode", "tried to add metadata, but upload was started in parallel mode");
                     } else {
                         resError(res, "Unknown error", "tried to add metadata, but unknown error occured");
                     }
@@ -301,15 +397,78 @@ bool Client::processCommand(Command* cmd) {
 
         sendServerResponse(&res);
     } else if (cmd->type() == CommandType::USR_DATA) {
+        // pipelined chunks are acknowledged cumulatively, errors are sent right away
+        bool acked = false;
+
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to put data, but was not logged in");
+        } else if(uploadWindow > 0 && uploadFailed) {
+            acked = true;
+        } else if(parallelUpload) {
+            // every chunk is acknowledged with its offset, so it doesn't matter which connection it came from
+            const string* data = nullptr;
+            int64_t offset = -1;
+
+            for(auto& param: cmd->params()) {
+                if(param.paramid() == "data") {
+                    data = &param.bparamval();
+                } else if(param.paramid() == "offset") {
+                    offset = param.iparamval();
+                }
+            }
+
+            if(data != nullptr && !data->empty() && offset >= 0) {
+                uint8_t wyn = u.addFileRange((uint64_t) offset, *data);
+
+                if(wyn == ADD_FILE_OK) {
+                    res.set_type(ResponseType::OK);
+                    if(u.getCurrentInFileMetadata().isValid) {
+                        logger->log(id, "user " + username + ": adding file accomplished");
+                    }
+                } else if(wyn == ADD_FILE_WRONG_RANGE) {
+                    resError(res, "Wrong block range", "tried to put data, but chunk was not aligned to blocks");
+                } else if(wyn == ADD_FILE_NO_SPACE) {
+                    resError(res, "Not enough space left", "tried to put data, but doesn't have enough free space");
+                } else if(wyn == ADD_FILE_NOT_STARTED) {
+                    resError(res, "No upload in progress", "tried to put data, but there is no upload in progress");
+                } else if(wyn == ADD_FILE_WRONG_HASH) {
+                    resError(res, "Wrong file checksum", "tried to put data, but uploaded file has wrong checksum");
+                } else {
+                    resError(res, "Error occured", "tried to put data, but error occured");
+                }
+
+                Param* tmp = res.add_params();
+                tmp->set_paramid("offset");
+                tmp->set_iparamval(offset);
+            } else {
+                resError(res, "Wrong command format", "tried to put data, but command format was wrong");
+            }
         } else {
             if(cmd->params_size() == 1 && cmd->params(0).paramid() == "data" && cmd->params(0).bparamval().length()) {
-                if(u.addFileChunk(cmd->params(0).bparamval())) {
-                    if(u.getCurrentInFileMetadata().isValid) {
+                uint8_t wyn = u.addFileChunk(cmd->params(0).bparamval());
+
+                if(wyn == ADD_FILE_OK) {
+                    bool finished = u.getCurrentInFileMetadata().isValid;
+                    if(finished) {
                         logger->log(id, "user " + username + ": adding file accomplished");
                     }
-                    res.set_type(ResponseType::OK);
+                    if(uploadWindow > 0) {
+                        acked = true;
+                        unackedChunks++;
+                        if(finished || unackedChunks >= (uploadWindow + 1) / 2) {
+                            sendUploadAck();
+                        }
+                    } else {
+                        res.set_type(ResponseType::OK);
+                    }
+                } else if(wyn == ADD_FILE_NO_SPACE) {
+                    resError(res, "Not enough space left", "tried to put data, but doesn't have enough free space");
+                } else if(wyn == ADD_FILE_TOO_BIG) {
+                    resError(res, "Data exceeds declared file size", "tried to put data, but it exceeds declared file size");
+                } else if(wyn == ADD_FILE_NOT_STARTED) {
+                    resError(res, "No upload in progress", "tried to put data, but there is no upload in progress");
+                } else if(wyn == ADD_FILE_WRONG_HASH) {
+                    resError(res, "Wrong file checksum", "tried to put data, but uploaded file has wrong checksum");
                 } else {
                     resError(res, "Error occured", "tried to put data, but error occured");
                 }
@@ -317,9 +476,19 @@ bool Client::processCommand(Command* cmd) {
                 resError(res, "Wrong command format", "tried to put data, but command format was wrong");
             }
 
+            if(!acked && uploadWindow > 0) {
+                // tells where writing stopped, chunks already in flight are dropped
+                Param* tmp = res.add_params();
+                tmp->set_paramid("last_valid");
+                tmp->set_iparamval((int64_t) u.getCurrentInFileMetadata().lastValid);
+                uploadFailed = true;
+                unackedChunks = 0;
+            }
         }
 
-        sendServerResponse(&res);
+        if(!acked) {
+            sendServerResponse(&res);
+        }
     } else if (cmd->type() == CommandType::LIST_USERS) {
         if(!(u.isAdmin())) {
             resError(res, "Not enough permissions", "tried to list users, but was not logged as admin");
@@ -589,12 +758,16 @@ bool Client::processCommand(Command* cmd) {
 
         sendServerResponse(&res);
     }  else if (cmd->type() == CommandType::DOWNLOAD) {
+        bool sent = false;
+
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to download file, but was not logged in");
         } else {
             string filename;
             uint64_t startingChunk = 0;
+            uint64_t window = 0;
             uint8_t validFields = 0;
+            bool zeroCopy = false;
 
             for(auto& param: cmd->params()) {
                 if(param.paramid() == "file_path") {
@@ -603,14 +776,22 @@ bool Client::processCommand(Command* cmd) {
                 } else if(param.paramid() == "starting_chunk") {
                     startingChunk = (uint64_t) param.iparamval();
                     validFields++;
+                } else if(param.paramid() == "zero_copy") {
+                    zeroCopy = param.iparamval() != 0;
+                } else if(param.paramid() == "window" && param.iparamval() > 0) {
+                    window = (uint64_t) param.iparamval();
                 }
             }
 
+            // file body can't be sent untouched when it has to be encrypted
+            zeroCopyDownload = zeroCopy && getEncryptionAlgorithm() == EncryptionAlgorithm::NOENCRYPTION;
+            streamCredit = 0;
+
             if(validFields == 2 && !filename.empty()) {
-                string data;
-                if(u.initFileDownload(filename, startingChunk, data)) {
-                    res.set_type(ResponseType::SRV_DATA);
-                    res.set_data(data);
+                // starting_chunk is byte offset, so interrupted stream is resumed from last received byte
+                sent = u.openFileDownload(filename, startingChunk) && sendFileChunk(true, window > 0);
+                if(sent) {
+                    streamCredit = (window > 0) ? window - 1 : 0;
                 } else {
                     resError(res, "Error occured", "tried to download file " + filename + ", but error occured");
                 }
@@ -619,21 +800,39 @@ bool Client::processCommand(Command* cmd) {
             }
         }
 
-        sendServerResponse(&res);
+        if(!sent) {
+            sendServerResponse(&res);
+        }
     } else if (cmd->type() == CommandType::C_DOWNLOAD) {
+        bool sent = false;
+        uint64_t credit = 0;
+
+        for(auto& param: cmd->params()) {
+            if(param.paramid() == "credit" && param.iparamval() > 0) {
+                credit = (uint64_t) param.iparamval();
+            }
+        }
+
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to continue downloading file, but was not logged in");
-        } else {
-            string data;
-            if (u.getFileChunk(data)) {
-                res.set_type(ResponseType::SRV_DATA);
-                res.set_data(data);
+        } else if(credit > 0) {
+            // chunks are pushed by pushStreamChunks after this batch of commands
+            sent = u.isCurrentOutFileValid();
+            if(sent) {
+                streamCredit += credit;
             } else {
+                resError(res, "Error occured", "tried to continue streaming file, but there is no download in progress");
+            }
+        } else {
+            sent = sendFileChunk(false, false);
+            if(!sent) {
                 resError(res, "Error occured", "tried to continue downloading file, but error occured");
             }
         }
 
-        sendServerResponse(&res);
+        if(!sent) {
+            sendServerResponse(&res);
+        }
     } else if (cmd->type() == CommandType::SHARE) {
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to share file, but was not logged in");
@@ -748,12 +947,16 @@ bool Client::processCommand(Command* cmd) {
 
         sendServerResponse(&res);
     } else if (cmd->type() == CommandType::SHARED_DOWNLOAD) {
+        bool sent = false;
+
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to download shared file, but was not logged in");
         } else {
             string filename, hash, ownerUsername;
             uint64_t startingChunk = 0;
+            uint64_t window = 0;
             uint8_t validFields = 0;
+            bool zeroCopy = false;
 
             for(auto& param: cmd->params()) {
                 if(param.paramid() == "file_path") {
@@ -768,14 +971,21 @@ bool Client::processCommand(Command* cmd) {
                 } else if(param.paramid() == "hash") {
                     hash = param.sparamval();
                     validFields++;
+                } else if(param.paramid() == "zero_copy") {
+                    zeroCopy = param.iparamval() != 0;
+                } else if(param.paramid() == "window" && param.iparamval() > 0) {
+                    window = (uint64_t) param.iparamval();
                 }
             }
 
+            // popular shared files are served like own ones, so all readers share their page cache
+            zeroCopyDownload = zeroCopy && getEncryptionAlgorithm() == EncryptionAlgorithm::NOENCRYPTION;
+            streamCredit = 0;
+
             if(validFields == 4 && !filename.empty()) {
-                string data;
-                if(u.initSharedFileDownload(filename, ownerUsername, hash, startingChunk, data)) {
-                    res.set_type(ResponseType::SRV_DATA);
-                    res.set_data(data);
+                sent = u.openSharedFileDownload(filename, ownerUsername, hash, startingChunk) && sendFileChunk(true, window > 0);
+                if(sent) {
+                    streamCredit = (window > 0) ? window - 1 : 0;
                 } else {
                     resError(res, "Error occured", "tried to download shared file " + filename + ", but error occured");
                 }
@@ -784,7 +994,9 @@ bool Client::processCommand(Command* cmd) {
             }
         }
 
-        sendServerResponse(&res);
+        if(!sent) {
+            sendServerResponse(&res);
+        }
     } else if (cmd->type() == CommandType::CLEAR_CACHE) {
         if(!(u.isValid() && u.isAuthorized())) {
             resError(res, "You are not logged in", "tried to clear cache, but was not logged in");
@@ -0,0 +1,192 @@
+#include "ContentCache.h"
+#include "FileCache.h"
+
+#include <functional>
+
+using namespace std;
+
+mutex ContentCache::cache_mutex;
+map<string, ContentCache::Entry> ContentCache::entries;
+list<string> ContentCache::lru;
+size_t ContentCache::usedBytes = 0;
+uint8_t ContentCache::sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+uint64_t ContentCache::samples = 0;
+uint64_t ContentCache::hits = 0;
+uint64_t ContentCache::misses = 0;
+uint64_t ContentCache::rejected = 0;
+uint64_t ContentCache::evictions = 0;
+
+// returns contents when file is cached or popular enough to be loaded now, nullptr means it's read from disk
+// called once per download, not per chunk
+shared_ptr<const string> ContentCache::get(const string& key, const string& hash, const string& path, uint64_t size) {
+    if(size == 0 || size > CONTENT_CACHE_MAX_FILE) {
+        return nullptr;
+    }
+
+    {
+        lock_guard<mutex> lock(cache_mutex);
+
+        recordAccess(key);
+
+        auto it = entries.find(key);
+        if(it != entries.end() && it->second.hash == hash && it->second.content->size() == size) {
+            lru.splice(lru.begin(), lru, it->second.lruPos);
+            hits++;
+            return it->second.content;
+        }
+
+        misses++;
+
+        if(!admit(key, size)) {
+            rejected++;
+            return nullptr;
+        }
+    }
+
+    // loaded outside of the lock, admission is checked once more before inserting
+    auto content = load(key, path, size);
+
+    if(!content) {
+        return nullptr;
+    }
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto it = entries.find(key);
+    if(it != entries.end()) {
+        removeEntry(it);
+    }
+
+    if(!admit(key, size)) {
+        return content;
+    }
+
+    // victims chosen by admit are evicted here
+    while(usedBytes + size > CONTENT_CACHE_SIZE && !lru.empty()) {
+        removeEntry(entries.find(lru.back()));
+        evictions++;
+    }
+
+    lru.push_front(key);
+    entries[key] = Entry{content, hash, path, lru.begin()};
+    usedBytes += size;
+
+    return content;
+}
+
+size_t ContentCache::slot(const string& key, int row) {
+    size_t h = hash<string>()(key);
+    size_t h2 = (h * 0x9E3779B97F4A7C15ull) >> 32;
+    return (h + row * (h2 | 1)) & (SKETCH_WIDTH - 1);
+}
+
+// expects cache_mutex locked, 4-bit saturating counters
+void ContentCache::recordAccess(const string& key) {
+    for(int r=0; r<SKETCH_DEPTH; r++) {
+        uint8_t& c = sketch[r][slot(key, r)];
+        if(c < 15) {
+            c++;
+        }
+    }
+
+    if(++samples >= SKETCH_SAMPLES) {
+        for(int r=0; r<SKETCH_DEPTH; r++) {
+            for(int i=0; i<SKETCH_WIDTH; i++) {
+                sketch[r][i] >>= 1;
+            }
+        }
+        samples = 0;
+    }
+}
+
+// expects cache_mutex locked
+uint8_t ContentCache::frequency(const string& key) {
+    uint8_t f = 15;
+
+    for(int r=0; r<SKETCH_DEPTH; r++) {
+        f = min(f, sketch[r][slot(key, r)]);
+    }
+
+    return f;
+}
+
+// expects cache_mutex locked, candidate has to be more popular than every LRU entry it would replace
+bool ContentCache::admit(const string& key, size_t size) {
+    uint8_t f = frequency(key);
+
+    if(f < CONTENT_CACHE_MIN_FREQUENCY || size > CONTENT_CACHE_SIZE) {
+        return false;
+    }
+
+    size_t freed = 0;
+
+    for(auto it = lru.rbegin(); it != lru.rend() && usedBytes - freed + size > CONTENT_CACHE_SIZE; it++) {
+        if(frequency(*it) >= f) {
+            return false;
+        }
+        freed += entries[*it].content->size();
+    }
+
+    return true;
+}
+
+// expects cache_mutex locked, readers still holding contents keep them until they're done
+void ContentCache::removeEntry(map<string, Entry>::iterator it) {
+    usedBytes -= it->second.content->size();
+    lru.erase(it->second.lruPos);
+    entries.erase(it);
+}
+
+shared_ptr<const string> ContentCache::load(const string& key, const string& path, uint64_t size) {
+    auto handle = FileCache::acquire(key, path, false);
+
+    if(!handle) {
+        return nullptr;
+    }
+
+    auto content = make_shared<string>();
+    content->resize(size);
+
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = pread(handle->fd, &(*content)[done], size - done, done);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return nullptr;
+        }
+        done += n;
+    }
+
+    return content;
+}
+
+void ContentCache::invalidate(const string& key) {
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto it = entries.find(key);
+    if(it != entries.end()) {
+        removeEntry(it);
+    }
+}
+
+// drops contents of all files under given path (deleted directory or user home)
+void ContentCache::invalidatePath(const string& prefix) {
+    lock_guard<mutex> lock(cache_mutex);
+
+    for(auto it = entries.begin(); it != entries.end();) {
+        auto next = std::next(it);
+        const string& path = it->second.path;
+        if(path.compare(0, prefix.size(), prefix) == 0 && (path.size() == prefix.size() || path[prefix.size()] == '/')) {
+            removeEntry(it);
+        }
+        it = next;
+    }
+}
+
+string ContentCache::stats() {
+    lock_guard<mutex> lock(cache_mutex);
+    return to_string(entries.size()) + " files, " + to_string(usedBytes / 1024) + "/" + to_string((size_t) CONTENT_CACHE_SIZE / 1024) + " KiB, "
+           + to_string(hits) + " hits, " + to_string(misses) + " misses, " + to_string(rejected) + " not admitted, " + to_string(evictions) + " evicted";
+}
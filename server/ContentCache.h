@@ -0,0 +1,53 @@
+#ifndef SERVER_CONTENTCACHE_H
+#define SERVER_CONTENTCACHE_H
+
+#include "main.h"
+
+#include <memory>
+
+#define SKETCH_WIDTH 4096
+#define SKETCH_DEPTH 4
+// counters are halved after this many recorded downloads, so old popularity fades
+#define SKETCH_SAMPLES (SKETCH_WIDTH * 8)
+// file is loaded to memory only after it was downloaded this many times recently
+#define CONTENT_CACHE_MIN_FREQUENCY 2
+
+// whole contents of popular (mostly shared) files, keyed by file id and checked against file hash
+// admission is TinyLFU-like: download frequency is counted in count-min sketch and new file
+// gets in only when it's more popular than LRU files it would push out, so one-off downloads
+// (or scans of many files) don't flush it
+class ContentCache {
+private:
+    struct Entry {
+        std::shared_ptr<const std::string> content;
+        std::string hash;
+        std::string path;
+        std::list<std::string>::iterator lruPos;
+    };
+
+    static std::mutex cache_mutex;
+    static std::map<std::string, Entry> entries;
+    static std::list<std::string> lru;
+    static size_t usedBytes;
+    static uint8_t sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+    static uint64_t samples;
+    static uint64_t hits;
+    static uint64_t misses;
+    static uint64_t rejected;
+    static uint64_t evictions;
+
+    static size_t slot(const std::string&, int);
+    static void recordAccess(const std::string&);
+    static uint8_t frequency(const std::string&);
+    static bool admit(const std::string&, size_t);
+    static void removeEntry(std::map<std::string, Entry>::iterator);
+    static std::shared_ptr<const std::string> load(const std::string&, const std::string&, uint64_t);
+
+public:
+    static std::shared_ptr<const std::string> get(const std::string&, const std::string&, const std::string&, uint64_t);
+    static void invalidate(const std::string&);
+    static void invalidatePath(const std::string&);
+    static std::string stats();
+};
+
+#endif //SERVER_CONTENTCACHE_H
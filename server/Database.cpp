@@ -1,59 +1,119 @@
 #include "Database.h"
+#include "MongoBackend.h"
+#include "EmbeddedBackend.h"
+#include "utils.h"
 
 #include <iostream>
 
-using namespace mongocxx;
 using namespace std;
 
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::make_document;
 using bsoncxx::builder::basic::sub_array;
 
 Database::Database(Logger* l) {
-    inst = new mongocxx::instance{};
-    client = new mongocxx::client{mongocxx::uri{DB_URI}};
     logger = l;
-    db = (*client)[DB_NAME];
-    connected = false;
 
-    try {
-        db.run_command(make_document(kvp("isMaster", 1)));
-        l->info(l_id, "connected to database");
-        connected = true;
-    } catch (const std::exception& ex) {
-        l->err(l_id, "error while connecting to database: " + string(ex.what()));
-    } catch (...) {
-        l->err(l_id, "error while connecting to database: unknown error");
+    if(DB_EMBEDDED) {
+        backend = new EmbeddedBackend(DB_EMBEDDED_DIR, l);
+    } else {
+        backend = new MongoBackend(DB_URI, DB_NAME, DB_POOL_SIZE, l);
+    }
+
+    connected = backend->connect();
+
+    if(connected) {
+        ensureSchema();
     }
 }
 
 Database::~Database() {
     logger->info(l_id, "closing database connection");
-    delete client;
-    delete inst;
+    delete backend;
 }
 
-bool Database::getField(string& colName, string& fieldName, bsoncxx::oid id, bsoncxx::document::element& el) {
-    mongocxx::options::find opts{};
-    opts.projection(make_document(kvp(fieldName, 1), kvp("_id", 0)));
-
+// creating index which already exists is a no-op, failure is only logged so server can still run without it
+bool Database::ensureIndex(string&& colName, bsoncxx::document::value&& keys, bsoncxx::document::value&& options) {
     try {
-        auto cursor = db[colName].find(make_document(kvp("_id", id)), opts);
+        backend->createIndex(colName, keys.view(), options.view());
+    } catch (const std::exception& ex) {
+        logger->warn(l_id, "couldn't create index on " + colName + ": " + string(ex.what()));
+        return false;
+    } catch (...) {
+        logger->warn(l_id, "couldn't create index on " + colName + ": unknown error");
+        return false;
+    }
 
-        auto doc_i = cursor.begin();
+    return true;
+}
 
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getField got empty resultSet");
-            return false;
-        }
+// indexes used by file listing, path deletion, sharing and garbage collector
+// files stored before parentDir existed get it here, before any connection is served
+void Database::ensureSchema() {
+    vector<pair<bsoncxx::oid, string> > missing;
+
+    try {
+        FindOptions opts;
+        opts.projection = make_document(kvp("_id", 1), kvp("filename", 1));
 
-        auto val = doc_i->begin();
+        backend->find("files", make_document(kvp("parentDir", make_document(kvp("$exists", false)))), opts,
+                      [&missing](const bsoncxx::document::view& doc_v) {
+            auto id = doc_v["_id"];
+            auto filename = doc_v["filename"];
+
+            if(id.type() == bsoncxx::type::k_oid && filename.type() == bsoncxx::type::k_utf8) {
+                missing.emplace_back(id.get_oid().value, bsoncxx::string::to_string(filename.get_utf8().value));
+            }
 
-        if (bsoncxx::string::to_string(val->key()) == fieldName) {
-            el = *val;
             return true;
-        }
+        });
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while looking for files without parentDir: " + string(ex.what()));
+    } catch (...) {
+        logger->err(l_id, "error while looking for files without parentDir: unknown error");
+    }
 
-        logger->log(l_id, "getField got invalid field");
-        return false;
+    for(auto& file: missing) {
+        setField("files", "parentDir", file.first, bsoncxx::types::value{bsoncxx::types::b_utf8{parentDir(file.second)}});
+    }
+
+    if(!missing.empty()) {
+        logger->info(l_id, "added parentDir to " + to_string(missing.size()) + " files");
+    }
+
+    ensureIndex("files", make_document(kvp("owner", 1), kvp("filename", 1)), make_document(kvp("unique", true)));
+    ensureIndex("files", make_document(kvp("owner", 1), kvp("parentDir", 1), kvp("filename", 1)), make_document());
+    ensureIndex("files", make_document(kvp("sharedWith.userId", 1)), make_document());
+    ensureIndex("files", make_document(kvp("lastChunkTime", 1)), make_document(
+            kvp("partialFilterExpression", make_document(kvp("isValid", false)))
+    ));
+    ensureIndex("users", make_document(kvp("username", 1)), make_document(kvp("unique", true)));
+}
+
+string Database::stats() {
+    return backend->stats();
+}
+
+// field is passed to callback while the document holding it is still there
+bool Database::getField(string& colName, string& fieldName, bsoncxx::oid id, function<bool(const bsoncxx::document::element&)> onField) {
+    FindOptions opts;
+    opts.projection = make_document(kvp(fieldName, 1), kvp("_id", 0));
+
+    bool found = false;
+    bool res = false;
+
+    try {
+        backend->find(colName, make_document(kvp("_id", id)), opts, [&](const bsoncxx::document::view& doc_v) {
+            found = !doc_v.empty();
+
+            if(found && bsoncxx::string::to_string(doc_v.begin()->key()) == fieldName) {
+                res = onField(*doc_v.begin());
+            } else if(found) {
+                logger->log(l_id, "getField got invalid field");
+            }
+
+            return false;
+        });
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting field: " + string(ex.what()));
         return false;
@@ -61,83 +121,73 @@ bool Database::getField(string& colName, string& fieldName, bsoncxx::oid id, bso
         logger->err(l_id, "error while getting field: unknown error");
         return false;
     }
-}
 
-bool Database::getField(string&& colName, string&& fieldName, bsoncxx::oid id, bsoncxx::document::element& el) {
-    return getField(colName, fieldName, id, el);
+    if(!found) {
+        logger->log(l_id, "getField got empty resultSet");
+    }
+
+    return res;
 }
 
 bool Database::getField(string&& colName, string&& fieldName, bsoncxx::oid id, string& res) {
-    bsoncxx::document::element el;
-
-    if(getField(colName, fieldName, id, el)) {
-        if(el.type() == bsoncxx::type::k_utf8) {
-            res = bsoncxx::string::to_string(el.get_utf8().value);
-            return true;
-        } else {
+    return getField(colName, fieldName, id, [this, &res](const bsoncxx::document::element& el) {
+        if(el.type() != bsoncxx::type::k_utf8) {
             logger->log(l_id, "getField got invalid field type (should be k_utf8)");
+            return false;
         }
-    }
 
-    return false;
+        res = bsoncxx::string::to_string(el.get_utf8().value);
+        return true;
+    });
 }
 
 bool Database::getField(string&& colName, string&& fieldName, bsoncxx::oid id, int64_t& res) {
-    bsoncxx::document::element el;
-
-    if(getField(colName, fieldName, id, el)) {
-        if(el.type() == bsoncxx::type::k_int64) {
-            res = el.get_int64().value;
-            return true;
-        } else {
+    return getField(colName, fieldName, id, [this, &res](const bsoncxx::document::element& el) {
+        if(el.type() != bsoncxx::type::k_int64) {
             logger->log(l_id, "getField got invalid field type (should be k_int64)");
+            return false;
         }
-    }
 
-    return false;
+        res = el.get_int64().value;
+        return true;
+    });
 }
 
-bool Database::getField(string&& colName, string&& fieldName, bsoncxx::oid id, const uint8_t*& res, uint32_t& resSize) {
-    bsoncxx::document::element el;
-
-    if(getField(colName, fieldName, id, el)) {
-        if(el.type() == bsoncxx::type::k_binary) {
-            res = el.get_binary().bytes;
-            resSize = el.get_binary().size;
-            return true;
-        } else {
+// binary value is copied, it doesn't outlive the document otherwise
+bool Database::getField(string&& colName, string&& fieldName, bsoncxx::oid id, std::vector<uint8_t>& res) {
+    return getField(colName, fieldName, id, [this, &res](const bsoncxx::document::element& el) {
+        if(el.type() != bsoncxx::type::k_binary) {
             logger->log(l_id, "getField got invalid field type (should be k_binary)");
+            return false;
         }
-    }
 
-    return false;
+        auto bin = el.get_binary();
+        res.assign(bin.bytes, bin.bytes + bin.size);
+        return true;
+    });
 }
 
 bool Database::getField(string&& colName, string&& fieldToGetName, string&& idFieldName, bsoncxx::oid& id,
                         string&& fieldName, const string& fieldVal, int64_t& res) {
 
-    mongocxx::options::find opts{};
-    opts.projection(make_document(kvp("_id", 0), kvp(fieldToGetName, 1)));
+    FindOptions opts;
+    opts.projection = make_document(kvp("_id", 0), kvp(fieldToGetName, 1));
+    opts.limit = 1;
+
+    bool found = false;
+    bool valid = false;
 
     try {
-        auto cursor = db[colName].find(make_document(kvp(idFieldName, id), kvp(fieldName, fieldVal)), opts);
+        backend->find(colName, make_document(kvp(idFieldName, id), kvp(fieldName, fieldVal)), opts, [&](const bsoncxx::document::view& doc_v) {
+            found = !doc_v.empty();
 
-        auto doc_i = cursor.begin();
+            if (found && bsoncxx::string::to_string(doc_v.begin()->key()) == fieldToGetName && doc_v.begin()->type() == bsoncxx::type::k_int64) {
+                res = doc_v.begin()->get_int64().value;
+                valid = true;
+            }
 
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getField (2) got empty resultSet");
             return false;
-        }
-
-        auto val = doc_i->begin();
-
-        if (bsoncxx::string::to_string(val->key()) == fieldToGetName && val->type() == bsoncxx::type::k_int64) {
-            res = val->get_int64().value;
-            return true;
-        }
-
-        logger->log(l_id, "getField (2) got invalid field");
-        return false;
+        });
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting field (2): " + string(ex.what()));
         return false;
@@ -145,39 +195,37 @@ bool Database::getField(string&& colName, string&& fieldToGetName, string&& idFi
         logger->err(l_id, "error while getting field (2): unknown error");
         return false;
     }
+
+    if (!found) {
+        logger->log(l_id, "getField (2) got empty resultSet");
+    } else if (!valid) {
+        logger->log(l_id, "getField (2) got invalid field");
+    }
+
+    return valid;
 }
 
 bool Database::getFieldM(string&& colName, string&& fieldName, bsoncxx::document::value&& fDoc, std::vector<string>& res) {
-    auto doc = bsoncxx::builder::basic::document{};
-    doc.append(kvp("_id", 0));
-    doc.append(kvp(fieldName, 1));
+    FindOptions opts;
+    opts.projection = make_document(kvp("_id", 0), kvp(fieldName, 1));
 
-    mongocxx::options::find opts{};
-    opts.projection(doc.view());
+    bool notEmpty = false;
+    bool valid = true;
 
     try {
-        auto cursor = db[colName].find(fDoc.view(), opts);
-
-        bool notEmpty = false;
-
-        for (auto doc_v: cursor) {
+        backend->find(colName, fDoc.view(), opts, [&](const bsoncxx::document::view& doc_v) {
             notEmpty = true;
 
             auto obj = doc_v.begin();
 
             if (distance(obj, doc_v.end()) != 1) {
-                logger->log(l_id, "getFieldM got too much fields");
+                valid = false;
                 return false;
             }
 
             res.emplace_back(bsoncxx::string::to_string(obj->get_utf8().value));
-        }
-
-        if(!notEmpty) {
-            logger->log(l_id, "getFieldM got empty result");
-        }
-
-        return true;
+            return true;
+        });
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting field multiple times: " + string(ex.what()));
         return false;
@@ -185,66 +233,49 @@ bool Database::getFieldM(string&& colName, string&& fieldName, bsoncxx::document
         logger->err(l_id, "error while getting field multiple times: unknown error");
         return false;
     }
-}
-
-bool Database::getFieldMAdvanced(string&& colName, string&& fieldName, mongocxx::pipeline& stages, std::vector<string>& res) {
-    stages.project(make_document(kvp("_id", 0), kvp(fieldName, 1)));
 
-    try {
-        auto cursor = db[colName].aggregate(stages);
+    if(!valid) {
+        logger->log(l_id, "getFieldM got too much fields");
+        return false;
+    }
 
-        bool notEmpty = false;
+    if(!notEmpty) {
+        logger->log(l_id, "getFieldM got empty result");
+    }
 
-        for (auto doc_v: cursor) {
-            notEmpty = true;
+    return true;
+}
 
-            auto obj = doc_v.begin();
+// _id of the first document matching filter
+static bool findId(MetadataBackend* backend, const string& colName, const bsoncxx::document::view& filter, bsoncxx::oid& id, bool& found) {
+    FindOptions opts;
+    opts.projection = make_document(kvp("_id", 1));
+    opts.limit = 1;
 
-            if (distance(obj, doc_v.end()) != 1) {
-                logger->log(l_id, "getFieldMAdvanced got too much fields");
-                return false;
-            }
+    bool valid = false;
+    found = false;
 
-            res.emplace_back(bsoncxx::string::to_string(obj->get_utf8().value));
-        }
+    backend->find(colName, filter, opts, [&](const bsoncxx::document::view& doc_v) {
+        found = !doc_v.empty();
 
-        if(!notEmpty) {
-            logger->log(l_id, "getFieldMAdvanced got empty result");
+        if (found && doc_v.begin()->type() == bsoncxx::type::k_oid) {
+            id = doc_v.begin()->get_oid().value;
+            valid = true;
         }
 
-        return true;
-    } catch (const std::exception& ex) {
-        logger->err(l_id, "error while getting field multiple times advanced: " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger->err(l_id, "error while getting field multiple times advanced: unknown error");
         return false;
-    }
+    });
+
+    return valid;
 }
 
 bool Database::getId(string&& colName, string&& fieldName, const string& fieldValue, bsoncxx::oid& id) {
-    mongocxx::options::find opts{};
-    opts.projection(make_document(kvp("_id", 1)));
+    bool found;
 
     try {
-        auto cursor = db[colName].find(make_document(kvp(fieldName, fieldValue)), opts);
-
-        auto doc_i = cursor.begin();
-
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getId got empty resultSet");
-            return false;
-        }
-
-        auto val = doc_i->begin();
-
-        if (val->type() == bsoncxx::type::k_oid) {
-            id = val->get_oid().value;
+        if (findId(backend, colName, make_document(kvp(fieldName, fieldValue)), id, found)) {
             return true;
         }
-
-        logger->log(l_id, "getId got invalid field type (should be k_oid)");
-        return false;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting id: " + string(ex.what()));
         return false;
@@ -252,31 +283,18 @@ bool Database::getId(string&& colName, string&& fieldName, const string& fieldVa
         logger->err(l_id, "error while getting id: unknown error");
         return false;
     }
+
+    logger->log(l_id, found ? "getId got invalid field type (should be k_oid)" : "getId got empty resultSet");
+    return false;
 }
 
 bool Database::getIdById(string&& colName, string&& fieldName, const string& fieldValue, string&& idFieldName, bsoncxx::oid& id) {
-    mongocxx::options::find opts{};
-    opts.projection(make_document(kvp("_id", 1)));
+    bool found;
 
     try {
-        auto cursor = db[colName].find(make_document(kvp(idFieldName, id), kvp(fieldName, fieldValue)), opts);
-
-        auto doc_i = cursor.begin();
-
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getIdById got empty resultSet");
-            return false;
-        }
-
-        auto val = doc_i->begin();
-
-        if (val->type() == bsoncxx::type::k_oid) {
-            id = val->get_oid().value;
+        if (findId(backend, colName, make_document(kvp(idFieldName, id), kvp(fieldName, fieldValue)), id, found)) {
             return true;
         }
-
-        logger->log(l_id, "getIdById got invalid field type (should be k_oid)");
-        return false;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting id by id: " + string(ex.what()));
         return false;
@@ -284,31 +302,18 @@ bool Database::getIdById(string&& colName, string&& fieldName, const string& fie
         logger->err(l_id, "error while getting id by id: unknown error");
         return false;
     }
+
+    logger->log(l_id, found ? "getIdById got invalid field type (should be k_oid)" : "getIdById got empty resultSet");
+    return false;
 }
 
 bool Database::getIdByDoc(string&& colName, bsoncxx::document::value&& doc, bsoncxx::oid& res) {
-    mongocxx::options::find opts{};
-    opts.projection(make_document(kvp("_id", 1)));
+    bool found;
 
     try {
-        auto cursor = db[colName].find(doc.view(), opts);
-
-        auto doc_i = cursor.begin();
-
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getIdByDoc got empty resultSet");
-            return false;
-        }
-
-        auto val = doc_i->begin();
-
-        if (val->type() == bsoncxx::type::k_oid) {
-            res = val->get_oid().value;
+        if (findId(backend, colName, doc.view(), res, found)) {
             return true;
         }
-
-        logger->log(l_id, "getIdByDoc got invalid field type (should be k_oid)");
-        return false;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while getting id by doc: " + string(ex.what()));
         return false;
@@ -316,225 +321,15 @@ bool Database::getIdByDoc(string&& colName, bsoncxx::document::value&& doc, bson
         logger->err(l_id, "error while getting id by doc: unknown error");
         return false;
     }
-}
-
-// get fields values described in map
-bool Database::getFields(string&& colName, bsoncxx::oid id, map<string, bsoncxx::types::value>& elements) {
-    auto doc = bsoncxx::builder::basic::document{};
-    doc.append(kvp("_id", 0));
-
-    for(const auto &name: elements) {
-        doc.append(kvp(name.first, 1));
-    }
-
-    mongocxx::options::find opts{};
-    opts.projection(doc.view());
-
-    try {
-        auto cursor = db[colName].find(make_document(kvp("_id", id)), opts);
-
-        auto doc_i = cursor.begin();
-
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "getFields got empty resultSet");
-            return false;
-        }
-
-        if (distance(doc_i->begin(), doc_i->end()) != elements.size()) {
-            logger->log(l_id, "getFields got invalid element count");
-            return false;
-        }
-
-        elements.clear();
-
-        for(auto val: (*doc_i)) {
-            string key = bsoncxx::string::to_string(val.key());
-            if (key != "_id") {
-                elements.emplace(key, val.get_value());
-            }
-        }
-        return true;
-    } catch (const std::exception& ex) {
-        logger->err(l_id, "error while getting fields (1): " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger->err(l_id, "error while getting fields (1): unknown error");
-        return false;
-    }
-}
-
-bool Database::getFields(string&& colName, vector<string>& fields, map<bsoncxx::oid, map<string, bsoncxx::types::value> >& elements) {
-    auto doc = bsoncxx::builder::basic::document{};
-
-    for(const auto &name: fields) {
-        doc.append(kvp(name, 1));
-    }
-
-    mongocxx::options::find opts{};
-    opts.projection(doc.view());
-
-    try {
-        auto cursor = db[colName].find(make_document(), opts);
-
-        bool notEmpty = false;
-
-        for (auto doc_v: cursor) {
-            notEmpty = true;
-
-            //TODO check if id was passed as field
-            if ((distance(doc_v.begin(), doc_v.end()) != fields.size() + 1) && (distance(doc_v.begin(), doc_v.end()) != fields.size()) && (distance(doc_v.begin(), doc_v.end()) != fields.size() - 1)) {
-                logger->log(l_id, std::to_string(distance(doc_v.begin(), doc_v.end())) + " != " + std::to_string(fields.size()));
-                logger->log(l_id, "getFields got invalid fields count");
-                return false;
-            }
-
-            bsoncxx::document::element t_id = doc_v["_id"];
-
-            if (!t_id || t_id.type() != bsoncxx::type::k_oid) {
-                logger->log(l_id, "getFields got invalid _id field");
-                return false;
-            }
-
-            bsoncxx::oid id = t_id.get_oid().value;
-
-            elements.emplace(id, map<string, bsoncxx::types::value>{});
-
-            for (auto val: doc_v) {
-                string key = bsoncxx::string::to_string(val.key());
-                if (key != "_id") {
-                    elements[id].emplace(key, val.get_value());
-                }
-            }
-        }
-
-        if(!notEmpty) {
-            logger->log(l_id, "getFields got empty result");
-        }
-
-        return notEmpty;
-    } catch (const std::exception& ex) {
-        logger->err(l_id, "error while getting fields (2): " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger->err(l_id, "error while getting fields (2): unknown error");
-        return false;
-    }
-}
-
-bool Database::getFields(string&& colName, bsoncxx::document::value&& doc, const vector<string>& fields, map<string, map<string, bsoncxx::types::value> >& elements) {
-    auto odoc = bsoncxx::builder::basic::document{};
-
-    for(const auto &name: fields) {
-        odoc.append(kvp(name, 1));
-    }
-
-    mongocxx::options::find opts{};
-    opts.projection(odoc.view());
-
-    try {
-        auto cursor = db[colName].find(doc.view(), opts);
-
-        bool notEmpty = false;
-
-        for (auto doc_v: cursor) {
-            notEmpty = true;
-
-            //TODO check if id was passed as field
-            if (distance(doc_v.begin(), doc_v.end()) != fields.size() + 1) {
-                logger->log(l_id, "getFields got invalid fields count");
-                return false;
-            }
-
-            bsoncxx::document::element t_id = doc_v["filename"];
-
-            if (!t_id || t_id.type() != bsoncxx::type::k_utf8) {
-                logger->log(l_id, "getFields got invalid filename field");
-                return false;
-            }
-
-            string id = bsoncxx::string::to_string(t_id.get_utf8().value);
-
-            elements.emplace(id, map<string, bsoncxx::types::value>{});
-
-            for (auto val: doc_v) {
-                string key = bsoncxx::string::to_string(val.key());
-                elements[id].emplace(key, val.get_value());
-            }
-        }
-
-        if(!notEmpty) {
-            logger->log(l_id, "getFields got empty result");
-        }
-
-        return notEmpty;
-    } catch (const std::exception& ex) {
-        logger->err(l_id, "error while getting fields (3): " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger->err(l_id, "error while getting fields (3): unknown error");
-        return false;
-    }
-}
-
-bool Database::getFieldsAdvanced(string&& colName, mongocxx::pipeline& stages, vector<string>& fields, map<string, map<string, bsoncxx::types::value> >& elements) {
-    auto odoc = bsoncxx::builder::basic::document{};
-
-    for(const auto &name: fields) {
-        odoc.append(kvp(name, 1));
-    }
-
-    stages.project(odoc.view());
-
-    try {
-        auto cursor = db[colName].aggregate(stages);
-
-        bool notEmpty = false;
 
-        for (auto doc_v: cursor) {
-            notEmpty = true;
-
-            //TODO check if id was passed as field
-            if ((distance(doc_v.begin(), doc_v.end()) != fields.size() - 1) && (distance(doc_v.begin(), doc_v.end()) != fields.size())) {
-                logger->log(l_id, "getFieldsAdvanced got invalid fields count");
-                logger->log(l_id, std::to_string(distance(doc_v.begin(), doc_v.end())) + " != " + std::to_string(fields.size()));
-                return false;
-            }
-
-            bsoncxx::document::element t_id = doc_v["filename"];
-
-            if (!t_id || t_id.type() != bsoncxx::type::k_utf8) {
-                logger->log(l_id, "getFieldsAdvanced got invalid filename field");
-                return false;
-            }
-
-            string id = bsoncxx::string::to_string(t_id.get_utf8().value);
-
-            elements.emplace(id, map<string, bsoncxx::types::value>{});
-
-            for (bsoncxx::v_noabi::document::element val: doc_v) {
-                string key = bsoncxx::string::to_string(val.key());
-                elements[id].emplace(key, val.get_value());
-            }
-        }
-
-        if(!notEmpty) {
-            logger->log(l_id, "getFieldsAdvanced got empty result");
-        }
-
-        return true;
-    } catch (const std::exception& ex) {
-        logger->err(l_id, "error while getting fields (4): " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger->err(l_id, "error while getting fields (4): unknown error");
-        return false;
-    }
+    logger->log(l_id, found ? "getIdByDoc got invalid field type (should be k_oid)" : "getIdByDoc got empty resultSet");
+    return false;
 }
 
 bool Database::setField(string& colName, string& fieldName, bsoncxx::oid id, bsoncxx::types::value& val) {
     try {
-        db[colName].update_one(make_document(kvp("_id", id)),
-                               make_document(kvp("$set", make_document(kvp(fieldName, val)))));
+        backend->update(colName, make_document(kvp("_id", id)),
+                        make_document(kvp("$set", make_document(kvp(fieldName, val)))), false);
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while setting field: " + string(ex.what()));
         return false;
@@ -587,11 +382,26 @@ bool Database::setField(string&& colName, string&& fieldName, bsoncxx::oid id, b
     return setField(colName, fieldName, id, bsoncxx::types::value{tmp});
 }
 
+bool Database::unsetField(string&& colName, string&& fieldName, bsoncxx::oid id) {
+    try {
+        backend->update(colName, make_document(kvp("_id", id)),
+                        make_document(kvp("$unset", make_document(kvp(fieldName, "")))), false);
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while unsetting field: " + string(ex.what()));
+        return false;
+    } catch (...) {
+        logger->err(l_id, "error while unsetting field: unknown error");
+        return false;
+    }
+
+    return true;
+}
+
 bool Database::incField(string&& colName, string&& fieldName, string&& idFieldName, bsoncxx::oid& id,
                         string&& matchFieldName, string& matchFieldVal, int64_t diff) {
     try {
-        db[colName].update_one(make_document(kvp(idFieldName, id), kvp(matchFieldName, matchFieldVal)),
-                               make_document(kvp("$inc", make_document(kvp(fieldName, diff)))));
+        backend->update(colName, make_document(kvp(idFieldName, id), kvp(matchFieldName, matchFieldVal)),
+                        make_document(kvp("$inc", make_document(kvp(fieldName, diff)))), false);
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while incrementing field: " + string(ex.what()));
         return false;
@@ -605,8 +415,8 @@ bool Database::incField(string&& colName, string&& fieldName, string&& idFieldNa
 
 bool Database::incField(string&& colName, bsoncxx::oid& id, string&& incField, int64_t incVal = 1) {
     try {
-        db[colName].update_one(make_document(kvp("_id", id)),
-                               make_document(kvp("$inc", make_document(kvp(incField, incVal)))));
+        backend->update(colName, make_document(kvp("_id", id)),
+                        make_document(kvp("$inc", make_document(kvp(incField, incVal)))), false);
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while incrementing field (2): " + string(ex.what()));
         return false;
@@ -624,7 +434,7 @@ bool Database::countField(string&& colName, string&& fieldName, bsoncxx::oid id,
     b_val.size = valSize;
 
     try {
-        res = (uint64_t) db[colName].count(make_document(kvp("_id", id), kvp(fieldName, b_val)));
+        res = backend->count(colName, make_document(kvp("_id", id), kvp(fieldName, b_val)));
         return true;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while counting binary fields: " + string(ex.what()));
@@ -637,7 +447,7 @@ bool Database::countField(string&& colName, string&& fieldName, bsoncxx::oid id,
 
 bool Database::countField(string&& colName, string&& fieldName, const string& fieldVal, string&& idFieldName, bsoncxx::oid id, uint64_t& res) {
     try {
-        res = (uint64_t) db[colName].count(make_document(kvp(idFieldName, id), kvp(fieldName, fieldVal)));
+        res = backend->count(colName, make_document(kvp(idFieldName, id), kvp(fieldName, fieldVal)));
         return true;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while counting string fields: " + string(ex.what()));
@@ -650,7 +460,7 @@ bool Database::countField(string&& colName, string&& fieldName, const string& fi
 
 bool Database::countField(string&& colName, string&& fieldName, const string& fieldVal, uint64_t& res) {
     try {
-        res = (uint64_t) db[colName].count(make_document(kvp(fieldName, fieldVal)));
+        res = backend->count(colName, make_document(kvp(fieldName, fieldVal)));
         return true;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while simple counting string fields: " + string(ex.what()));
@@ -663,8 +473,8 @@ bool Database::countField(string&& colName, string&& fieldName, const string& fi
 
 bool Database::removeFieldFromArray(string&& colName, string&& arrayName, bsoncxx::oid id, bsoncxx::document::value&& val) {
     try {
-        db[colName].update_one(make_document(kvp("_id", id)),
-                               make_document(kvp("$pull", make_document(kvp(arrayName, val)))));
+        backend->update(colName, make_document(kvp("_id", id)),
+                        make_document(kvp("$pull", make_document(kvp(arrayName, val)))), false);
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while removing field from array: " + string(ex.what()));
         return false;
@@ -679,8 +489,8 @@ bool Database::removeFieldFromArray(string&& colName, string&& arrayName, bsoncx
 bool Database::removeFieldFromArrays(string&& colName, string&& arrayName, string&& fieldName, bsoncxx::types::value&& val) {
     string fullName = arrayName + "." + fieldName;
     try {
-        db[colName].update_many(make_document(kvp(fullName, val)),
-                               make_document(kvp("$pull", make_document(kvp(arrayName, make_document(kvp(fieldName, val)))))));
+        backend->update(colName, make_document(kvp(fullName, val)),
+                        make_document(kvp("$pull", make_document(kvp(arrayName, make_document(kvp(fieldName, val)))))), true);
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while removing field from arrays: " + string(ex.what()));
         return false;
@@ -692,101 +502,186 @@ bool Database::removeFieldFromArrays(string&& colName, string&& arrayName, strin
     return true;
 }
 
-bool Database::pushValToArr(string&& colName, string&& arrayName, bsoncxx::oid id, bsoncxx::document::value&& val) {
+bool Database::updateDoc(string&& colName, bsoncxx::oid id, bsoncxx::document::value&& update) {
     try {
-        db[colName].update_one(make_document(kvp("_id", id)),
-                               make_document(kvp("$push", make_document(kvp(arrayName, val)))));
+        backend->update(colName, make_document(kvp("_id", id)), update.view(), false);
     } catch (const std::exception& ex) {
-        logger->err(l_id, "error while pushing to array: " + string(ex.what()));
+        logger->err(l_id, "error while updating document: " + string(ex.what()));
         return false;
     } catch (...) {
-        logger->err(l_id, "error while pushing to array: unknown error");
+        logger->err(l_id, "error while updating document: unknown error");
         return false;
     }
 
     return true;
 }
 
-bool Database::insertDoc(string&& colName, bsoncxx::oid& id, bsoncxx::builder::basic::document& doc) {
+bool Database::updateMany(string&& colName, bsoncxx::document::value&& filter, bsoncxx::document::value&& update) {
     try {
-        auto res = db[colName].insert_one(doc.view());
+        backend->update(colName, filter.view(), update.view(), true);
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while updating documents: " + string(ex.what()));
+        return false;
+    } catch (...) {
+        logger->err(l_id, "error while updating documents: unknown error");
+        return false;
+    }
 
-        if(!res) {
-            logger->log(l_id, "insertDoc failed while inserting");
-            return false;
-        }
+    return true;
+}
 
-        if (res->inserted_id().type() != bsoncxx::type::k_oid) {
-            logger->log(l_id, "insertDoc hasn't got inserted id");
-            return false;
-        }
+// every matching document is passed to callback while the backend still holds it
+bool Database::findDocs(string&& colName, bsoncxx::document::value&& filter, function<void(const bsoncxx::document::view&)> parse) {
+    try {
+        backend->find(colName, filter.view(), FindOptions(), [&parse](const bsoncxx::document::view& doc_v) {
+            parse(doc_v);
+            return true;
+        });
 
-        id = res->inserted_id().get_oid().value;
         return true;
     } catch (const std::exception& ex) {
-        logger->err(l_id, "error while inserting doc: " + string(ex.what()));
+        logger->err(l_id, "error while finding documents: " + string(ex.what()));
         return false;
     } catch (...) {
-        logger->err(l_id, "error while inserting doc: unknown error");
+        logger->err(l_id, "error while finding documents: unknown error");
         return false;
     }
 }
 
-bsoncxx::types::b_binary Database::stringToBinary(const string& str) {
-    bsoncxx::types::b_binary b_sid{};
-    b_sid.bytes = (const uint8_t*) str.c_str();
-    b_sid.size = (uint32_t) str.size();
-    return b_sid;
+bool Database::pushValToArr(string&& colName, string&& arrayName, bsoncxx::oid id, bsoncxx::document::value&& val) {
+    try {
+        backend->update(colName, make_document(kvp("_id", id)),
+                        make_document(kvp("$push", make_document(kvp(arrayName, val)))), false);
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while pushing to array: " + string(ex.what()));
+        return false;
+    } catch (...) {
+        logger->err(l_id, "error while pushing to array: unknown error");
+        return false;
+    }
+
+    return true;
 }
 
-bool Database::removeByOid(string&& colName, string&& fieldName, bsoncxx::oid& fieldValue) {
+bool Database::insertDoc(string&& colName, bsoncxx::oid& id, bsoncxx::builder::basic::document& doc) {
     try {
-        db[colName].delete_many(make_document(kvp(fieldName, fieldValue)));
+        id = backend->insert(colName, doc.view());
+        return true;
     } catch (const std::exception& ex) {
-        logger->err(l_id, "error while deleting by oid: " + string(ex.what()));
+        logger->err(l_id, "error while inserting doc: " + string(ex.what()));
         return false;
     } catch (...) {
-        logger->err(l_id, "error while deleting by oid: unknown error");
+        logger->err(l_id, "error while inserting doc: unknown error");
+        return false;
+    }
+}
+
+bool Database::read(const bsoncxx::document::element& el, string& res) {
+    if(el.type() != bsoncxx::type::k_utf8) {
         return false;
     }
 
+    res.assign(el.get_utf8().value.data(), el.get_utf8().value.size());
     return true;
 }
 
-bool Database::sumFieldAdvanced(string&& colName, string&& resFieldName, mongocxx::pipeline& stages, uint64_t& res) {
-    stages.project(make_document(kvp(resFieldName, 1)));
+bool Database::read(const bsoncxx::document::element& el, uint64_t& res) {
+    if(el.type() == bsoncxx::type::k_int64) {
+        res = (uint64_t) el.get_int64().value;
+    } else if(el.type() == bsoncxx::type::k_int32) {
+        res = (uint64_t) el.get_int32().value;
+    } else {
+        return false;
+    }
 
-    try {
-        auto cursor = db[colName].aggregate(stages);
+    return true;
+}
 
-        auto doc_i = cursor.begin();
+bool Database::read(const bsoncxx::document::element& el, uint8_t& res) {
+    uint64_t tmp;
 
-        if (doc_i == cursor.end() || doc_i->empty()) {
-            logger->log(l_id, "sumFieldAdvanced got empty resultSet");
-            res = 0;
-            return true; // !!
-        }
+    if(!read(el, tmp)) {
+        return false;
+    }
 
-        auto val = doc_i->begin();
+    res = (uint8_t) tmp;
+    return true;
+}
 
-        if (bsoncxx::string::to_string(val->key()) == resFieldName && val->type() == bsoncxx::type::k_int64) {
-            res = (uint64_t) val->get_int64().value;
-            return true;
-        }
+bool Database::read(const bsoncxx::document::element& el, bool& res) {
+    if(el.type() != bsoncxx::type::k_bool) {
+        return false;
+    }
+
+    res = el.get_bool().value;
+    return true;
+}
+
+bool Database::read(const bsoncxx::document::element& el, bsoncxx::oid& res) {
+    if(el.type() != bsoncxx::type::k_oid) {
+        return false;
+    }
+
+    res = el.get_oid().value;
+    return true;
+}
+
+bool Database::readBinary(const bsoncxx::document::element& el, string& res) {
+    if(el.type() != bsoncxx::type::k_binary) {
+        return false;
+    }
+
+    res.assign((const char*) el.get_binary().bytes, el.get_binary().size);
+    return true;
+}
+
+// milliseconds since epoch
+bool Database::readDate(const bsoncxx::document::element& el, uint64_t& res) {
+    if(el.type() != bsoncxx::type::k_date) {
+        return false;
+    }
+
+    res = (uint64_t) el.get_date().to_int64();
+    return true;
+}
 
+// missing array (null) is empty too
+bool Database::readNotEmpty(const bsoncxx::document::element& el, bool& res) {
+    if(el.type() == bsoncxx::type::k_null) {
+        res = false;
+    } else if(el.type() == bsoncxx::type::k_array) {
+        res = !el.get_array().value.empty();
+    } else {
         return false;
+    }
+
+    return true;
+}
+
+bsoncxx::types::b_binary Database::stringToBinary(const string& str) {
+    bsoncxx::types::b_binary b_sid{};
+    b_sid.bytes = (const uint8_t*) str.c_str();
+    b_sid.size = (uint32_t) str.size();
+    return b_sid;
+}
+
+bool Database::removeByOid(string&& colName, string&& fieldName, bsoncxx::oid& fieldValue) {
+    try {
+        backend->remove(colName, make_document(kvp(fieldName, fieldValue)));
     } catch (const std::exception& ex) {
-        logger->err(l_id, "error while summing field: " + string(ex.what()));
+        logger->err(l_id, "error while deleting by oid: " + string(ex.what()));
         return false;
     } catch (...) {
-        logger->err(l_id, "error while summing field: unknown error");
+        logger->err(l_id, "error while deleting by oid: unknown error");
         return false;
     }
+
+    return true;
 }
 
 bool Database::deleteDocs(string&& colName, bsoncxx::document::value&& doc) {
     try {
-       db[colName].delete_many(doc.view());
+       backend->remove(colName, doc.view());
        return true;
     } catch (const std::exception& ex) {
         logger->err(l_id, "error while summing field: " + string(ex.what()));
@@ -3,63 +3,61 @@
 
 #include "main.h"
 #include "Logger.h"
+#include "MetadataBackend.h"
 
-#include <mongocxx/instance.hpp>
-#include <mongocxx/uri.hpp>
-#include <mongocxx/client.hpp>
-
-#include <bsoncxx/array/view.hpp>
 #include <bsoncxx/array/view.hpp>
-#include <bsoncxx/builder/basic/array.hpp>
-#include <bsoncxx/builder/basic/document.hpp>
-#include <bsoncxx/builder/basic/kvp.hpp>
-#include <bsoncxx/document/value.hpp>
-#include <bsoncxx/document/view.hpp>
 #include <bsoncxx/json.hpp>
 #include <bsoncxx/stdx/string_view.hpp>
-#include <bsoncxx/string/to_string.hpp>
-#include <bsoncxx/types.hpp>
-#include <bsoncxx/types/value.hpp>
-#include <bsoncxx/json.hpp>
-
-#include <mongocxx/client.hpp>
-#include <mongocxx/instance.hpp>
 
+#include <functional>
 
+// 1 - metadata kept in process by EmbeddedBackend (no mongod needed), 0 - in mongod at DB_URI
+#define DB_EMBEDDED 0
+#define DB_EMBEDDED_DIR "/var/lib/tin"
 #define DB_URI "mongodb://localhost:27017"
 #define DB_NAME "tin"
+// clients (sockets to mongod) shared by all threads, above that operations wait for a free one
+#define DB_POOL_SIZE 64
 
 using std::string;
 
+// how one field of a result document is stored into T
+// static tables of these give both the projection and the decoding of rows read straight from cursor
+template<class T>
+struct FieldDecoder {
+    const char* name;
+    bool (*decode)(const bsoncxx::document::element&, T&);
+};
+
 class Database {
 private:
-    mongocxx::client* client;
-    mongocxx::database db;
+    MetadataBackend* backend;
     Logger* logger;
     std::string l_id = "DB";
     bool connected;
-    mongocxx::instance* inst;
 
-    bool getField(string&, string&, bsoncxx::oid, bsoncxx::document::element&);
+    bool ensureIndex(string&&, bsoncxx::document::value&&, bsoncxx::document::value&&);
+    void ensureSchema();
+
+    template<class T, size_t N>
+    static bsoncxx::document::value projection(const FieldDecoder<T> (&)[N]);
+    template<class T, size_t N>
+    static bool decodeRow(const bsoncxx::document::view&, const FieldDecoder<T> (&)[N], T&);
+
+    bool getField(string&, string&, bsoncxx::oid, std::function<bool(const bsoncxx::document::element&)>);
     bool setField(string&, string&, bsoncxx::oid id, bsoncxx::types::value&);
 public:
     Database(Logger*);
     ~Database();
-    bool getField(string&&, string&&, bsoncxx::oid, bsoncxx::document::element&);
+    std::string stats();
     bool getField(string&&, string&&, bsoncxx::oid, string&);
     bool getField(string&&, string&&, bsoncxx::oid, int64_t&);
-    bool getField(string&&, string&&, bsoncxx::oid, const uint8_t*&, uint32_t&);
+    bool getField(string&&, string&&, bsoncxx::oid, std::vector<uint8_t>&);
     bool getField(string&&, string&&, string&&, bsoncxx::oid& id, string&&, const string&, int64_t&);
     bool getFieldM(string&&, string&&, bsoncxx::document::value&&, std::vector<string>&);
-    bool getFieldMAdvanced(string&&, string&&, mongocxx::pipeline&, std::vector<string>&);
     bool getId(string&&, string&&, const string&, bsoncxx::oid&);
     bool getIdById(string&&, string&&, const string&, string&&, bsoncxx::oid&);
     bool getIdByDoc(string&&, bsoncxx::document::value&&, bsoncxx::oid&);
-    bool getFields(string&&, bsoncxx::oid, std::map<string, bsoncxx::types::value>&);
-    bool getFields(string&&, std::vector<string>&, std::map<bsoncxx::oid, std::map<string, bsoncxx::types::value> >&);
-    bool getFields(string&&, bsoncxx::document::value&&, const std::vector<string>&,
-            std::map<string, std::map<string, bsoncxx::types::value> >&);
-    bool getFieldsAdvanced(string&&, mongocxx::pipeline&, std::vector<string>&, std::map<string, std::map<string, bsoncxx::types::value> >&);
     bool setField(string&&, string&&, bsoncxx::oid, bsoncxx::types::value&&);
     bool setField(string&, string&, bsoncxx::oid, bsoncxx::types::value&&);
     bool setField(string&&, string&&, bsoncxx::oid, string&);
@@ -67,6 +65,7 @@ public:
     bool setFieldCurrentDate(string&&, string&&, bsoncxx::oid, std::chrono::system_clock::time_point&);
     bool setField(string&&, string&&, bsoncxx::oid, bool);
     bool setField(string&&, string&&, bsoncxx::oid, const uint8_t*, uint32_t);
+    bool unsetField(string&&, string&&, bsoncxx::oid);
     bool incField(string&&, string&&, string&&, bsoncxx::oid&, string&&, string&, int64_t = 1);
     bool incField(string&&, bsoncxx::oid&, string&&, int64_t);
     bool countField(string&&, string&&, bsoncxx::oid, const uint8_t*, uint32_t, uint64_t&);
@@ -74,12 +73,99 @@ public:
     bool countField(string&&, string&&, const string&, uint64_t&);
     bool removeFieldFromArray(string&&, string&&, bsoncxx::oid, bsoncxx::document::value&&);
     bool removeFieldFromArrays(string&&, string&&, string&&, bsoncxx::types::value&&);
+    bool updateDoc(string&&, bsoncxx::oid, bsoncxx::document::value&&);
+    bool updateMany(string&&, bsoncxx::document::value&&, bsoncxx::document::value&&);
+    bool findDocs(string&&, bsoncxx::document::value&&, std::function<void(const bsoncxx::document::view&)>);
+    template<class T, size_t N>
+    bool findRows(string&&, bsoncxx::document::value&&, const FieldDecoder<T> (&)[N], std::function<bool(T&)>);
+    template<class T, size_t N>
+    bool findRows(string&&, bsoncxx::document::value&&, FindOptions&&, const FieldDecoder<T> (&)[N], std::function<bool(T&)>);
+    static bool read(const bsoncxx::document::element&, string&);
+    static bool read(const bsoncxx::document::element&, uint64_t&);
+    static bool read(const bsoncxx::document::element&, uint8_t&);
+    static bool read(const bsoncxx::document::element&, bool&);
+    static bool read(const bsoncxx::document::element&, bsoncxx::oid&);
+    static bool readBinary(const bsoncxx::document::element&, string&);
+    static bool readDate(const bsoncxx::document::element&, uint64_t&);
+    static bool readNotEmpty(const bsoncxx::document::element&, bool&);
     bool pushValToArr(string&&, string&&, bsoncxx::oid, bsoncxx::document::value&&);
     bool insertDoc(string&&, bsoncxx::oid&, bsoncxx::builder::basic::document&);
     static bsoncxx::types::b_binary stringToBinary(const string&);
     bool removeByOid(string&&, string&&, bsoncxx::oid&);
-    bool sumFieldAdvanced(string&&, string&&, mongocxx::pipeline&, uint64_t&);
     bool deleteDocs(string&&, bsoncxx::document::value&&);
 };
 
+// fields missing in document are left as they are in T
+template<class T, size_t N>
+bool Database::decodeRow(const bsoncxx::document::view& doc, const FieldDecoder<T> (&fields)[N], T& row) {
+    for(auto el: doc) {
+        auto key = el.key();
+
+        for(size_t i=0; i<N; i++) {
+            if(key.size() == strlen(fields[i].name) && memcmp(key.data(), fields[i].name, key.size()) == 0) {
+                if(!fields[i].decode(el, row)) {
+                    return false;
+                }
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+template<class T, size_t N>
+bsoncxx::document::value Database::projection(const FieldDecoder<T> (&fields)[N]) {
+    auto doc = bsoncxx::builder::basic::document{};
+    bool withId = false;
+
+    for(size_t i=0; i<N; i++) {
+        doc.append(bsoncxx::builder::basic::kvp(fields[i].name, 1));
+        withId = withId || strcmp(fields[i].name, "_id") == 0;
+    }
+
+    if(!withId) {
+        doc.append(bsoncxx::builder::basic::kvp("_id", 0));
+    }
+
+    return doc.extract();
+}
+
+template<class T, size_t N>
+bool Database::findRows(string&& colName, bsoncxx::document::value&& filter, const FieldDecoder<T> (&fields)[N], std::function<bool(T&)> onRow) {
+    return findRows(std::move(colName), std::move(filter), FindOptions(), fields, onRow);
+}
+
+// every row is decoded into new T and passed to callback, which can stop reading by returning false
+template<class T, size_t N>
+bool Database::findRows(string&& colName, bsoncxx::document::value&& filter, FindOptions&& options, const FieldDecoder<T> (&fields)[N], std::function<bool(T&)> onRow) {
+    options.projection = projection(fields);
+    bool valid = true;
+
+    try {
+        backend->find(colName, filter.view(), options, [&fields, &onRow, &valid](const bsoncxx::document::view& doc_v) {
+            T row{};
+
+            if(!decodeRow(doc_v, fields, row)) {
+                valid = false;
+                return false;
+            }
+
+            return onRow(row);
+        });
+
+        if(!valid) {
+            logger->log(l_id, "findRows got field of invalid type");
+        }
+
+        return valid;
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while finding rows: " + string(ex.what()));
+        return false;
+    } catch (...) {
+        logger->err(l_id, "error while finding rows: unknown error");
+        return false;
+    }
+}
+
 #endif //SERVER_DATABASE_H
@@ -0,0 +1,1472 @@
+#include "EmbeddedBackend.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <set>
+#include <stdexcept>
+#include <sys/stat.h>
+
+using namespace std;
+
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::make_document;
+using bsoncxx::builder::basic::sub_array;
+using bsoncxx::builder::basic::sub_document;
+
+// record types of snapshot and log
+#define WAL_PUT 1
+#define WAL_DEL 2
+#define WAL_INDEX 3
+
+// filter operators
+#define COND_EQ 0
+#define COND_NE 1
+#define COND_GT 2
+#define COND_GTE 3
+#define COND_LT 4
+#define COND_LTE 5
+#define COND_IN 6
+#define COND_EXISTS 7
+#define COND_REGEX 8
+
+static vector<string> splitPath(const string& path) {
+    vector<string> parts;
+    size_t start = 0;
+
+    while(true) {
+        size_t dot = path.find('.', start);
+        parts.push_back(path.substr(start, dot == string::npos ? string::npos : dot - start));
+
+        if(dot == string::npos) {
+            return parts;
+        }
+
+        start = dot + 1;
+    }
+}
+
+static bool isIndex(const string& part) {
+    return !part.empty() && part.size() < 10 && all_of(part.begin(), part.end(), ::isdigit);
+}
+
+static string keyOf(const bsoncxx::document::element& el) {
+    return string(el.key().data(), el.key().size());
+}
+
+static string idKey(const bsoncxx::oid& id) {
+    return string(id.bytes(), id.size());
+}
+
+static bsoncxx::types::value asValue(const bsoncxx::document::view& doc) {
+    return bsoncxx::types::value{bsoncxx::types::b_document{doc}};
+}
+
+// values under dotted path, arrays on the way are walked into (or indexed by number)
+// array at the end gives its items, and itself too when withArrays is set (equality with whole array)
+static void collect(const bsoncxx::types::value& val, const vector<string>& path, size_t i, bool withArrays, vector<bsoncxx::types::value>& res) {
+    if(i == path.size()) {
+        if(val.type() == bsoncxx::type::k_array) {
+            for(auto item: val.get_array().value) {
+                res.push_back(item.get_value());
+            }
+
+            if(withArrays) {
+                res.push_back(val);
+            }
+        } else {
+            res.push_back(val);
+        }
+        return;
+    }
+
+    if(val.type() == bsoncxx::type::k_document) {
+        auto doc = val.get_document().value;
+        auto el = doc.find(path[i]);
+
+        if(el != doc.end()) {
+            collect(el->get_value(), path, i + 1, withArrays, res);
+        }
+    } else if(val.type() == bsoncxx::type::k_array) {
+        auto arr = val.get_array().value;
+
+        if(isIndex(path[i])) {
+            auto item = arr[(uint32_t) stoul(path[i])];
+
+            if(item) {
+                collect(item.get_value(), path, i + 1, withArrays, res);
+            }
+            return;
+        }
+
+        for(auto item: arr) {
+            if(item.type() == bsoncxx::type::k_document) {
+                collect(item.get_value(), path, i, withArrays, res);
+            }
+        }
+    }
+}
+
+// types are compared only within the same class, like numbers of different widths
+static int typeRank(bsoncxx::type t) {
+    switch(t) {
+        case bsoncxx::type::k_null:
+            return 1;
+        case bsoncxx::type::k_int32:
+        case bsoncxx::type::k_int64:
+        case bsoncxx::type::k_double:
+            return 2;
+        case bsoncxx::type::k_utf8:
+            return 3;
+        case bsoncxx::type::k_document:
+            return 4;
+        case bsoncxx::type::k_array:
+            return 5;
+        case bsoncxx::type::k_binary:
+            return 6;
+        case bsoncxx::type::k_oid:
+            return 7;
+        case bsoncxx::type::k_bool:
+            return 8;
+        case bsoncxx::type::k_date:
+            return 9;
+        default:
+            return 10;
+    }
+}
+
+static int compareBytes(const void* a, size_t aSize, const void* b, size_t bSize) {
+    int res = memcmp(a, b, min(aSize, bSize));
+
+    if(res != 0) {
+        return res;
+    }
+
+    return aSize < bSize ? -1 : (aSize > bSize ? 1 : 0);
+}
+
+static bool isIntegral(const bsoncxx::types::value& v) {
+    return v.type() == bsoncxx::type::k_int32 || v.type() == bsoncxx::type::k_int64;
+}
+
+static int64_t toInt64(const bsoncxx::types::value& v) {
+    return v.type() == bsoncxx::type::k_int32 ? (int64_t) v.get_int32().value : (int64_t) v.get_int64().value;
+}
+
+static double toDouble(const bsoncxx::types::value& v) {
+    return v.type() == bsoncxx::type::k_double ? v.get_double().value : (double) toInt64(v);
+}
+
+// values have to be of the same rank
+static int compareValues(const bsoncxx::types::value& a, const bsoncxx::types::value& b) {
+    switch(typeRank(a.type())) {
+        case 1:
+            return 0;
+        case 2:
+            if(isIntegral(a) && isIntegral(b)) {
+                return toInt64(a) < toInt64(b) ? -1 : (toInt64(a) > toInt64(b) ? 1 : 0);
+            }
+            return toDouble(a) < toDouble(b) ? -1 : (toDouble(a) > toDouble(b) ? 1 : 0);
+        case 3:
+            return compareBytes(a.get_utf8().value.data(), a.get_utf8().value.size(), b.get_utf8().value.data(), b.get_utf8().value.size());
+        case 4:
+            return compareBytes(a.get_document().value.data(), a.get_document().value.length(),
+                                b.get_document().value.data(), b.get_document().value.length());
+        case 5:
+            return compareBytes(a.get_array().value.data(), a.get_array().value.length(),
+                                b.get_array().value.data(), b.get_array().value.length());
+        case 6:
+            if(a.get_binary().size != b.get_binary().size) {
+                return a.get_binary().size < b.get_binary().size ? -1 : 1;
+            }
+            return memcmp(a.get_binary().bytes, b.get_binary().bytes, a.get_binary().size);
+        case 7:
+            return memcmp(a.get_oid().value.bytes(), b.get_oid().value.bytes(), a.get_oid().value.size());
+        case 8:
+            return (int) a.get_bool().value - (int) b.get_bool().value;
+        case 9:
+            return a.get_date().to_int64() < b.get_date().to_int64() ? -1 : (a.get_date().to_int64() > b.get_date().to_int64() ? 1 : 0);
+        default:
+            return 0;
+    }
+}
+
+static bool equalValues(const bsoncxx::types::value& a, const bsoncxx::types::value& b) {
+    return typeRank(a.type()) == typeRank(b.type()) && compareValues(a, b) == 0;
+}
+
+static void appendRaw(string& res, char tag, const void* data, size_t size) {
+    uint32_t len = (uint32_t) size;
+    res.push_back(tag);
+    res.append((const char*) &len, sizeof(len));
+    res.append((const char*) data, size);
+}
+
+// self-delimiting, so keys of compound indexes are concatenated encodings and equal values of any number type are equal
+static string encode(const bsoncxx::types::value& v) {
+    string res;
+
+    switch(v.type()) {
+        case bsoncxx::type::k_int32:
+        case bsoncxx::type::k_int64:
+        case bsoncxx::type::k_double: {
+            double d = toDouble(v);
+            int64_t i = isIntegral(v) ? toInt64(v) : (int64_t) d;
+
+            if(isIntegral(v) || (double) i == d) {
+                res.push_back('n');
+                res.append((const char*) &i, sizeof(i));
+            } else {
+                res.push_back('d');
+                res.append((const char*) &d, sizeof(d));
+            }
+            break;
+        }
+        case bsoncxx::type::k_utf8:
+            appendRaw(res, 's', v.get_utf8().value.data(), v.get_utf8().value.size());
+            break;
+        case bsoncxx::type::k_oid:
+            res.push_back('o');
+            res.append(v.get_oid().value.bytes(), v.get_oid().value.size());
+            break;
+        case bsoncxx::type::k_bool:
+            res.push_back(v.get_bool().value ? 'T' : 'F');
+            break;
+        case bsoncxx::type::k_date: {
+            int64_t ms = v.get_date().to_int64();
+            res.push_back('t');
+            res.append((const char*) &ms, sizeof(ms));
+            break;
+        }
+        case bsoncxx::type::k_binary:
+            appendRaw(res, 'x', v.get_binary().bytes, v.get_binary().size);
+            break;
+        case bsoncxx::type::k_document:
+            appendRaw(res, 'r', v.get_document().value.data(), v.get_document().value.length());
+            break;
+        case bsoncxx::type::k_array:
+            appendRaw(res, 'a', v.get_array().value.data(), v.get_array().value.length());
+            break;
+        default:
+            res.push_back('z');
+    }
+
+    return res;
+}
+
+// every combination of values of indexed fields, missing field is indexed as null
+static void indexKeys(const bsoncxx::document::view& doc, const vector<string>& fields, vector<string>& keys) {
+    keys.assign(1, string());
+
+    for(auto& field: fields) {
+        vector<bsoncxx::types::value> vals;
+        collect(asValue(doc), splitPath(field), 0, false, vals);
+
+        set<string> encoded;
+
+        for(auto& v: vals) {
+            encoded.insert(encode(v));
+        }
+
+        if(encoded.empty()) {
+            encoded.insert(encode(bsoncxx::types::value{bsoncxx::types::b_null{}}));
+        }
+
+        vector<string> next;
+
+        for(auto& key: keys) {
+            for(auto& e: encoded) {
+                next.push_back(key + e);
+            }
+        }
+
+        keys.swap(next);
+    }
+}
+
+// FNV-1a, catches torn and garbled records at the end of log
+static uint32_t checksum(const char* data, size_t size) {
+    uint32_t h = 2166136261u;
+
+    for(size_t i=0; i<size; i++) {
+        h ^= (uint8_t) data[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static bool writeAll(int fd, const string& buf) {
+    size_t done = 0;
+
+    while(done < buf.size()) {
+        ssize_t res = write(fd, buf.data() + done, buf.size() - done);
+
+        if(res < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        done += (size_t) res;
+    }
+
+    return true;
+}
+
+static bool syncDir(const string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return false;
+    }
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+static bool readAt(const string& path, uint64_t offset, uint64_t len, string& res) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return false;
+    }
+
+    res.resize(len);
+    size_t done = 0;
+
+    while(done < len) {
+        ssize_t r = pread(fd, &res[done], len - done, (off_t) (offset + done));
+
+        if(r < 0 && errno == EINTR) {
+            continue;
+        }
+        if(r <= 0) {
+            close(fd);
+            return false;
+        }
+
+        done += (size_t) r;
+    }
+
+    close(fd);
+    return true;
+}
+
+EmbeddedBackend::Node::Node(): value(bsoncxx::types::b_null{}) {}
+
+EmbeddedBackend::Node::Node(const bsoncxx::types::value& v): value(v) {}
+
+EmbeddedBackend::EmbeddedBackend(const string& d, Logger* l): finds(0), writes(0), compactions(0) {
+    dir = d;
+    logger = l;
+}
+
+EmbeddedBackend::~EmbeddedBackend() {
+    if(walFd != -1) {
+        close(walFd);
+    }
+}
+
+// loads snapshot and replays log written after it, torn end of log (crash during write) is cut off
+bool EmbeddedBackend::connect() {
+    if(mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+        logger->err(l_id, "couldn't create metadata directory " + dir, errno);
+        return false;
+    }
+
+    lock_guard<mutex> lock(db_mutex);
+
+    try {
+        if(!replay(dir + "/metadata.snap", false)) {
+            logger->err(l_id, "metadata snapshot in " + dir + " is corrupted");
+            return false;
+        }
+
+        replay(dir + "/metadata.wal", true);
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while loading metadata: " + string(ex.what()));
+        return false;
+    }
+
+    walFd = open((dir + "/metadata.wal").c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if(walFd == -1) {
+        logger->err(l_id, "couldn't open metadata log", errno);
+        return false;
+    }
+
+    compactAt = walBytes + EMBEDDED_WAL_MAX;
+
+    size_t count = 0;
+
+    for(auto& col: collections) {
+        count += col.second.docs.size();
+    }
+
+    logger->info(l_id, "loaded " + to_string(count) + " documents from " + dir);
+    return true;
+}
+
+// missing file is an empty one, for log walBytes is set to the length of its valid part
+bool EmbeddedBackend::replay(const string& path, bool isLog) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        if(errno == ENOENT) {
+            return true;
+        }
+        throw runtime_error("couldn't open " + path + ": " + strerror(errno));
+    }
+
+    string data;
+    char buf[64 * 1024];
+    ssize_t res;
+
+    while((res = read(fd, buf, sizeof(buf))) != 0) {
+        if(res < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            close(fd);
+            throw runtime_error("couldn't read " + path + ": " + strerror(err));
+        }
+
+        data.append(buf, (size_t) res);
+    }
+
+    close(fd);
+
+    size_t offset = 0;
+
+    while(offset + 8 <= data.size()) {
+        uint32_t len, sum;
+        memcpy(&len, data.data() + offset, sizeof(len));
+        memcpy(&sum, data.data() + offset + 4, sizeof(sum));
+
+        if(len < 8 || offset + 8 + len > data.size() || checksum(data.data() + offset + 8, len) != sum) {
+            break;
+        }
+
+        const char* payload = data.data() + offset + 8;
+        uint8_t op = (uint8_t) payload[0];
+        uint16_t colLen;
+        memcpy(&colLen, payload + 1, sizeof(colLen));
+
+        if(3 + (size_t) colLen + 5 > len) {
+            break;
+        }
+
+        string colName(payload + 3, colLen);
+        bsoncxx::document::view doc((const uint8_t*) payload + 3 + colLen, len - 3 - colLen);
+        Collection& col = collections[colName];
+
+        if(op == WAL_PUT) {
+            applyPut(col, make_shared<const bsoncxx::document::value>(doc));
+        } else if(op == WAL_DEL) {
+            applyDel(col, idKey(doc["_id"].get_oid().value));
+        } else if(op == WAL_INDEX) {
+            applyIndex(col, doc);
+        } else {
+            break;
+        }
+
+        offset += 8 + len;
+    }
+
+    if(offset == data.size()) {
+        if(isLog) {
+            walBytes = offset;
+        }
+        return true;
+    }
+
+    if(!isLog) {
+        return false;
+    }
+
+    logger->warn(l_id, "cutting off " + to_string(data.size() - offset) + " bytes of unfinished metadata log");
+
+    if(truncate(path.c_str(), (off_t) offset) != 0) {
+        throw runtime_error("couldn't truncate " + path + ": " + strerror(errno));
+    }
+
+    walBytes = offset;
+    return true;
+}
+
+// [u32 length][u32 checksum][u8 type][u16 collection name length][collection name][bson document]
+string EmbeddedBackend::record(uint8_t op, const string& colName, const bsoncxx::document::view& doc) {
+    uint32_t len = (uint32_t) (3 + colName.size() + doc.length());
+    uint16_t colLen = (uint16_t) colName.size();
+
+    string res;
+    res.reserve(8 + len);
+    res.append((const char*) &len, sizeof(len));
+    res.append(4, '\0');
+    res.push_back((char) op);
+    res.append((const char*) &colLen, sizeof(colLen));
+    res.append(colName);
+    res.append((const char*) doc.data(), doc.length());
+
+    uint32_t sum = checksum(res.data() + 8, len);
+    memcpy(&res[4], &sum, sizeof(sum));
+    return res;
+}
+
+// called with db_mutex held, before records are applied in memory
+// returns true when log grew big enough to be compacted, which writer does after applying its records
+bool EmbeddedBackend::logRecords(const string& records) {
+    if(!writeAll(walFd, records) || (EMBEDDED_WAL_SYNC && fdatasync(walFd) != 0)) {
+        string err = strerror(errno);
+        // partial record would hide everything appended after it
+        if(ftruncate(walFd, (off_t) walBytes) != 0) {
+            logger->err(l_id, "couldn't roll back metadata log", errno);
+        }
+        throw runtime_error("couldn't write metadata log: " + err);
+    }
+
+    walBytes += records.size();
+    writes++;
+
+    return walBytes >= compactAt && !compacting;
+}
+
+// called with db_mutex held, after records are applied, lock is released while snapshot is written
+// snapshot holds state of the first snapAt bytes of log, records logged meanwhile are moved to the new log
+// a crash leaves either old snapshot or new one with a log starting no later than it, records still
+// in log are put or deleted again on replay, which gives the same state
+void EmbeddedBackend::compact(unique_lock<mutex>& lock) {
+    struct SnapCollection {
+        string name;
+        vector<bsoncxx::document::value> indexes;
+        vector<Doc> docs;
+    };
+
+    compacting = true;
+    uint64_t snapAt = walBytes;
+    vector<SnapCollection> snap;
+
+    // documents are immutable, copying pointers is enough
+    for(auto& col: collections) {
+        snap.push_back(SnapCollection{col.first, {}, {}});
+        snap.back().docs.reserve(col.second.docs.size());
+
+        for(auto& index: col.second.indexes) {
+            snap.back().indexes.push_back(index.spec);
+        }
+
+        for(auto& doc: col.second.docs) {
+            snap.back().docs.push_back(doc.second);
+        }
+    }
+
+    lock.unlock();
+
+    string tmpPath = dir + "/metadata.snap.tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    bool ok = fd != -1;
+    string buf;
+
+    for(auto colIt = snap.begin(); ok && colIt != snap.end(); ++colIt) {
+        for(auto& spec: colIt->indexes) {
+            buf += record(WAL_INDEX, colIt->name, spec.view());
+        }
+
+        for(auto& doc: colIt->docs) {
+            buf += record(WAL_PUT, colIt->name, doc->view());
+
+            if(buf.size() >= 1024*1024) {
+                ok = writeAll(fd, buf);
+                buf.clear();
+            }
+        }
+    }
+
+    snap.clear();
+
+    ok = ok && writeAll(fd, buf) && fsync(fd) == 0;
+
+    if(fd != -1) {
+        close(fd);
+    }
+
+    ok = ok && rename(tmpPath.c_str(), (dir + "/metadata.snap").c_str()) == 0 && syncDir(dir);
+
+    lock.lock();
+    compacting = false;
+
+    // records logged while snapshot was written start the new log, it replaces the old one by rename
+    string walPath = dir + "/metadata.wal";
+    string tail;
+    int newFd = -1;
+
+    if(ok) {
+        ok = readAt(walPath, snapAt, walBytes - snapAt, tail);
+    }
+
+    if(ok) {
+        newFd = open((walPath + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        ok = newFd != -1 && writeAll(newFd, tail) && fdatasync(newFd) == 0
+             && rename((walPath + ".tmp").c_str(), walPath.c_str()) == 0 && syncDir(dir);
+    }
+
+    if(!ok) {
+        logger->err(l_id, "error while compacting metadata log", errno);
+        if(newFd != -1) {
+            close(newFd);
+        }
+        compactAt = walBytes + EMBEDDED_WAL_MAX;
+        return;
+    }
+
+    close(walFd);
+    walFd = newFd;
+    walBytes = tail.size();
+    compactAt = walBytes + EMBEDDED_WAL_MAX;
+    compactions++;
+    logger->log(l_id, "compacted metadata log into snapshot");
+}
+
+EmbeddedBackend::Filter EmbeddedBackend::compile(const bsoncxx::document::view& filter) {
+    Filter res;
+
+    for(auto el: filter) {
+        string key = keyOf(el);
+
+        if(key.empty() || key[0] == '$') {
+            throw runtime_error("unsupported filter operator " + key);
+        }
+
+        auto path = splitPath(key);
+
+        if(el.type() == bsoncxx::type::k_regex) {
+            auto flags = regex::ECMAScript;
+            string options(el.get_regex().options.data(), el.get_regex().options.size());
+
+            if(options.find('i') != string::npos) {
+                flags |= regex::icase;
+            }
+
+            auto re = make_shared<regex>(string(el.get_regex().regex.data(), el.get_regex().regex.size()), flags);
+            res.push_back(Condition{path, COND_REGEX, el.get_value(), re});
+            continue;
+        }
+
+        auto ops = el.type() == bsoncxx::type::k_document ? el.get_document().value : bsoncxx::document::view();
+
+        if(ops.empty() || ops.begin()->key().size() == 0 || ops.begin()->key().data()[0] != '$') {
+            res.push_back(Condition{path, COND_EQ, el.get_value(), nullptr});
+            continue;
+        }
+
+        for(auto op: ops) {
+            static const map<string, int> names = {
+                    {"$eq", COND_EQ}, {"$ne", COND_NE}, {"$gt", COND_GT}, {"$gte", COND_GTE}, {"$lt", COND_LT},
+                    {"$lte", COND_LTE}, {"$in", COND_IN}, {"$exists", COND_EXISTS}
+            };
+
+            auto name = names.find(keyOf(op));
+
+            if(name == names.end()) {
+                throw runtime_error("unsupported filter operator " + keyOf(op));
+            }
+
+            res.push_back(Condition{path, name->second, op.get_value(), nullptr});
+        }
+    }
+
+    return res;
+}
+
+// condition on path starting at from-th part of it, val is the value at the beginning of path
+bool EmbeddedBackend::matches(const bsoncxx::types::value& val, const Condition& cond, size_t from) {
+    vector<bsoncxx::types::value> vals;
+    collect(val, cond.path, from, true, vals);
+
+    switch(cond.op) {
+        case COND_EXISTS: {
+            bool exists = cond.arg.type() == bsoncxx::type::k_bool ? cond.arg.get_bool().value
+                                                                   : (typeRank(cond.arg.type()) == 2 && toDouble(cond.arg) != 0);
+            return vals.empty() != exists;
+        }
+        case COND_EQ:
+        case COND_NE: {
+            bool found = vals.empty() && cond.arg.type() == bsoncxx::type::k_null;
+
+            for(size_t i=0; i<vals.size() && !found; i++) {
+                found = equalValues(vals[i], cond.arg);
+            }
+
+            return found == (cond.op == COND_EQ);
+        }
+        case COND_IN:
+            if(cond.arg.type() != bsoncxx::type::k_array) {
+                throw runtime_error("$in needs an array");
+            }
+
+            for(auto item: cond.arg.get_array().value) {
+                for(auto& v: vals) {
+                    if(equalValues(v, item.get_value())) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        case COND_REGEX:
+            for(auto& v: vals) {
+                if(v.type() == bsoncxx::type::k_utf8
+                   && regex_search(v.get_utf8().value.data(), v.get_utf8().value.data() + v.get_utf8().value.size(), *cond.re)) {
+                    return true;
+                }
+            }
+            return false;
+        default:
+            for(auto& v: vals) {
+                if(typeRank(v.type()) != typeRank(cond.arg.type())) {
+                    continue;
+                }
+
+                int c = compareValues(v, cond.arg);
+
+                if((cond.op == COND_GT && c > 0) || (cond.op == COND_GTE && c >= 0) || (cond.op == COND_LT && c < 0) || (cond.op == COND_LTE && c <= 0)) {
+                    return true;
+                }
+            }
+            return false;
+    }
+}
+
+bool EmbeddedBackend::matches(const bsoncxx::document::view& doc, const Filter& filter) {
+    auto val = asValue(doc);
+
+    for(auto& cond: filter) {
+        if(!matches(val, cond, 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// documents matching filter in _id order, equality on _id or on leading fields of an index avoids the full scan
+void EmbeddedBackend::candidates(Collection& col, const Filter& filter, vector<Doc>& res) {
+    for(auto& cond: filter) {
+        if(cond.op == COND_EQ && cond.path.size() == 1 && cond.path[0] == "_id" && cond.arg.type() == bsoncxx::type::k_oid) {
+            auto it = col.docs.find(idKey(cond.arg.get_oid().value));
+
+            if(it != col.docs.end() && matches(it->second->view(), filter)) {
+                res.push_back(it->second);
+            }
+            return;
+        }
+    }
+
+    const Index* best = nullptr;
+    string bestPrefix;
+    size_t bestFields = 0;
+
+    for(auto& index: col.indexes) {
+        string prefix;
+        size_t fields = 0;
+
+        for(auto& field: index.fields) {
+            auto path = splitPath(field);
+            auto eq = find_if(filter.begin(), filter.end(), [&path](const Condition& cond) {
+                return cond.op == COND_EQ && cond.path == path && cond.arg.type() != bsoncxx::type::k_array
+                       && cond.arg.type() != bsoncxx::type::k_document;
+            });
+
+            if(eq == filter.end()) {
+                break;
+            }
+
+            prefix += encode(eq->arg);
+            fields++;
+        }
+
+        if(fields > bestFields) {
+            best = &index;
+            bestPrefix = prefix;
+            bestFields = fields;
+        }
+    }
+
+    if(best == nullptr) {
+        for(auto& doc: col.docs) {
+            if(matches(doc.second->view(), filter)) {
+                res.push_back(doc.second);
+            }
+        }
+        return;
+    }
+
+    // document with array field has several keys in index
+    set<string> ids;
+
+    for(auto it = best->entries.lower_bound(bestPrefix); it != best->entries.end() && it->first.compare(0, bestPrefix.size(), bestPrefix) == 0; ++it) {
+        ids.insert(it->second);
+    }
+
+    for(auto& id: ids) {
+        auto it = col.docs.find(id);
+
+        if(it != col.docs.end() && matches(it->second->view(), filter)) {
+            res.push_back(it->second);
+        }
+    }
+}
+
+EmbeddedBackend::Node EmbeddedBackend::toNode(const bsoncxx::types::value& val) {
+    Node res(val);
+
+    if(val.type() == bsoncxx::type::k_document) {
+        for(auto el: val.get_document().value) {
+            res.keys.push_back(keyOf(el));
+            res.items.push_back(toNode(el.get_value()));
+        }
+    } else if(val.type() == bsoncxx::type::k_array) {
+        for(auto el: val.get_array().value) {
+            res.keys.emplace_back();
+            res.items.push_back(toNode(el.get_value()));
+        }
+    }
+
+    return res;
+}
+
+void EmbeddedBackend::append(sub_document& doc, const string& key, const Node& node) {
+    if(node.value.type() == bsoncxx::type::k_document) {
+        doc.append(kvp(key, [&node](sub_document sub) {
+            for(size_t i=0; i<node.items.size(); i++) {
+                append(sub, node.keys[i], node.items[i]);
+            }
+        }));
+    } else if(node.value.type() == bsoncxx::type::k_array) {
+        doc.append(kvp(key, [&node](sub_array sub) {
+            for(auto& item: node.items) {
+                append(sub, item);
+            }
+        }));
+    } else {
+        doc.append(kvp(key, node.value));
+    }
+}
+
+void EmbeddedBackend::append(sub_array& arr, const Node& node) {
+    if(node.value.type() == bsoncxx::type::k_document) {
+        arr.append([&node](sub_document sub) {
+            for(size_t i=0; i<node.items.size(); i++) {
+                append(sub, node.keys[i], node.items[i]);
+            }
+        });
+    } else if(node.value.type() == bsoncxx::type::k_array) {
+        arr.append([&node](sub_array sub) {
+            for(auto& item: node.items) {
+                append(sub, item);
+            }
+        });
+    } else {
+        arr.append(node.value);
+    }
+}
+
+// with create missing fields are added (null ones become documents), otherwise nullptr is returned for them
+EmbeddedBackend::Node* EmbeddedBackend::nodeAt(Node& root, const vector<string>& path, bool create) {
+    Node* cur = &root;
+
+    for(auto& part: path) {
+        if(create && cur->value.type() == bsoncxx::type::k_null) {
+            cur->value = bsoncxx::types::value{bsoncxx::types::b_document{}};
+        }
+
+        if(cur->value.type() == bsoncxx::type::k_document) {
+            auto it = std::find(cur->keys.begin(), cur->keys.end(), part);
+
+            if(it != cur->keys.end()) {
+                cur = &cur->items[it - cur->keys.begin()];
+                continue;
+            }
+
+            if(!create) {
+                return nullptr;
+            }
+
+            cur->keys.push_back(part);
+            cur->items.emplace_back();
+            cur = &cur->items.back();
+        } else if(cur->value.type() == bsoncxx::type::k_array && isIndex(part)) {
+            size_t i = stoul(part);
+
+            if(i >= cur->items.size()) {
+                if(!create) {
+                    return nullptr;
+                }
+                cur->keys.resize(i + 1);
+                cur->items.resize(i + 1);
+            }
+
+            cur = &cur->items[i];
+        } else if(create) {
+            throw runtime_error("can't create field " + part + " inside a value");
+        } else {
+            return nullptr;
+        }
+    }
+
+    return cur;
+}
+
+// index of the first item of array at path[0..n) matched by conditions of filter on fields of that array ("arr.$.field")
+size_t EmbeddedBackend::position(const bsoncxx::document::view& doc, const vector<string>& path, size_t n, const Filter& filter) {
+    vector<string> arrPath(path.begin(), path.begin() + n);
+    vector<bsoncxx::types::value> vals;
+    collect(asValue(doc), arrPath, 0, true, vals);
+
+    if(vals.empty() || vals.back().type() != bsoncxx::type::k_array) {
+        throw runtime_error("positional operator needs an array");
+    }
+
+    size_t i = 0;
+
+    for(auto item: vals.back().get_array().value) {
+        bool found = false;
+        bool ok = true;
+
+        for(auto& cond: filter) {
+            if(cond.path.size() > n && equal(arrPath.begin(), arrPath.end(), cond.path.begin())) {
+                found = true;
+                ok = ok && matches(item.get_value(), cond, n);
+            }
+        }
+
+        if(found && ok) {
+            return i;
+        }
+
+        i++;
+    }
+
+    throw runtime_error("positional operator didn't find the matching item");
+}
+
+// new version of document, old one is left untouched for readers still holding it
+EmbeddedBackend::Doc EmbeddedBackend::applyUpdate(const Doc& doc, const bsoncxx::document::view& update, const Filter& filter) {
+    Node root = toNode(asValue(doc->view()));
+
+    for(auto op: update) {
+        string name = keyOf(op);
+
+        if(op.type() != bsoncxx::type::k_document) {
+            throw runtime_error("update operator " + name + " needs a document");
+        }
+
+        for(auto field: op.get_document().value) {
+            auto path = splitPath(keyOf(field));
+
+            for(size_t i=0; i<path.size(); i++) {
+                if(path[i] == "$") {
+                    path[i] = to_string(position(doc->view(), path, i, filter));
+                }
+            }
+
+            if(name == "$set") {
+                *nodeAt(root, path, true) = toNode(field.get_value());
+            } else if(name == "$unset") {
+                string last = path.back();
+                path.pop_back();
+                Node* parent = nodeAt(root, path, false);
+
+                if(parent != nullptr && parent->value.type() == bsoncxx::type::k_document) {
+                    auto it = std::find(parent->keys.begin(), parent->keys.end(), last);
+                    if(it != parent->keys.end()) {
+                        parent->items.erase(parent->items.begin() + (it - parent->keys.begin()));
+                        parent->keys.erase(it);
+                    }
+                } else if(parent != nullptr && parent->value.type() == bsoncxx::type::k_array && isIndex(last) && stoul(last) < parent->items.size()) {
+                    parent->items[stoul(last)] = Node();
+                }
+            } else if(name == "$inc") {
+                Node* node = nodeAt(root, path, true);
+                auto diff = field.get_value();
+
+                if(typeRank(diff.type()) != 2) {
+                    throw runtime_error("$inc needs a number");
+                }
+
+                if(node->value.type() == bsoncxx::type::k_null) {
+                    *node = Node(diff);
+                } else if(typeRank(node->value.type()) != 2) {
+                    throw runtime_error("$inc on a field which isn't a number");
+                } else if(isIntegral(node->value) && isIntegral(diff)) {
+                    node->value = bsoncxx::types::value{bsoncxx::types::b_int64{toInt64(node->value) + toInt64(diff)}};
+                } else {
+                    node->value = bsoncxx::types::value{bsoncxx::types::b_double{toDouble(node->value) + toDouble(diff)}};
+                }
+            } else if(name == "$push") {
+                Node* node = nodeAt(root, path, true);
+
+                if(node->value.type() == bsoncxx::type::k_null) {
+                    node->value = bsoncxx::types::value{bsoncxx::types::b_array{}};
+                } else if(node->value.type() != bsoncxx::type::k_array) {
+                    throw runtime_error("$push on a field which isn't an array");
+                }
+
+                node->keys.emplace_back();
+                node->items.push_back(toNode(field.get_value()));
+            } else if(name == "$pull") {
+                Node* node = nodeAt(root, path, false);
+
+                if(node == nullptr || node->value.type() != bsoncxx::type::k_array) {
+                    continue;
+                }
+
+                // {field: cond, ...} is matched against documents in array, anything else against items themselves
+                auto arg = field.get_value();
+                bool onFields = arg.type() == bsoncxx::type::k_document && !arg.get_document().value.empty()
+                                && arg.get_document().value.begin()->key().data()[0] != '$';
+                auto wrapped = make_document(kvp("v", arg));
+                Filter cond = compile(onFields ? arg.get_document().value : wrapped.view());
+
+                vector<string> keys;
+                vector<Node> items;
+
+                for(auto& item: node->items) {
+                    bsoncxx::builder::basic::document tmp;
+                    append(tmp, "v", item);
+                    auto itemDoc = tmp.extract();
+                    auto v = itemDoc.view()["v"];
+
+                    bool pulled = onFields ? v.type() == bsoncxx::type::k_document && matches(v.get_document().value, cond)
+                                           : matches(itemDoc.view(), cond);
+
+                    if(!pulled) {
+                        keys.emplace_back();
+                        items.push_back(item);
+                    }
+                }
+
+                node->keys.swap(keys);
+                node->items.swap(items);
+            } else {
+                throw runtime_error("unsupported update operator " + name);
+            }
+        }
+    }
+
+    bsoncxx::builder::basic::document res;
+
+    for(size_t i=0; i<root.items.size(); i++) {
+        append(res, root.keys[i], root.items[i]);
+    }
+
+    return make_shared<const bsoncxx::document::value>(res.extract());
+}
+
+void EmbeddedBackend::checkUnique(Collection& col, const string& id, const bsoncxx::document::view& doc) {
+    for(auto& index: col.indexes) {
+        if(!index.unique) {
+            continue;
+        }
+
+        vector<string> keys;
+        indexKeys(doc, index.fields, keys);
+
+        for(auto& key: keys) {
+            auto range = index.entries.equal_range(key);
+
+            for(auto it = range.first; it != range.second; ++it) {
+                if(it->second != id) {
+                    throw runtime_error("duplicate key in unique index");
+                }
+            }
+        }
+    }
+}
+
+static void unindex(multimap<string, string>& entries, const vector<string>& keys, const string& id) {
+    for(auto& key: keys) {
+        auto range = entries.equal_range(key);
+
+        for(auto it = range.first; it != range.second;) {
+            it = it->second == id ? entries.erase(it) : next(it);
+        }
+    }
+}
+
+void EmbeddedBackend::applyPut(Collection& col, const Doc& doc) {
+    string id = idKey(doc->view()["_id"].get_oid().value);
+    auto old = col.docs.find(id);
+
+    for(auto& index: col.indexes) {
+        vector<string> keys;
+
+        if(old != col.docs.end()) {
+            indexKeys(old->second->view(), index.fields, keys);
+            unindex(index.entries, keys, id);
+        }
+
+        indexKeys(doc->view(), index.fields, keys);
+
+        for(auto& key: keys) {
+            index.entries.emplace(key, id);
+        }
+    }
+
+    col.docs[id] = doc;
+}
+
+void EmbeddedBackend::applyDel(Collection& col, const string& id) {
+    auto it = col.docs.find(id);
+
+    if(it == col.docs.end()) {
+        return;
+    }
+
+    for(auto& index: col.indexes) {
+        vector<string> keys;
+        indexKeys(it->second->view(), index.fields, keys);
+        unindex(index.entries, keys, id);
+    }
+
+    col.docs.erase(it);
+}
+
+// spec is {keys: {...}, options: {...}}, only "unique" of options is used
+void EmbeddedBackend::applyIndex(Collection& col, const bsoncxx::document::view& spec) {
+    vector<string> fields;
+
+    for(auto el: spec["keys"].get_document().value) {
+        fields.push_back(keyOf(el));
+    }
+
+    for(auto& index: col.indexes) {
+        if(index.fields == fields) {
+            return;
+        }
+    }
+
+    auto unique = spec["options"].get_document().value["unique"];
+    col.indexes.push_back(Index{fields, unique && unique.type() == bsoncxx::type::k_bool && unique.get_bool().value,
+                                bsoncxx::document::value(spec), {}});
+
+    Index& index = col.indexes.back();
+
+    for(auto& doc: col.docs) {
+        vector<string> keys;
+        indexKeys(doc.second->view(), fields, keys);
+
+        for(auto& key: keys) {
+            index.entries.emplace(key, doc.first);
+        }
+    }
+}
+
+// documents are matched under the lock and passed to callback after it's released, so callback can query again
+void EmbeddedBackend::find(const string& colName, const bsoncxx::document::view& filter, const FindOptions& options,
+                           const function<bool(const bsoncxx::document::view&)>& onDoc) {
+    Filter f = compile(filter);
+    vector<Doc> docs;
+
+    {
+        lock_guard<mutex> lock(db_mutex);
+        auto col = collections.find(colName);
+
+        if(col != collections.end()) {
+            candidates(col->second, f, docs);
+        }
+    }
+
+    finds++;
+
+    if(options.sortOrder != 0) {
+        auto path = splitPath(options.sortField);
+        vector<bsoncxx::types::value> keys;
+
+        for(auto& doc: docs) {
+            vector<bsoncxx::types::value> vals;
+            collect(asValue(doc->view()), path, 0, false, vals);
+            keys.push_back(vals.empty() ? bsoncxx::types::value{bsoncxx::types::b_null{}} : vals.front());
+        }
+
+        vector<size_t> order(docs.size());
+
+        for(size_t i=0; i<order.size(); i++) {
+            order[i] = i;
+        }
+
+        int sign = options.sortOrder;
+
+        stable_sort(order.begin(), order.end(), [&keys, sign](size_t a, size_t b) {
+            int rankA = typeRank(keys[a].type()), rankB = typeRank(keys[b].type());
+            int c = rankA != rankB ? rankA - rankB : compareValues(keys[a], keys[b]);
+            return sign > 0 ? c < 0 : c > 0;
+        });
+
+        vector<Doc> sorted;
+
+        for(auto i: order) {
+            sorted.push_back(docs[i]);
+        }
+
+        docs.swap(sorted);
+    }
+
+    if(options.limit > 0 && docs.size() > (size_t) options.limit) {
+        docs.resize((size_t) options.limit);
+    }
+
+    // inclusion of top-level fields, _id is included unless it's set to 0 ({_id: 0} alone excludes just _id)
+    set<string> included;
+    bool withId = true;
+    bool inclusive = false;
+
+    for(auto el: options.projection.view()) {
+        bool on = el.type() == bsoncxx::type::k_bool ? el.get_bool().value : (typeRank(el.type()) == 2 && toDouble(el.get_value()) != 0);
+
+        if(keyOf(el) == "_id") {
+            withId = on;
+        } else if(on) {
+            included.insert(keyOf(el));
+        }
+
+        inclusive = inclusive || on;
+    }
+
+    bool project = !options.projection.view().empty();
+
+    for(auto& doc: docs) {
+        if(!project) {
+            if(!onDoc(doc->view())) {
+                break;
+            }
+            continue;
+        }
+
+        bsoncxx::builder::basic::document res;
+
+        for(auto el: doc->view()) {
+            string key = keyOf(el);
+
+            if(key == "_id" ? withId : (!inclusive || included.count(key) > 0)) {
+                res.append(kvp(key, el.get_value()));
+            }
+        }
+
+        auto projected = res.extract();
+
+        if(!onDoc(projected.view())) {
+            break;
+        }
+    }
+}
+
+uint64_t EmbeddedBackend::count(const string& colName, const bsoncxx::document::view& filter) {
+    Filter f = compile(filter);
+    vector<Doc> docs;
+
+    lock_guard<mutex> lock(db_mutex);
+    auto col = collections.find(colName);
+
+    if(col != collections.end()) {
+        candidates(col->second, f, docs);
+    }
+
+    finds++;
+    return docs.size();
+}
+
+bsoncxx::oid EmbeddedBackend::insert(const string& colName, const bsoncxx::document::view& doc) {
+    Doc stored;
+    bsoncxx::oid id;
+    auto idEl = doc["_id"];
+
+    if(!idEl) {
+        bsoncxx::builder::basic::document withId;
+        withId.append(kvp("_id", id));
+
+        for(auto el: doc) {
+            withId.append(kvp(keyOf(el), el.get_value()));
+        }
+
+        stored = make_shared<const bsoncxx::document::value>(withId.extract());
+    } else if(idEl.type() == bsoncxx::type::k_oid) {
+        id = idEl.get_oid().value;
+        stored = make_shared<const bsoncxx::document::value>(doc);
+    } else {
+        throw runtime_error("_id has to be an ObjectId");
+    }
+
+    string key = idKey(id);
+
+    unique_lock<mutex> lock(db_mutex);
+    Collection& col = collections[colName];
+
+    if(col.docs.count(key) > 0) {
+        throw runtime_error("duplicate _id");
+    }
+
+    checkUnique(col, key, stored->view());
+    bool full = logRecords(record(WAL_PUT, colName, stored->view()));
+    applyPut(col, stored);
+
+    if(full) {
+        compact(lock);
+    }
+
+    return id;
+}
+
+// whole update is checked before anything is logged, so failing one changes nothing
+void EmbeddedBackend::update(const string& colName, const bsoncxx::document::view& filter, const bsoncxx::document::view& update, bool many) {
+    Filter f = compile(filter);
+    vector<Doc> docs;
+
+    unique_lock<mutex> lock(db_mutex);
+    auto col = collections.find(colName);
+
+    if(col == collections.end()) {
+        return;
+    }
+
+    candidates(col->second, f, docs);
+
+    if(!many && docs.size() > 1) {
+        docs.resize(1);
+    }
+
+    vector<Doc> updated;
+    string records;
+
+    for(auto& doc: docs) {
+        Doc res = applyUpdate(doc, update, f);
+        auto oldId = doc->view()["_id"];
+        auto newId = res->view()["_id"];
+
+        if(!newId || newId.type() != bsoncxx::type::k_oid || newId.get_oid().value != oldId.get_oid().value) {
+            throw runtime_error("_id can't be changed");
+        }
+
+        if(res->view().length() == doc->view().length() && memcmp(res->view().data(), doc->view().data(), res->view().length()) == 0) {
+            continue;
+        }
+
+        checkUnique(col->second, idKey(newId.get_oid().value), res->view());
+        records += record(WAL_PUT, colName, res->view());
+        updated.push_back(res);
+    }
+
+    if(updated.empty()) {
+        return;
+    }
+
+    bool full = logRecords(records);
+
+    for(auto& doc: updated) {
+        applyPut(col->second, doc);
+    }
+
+    if(full) {
+        compact(lock);
+    }
+}
+
+void EmbeddedBackend::remove(const string& colName, const bsoncxx::document::view& filter) {
+    Filter f = compile(filter);
+    vector<Doc> docs;
+
+    unique_lock<mutex> lock(db_mutex);
+    auto col = collections.find(colName);
+
+    if(col == collections.end()) {
+        return;
+    }
+
+    candidates(col->second, f, docs);
+
+    if(docs.empty()) {
+        return;
+    }
+
+    string records;
+
+    for(auto& doc: docs) {
+        records += record(WAL_DEL, colName, make_document(kvp("_id", doc->view()["_id"].get_oid().value)).view());
+    }
+
+    bool full = logRecords(records);
+
+    for(auto& doc: docs) {
+        applyDel(col->second, idKey(doc->view()["_id"].get_oid().value));
+    }
+
+    if(full) {
+        compact(lock);
+    }
+}
+
+// creating index which already exists is a no-op, unique one fails when documents already break it
+void EmbeddedBackend::createIndex(const string& colName, const bsoncxx::document::view& keys, const bsoncxx::document::view& options) {
+    auto spec = make_document(kvp("keys", keys), kvp("options", options));
+    vector<string> fields;
+
+    for(auto el: keys) {
+        fields.push_back(keyOf(el));
+    }
+
+    unique_lock<mutex> lock(db_mutex);
+    Collection& col = collections[colName];
+
+    for(auto& index: col.indexes) {
+        if(index.fields == fields) {
+            return;
+        }
+    }
+
+    auto unique = options["unique"];
+
+    if(unique && unique.type() == bsoncxx::type::k_bool && unique.get_bool().value) {
+        map<string, string> seen;
+
+        for(auto& doc: col.docs) {
+            vector<string> docKeys;
+            indexKeys(doc.second->view(), fields, docKeys);
+
+            for(auto& key: docKeys) {
+                auto it = seen.emplace(key, doc.first).first;
+                if(it->second != doc.first) {
+                    throw runtime_error("documents have duplicate keys");
+                }
+            }
+        }
+    }
+
+    bool full = logRecords(record(WAL_INDEX, colName, spec.view()));
+    applyIndex(col, spec.view());
+
+    if(full) {
+        compact(lock);
+    }
+}
+
+string EmbeddedBackend::stats() {
+    size_t docs = 0;
+    size_t cols = 0;
+    uint64_t logSize = 0;
+
+    {
+        lock_guard<mutex> lock(db_mutex);
+        cols = collections.size();
+        logSize = walBytes;
+
+        for(auto& col: collections) {
+            docs += col.second.docs.size();
+        }
+    }
+
+    return "embedded: " + to_string(docs) + " documents in " + to_string(cols) + " collections, log " + to_string(logSize / 1024)
+           + " KiB, " + to_string(finds.load()) + " reads, " + to_string(writes.load()) + " writes, "
+           + to_string(compactions.load()) + " compactions";
+}
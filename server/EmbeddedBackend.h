@@ -0,0 +1,108 @@
+#ifndef SERVER_EMBEDDEDBACKEND_H
+#define SERVER_EMBEDDEDBACKEND_H
+
+#include "main.h"
+#include "Logger.h"
+#include "MetadataBackend.h"
+
+#include <atomic>
+#include <memory>
+#include <regex>
+
+// every change is synced to disk before it's applied, 0 leaves flushing to the kernel (faster, last writes can be lost)
+#define EMBEDDED_WAL_SYNC 1
+// above that log is compacted into new snapshot
+#define EMBEDDED_WAL_MAX (64*1024*1024)
+
+// in-process metadata store, collections are ordered maps of documents kept in memory
+// state on disk is a snapshot plus write-ahead log of whole documents put or deleted since it was taken
+// secondary indexes (from createIndex) map encoded values of indexed fields to document ids
+class EmbeddedBackend: public MetadataBackend {
+private:
+    typedef std::shared_ptr<const bsoncxx::document::value> Doc;
+
+    struct Index {
+        std::vector<std::string> fields;
+        bool unique;
+        bsoncxx::document::value spec;
+        std::multimap<std::string, std::string> entries;
+    };
+
+    struct Collection {
+        std::map<std::string, Doc> docs;
+        std::vector<Index> indexes;
+    };
+
+    // one field of filter, arg points into the filter document
+    struct Condition {
+        std::vector<std::string> path;
+        int op;
+        bsoncxx::types::value arg;
+        std::shared_ptr<std::regex> re;
+    };
+
+    typedef std::vector<Condition> Filter;
+
+    // document being updated, children are fields of documents or items of arrays
+    struct Node {
+        bsoncxx::types::value value;
+        std::vector<std::string> keys;
+        std::vector<Node> items;
+
+        Node();
+        explicit Node(const bsoncxx::types::value&);
+    };
+
+    std::string dir;
+    Logger* logger;
+    std::string l_id = "DB/embedded";
+    int walFd = -1;
+    uint64_t walBytes = 0;
+    uint64_t compactAt = EMBEDDED_WAL_MAX;
+    // only one writer compacts at a time, others keep logging meanwhile
+    bool compacting = false;
+
+    std::mutex db_mutex;
+    std::map<std::string, Collection> collections;
+
+    std::atomic<uint64_t> finds;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> compactions;
+
+    static Filter compile(const bsoncxx::document::view&);
+    static bool matches(const bsoncxx::types::value&, const Condition&, size_t);
+    static bool matches(const bsoncxx::document::view&, const Filter&);
+    static void candidates(Collection&, const Filter&, std::vector<Doc>&);
+
+    static Node toNode(const bsoncxx::types::value&);
+    static void append(bsoncxx::builder::basic::sub_document&, const std::string&, const Node&);
+    static void append(bsoncxx::builder::basic::sub_array&, const Node&);
+    static Node* nodeAt(Node&, const std::vector<std::string>&, bool);
+    static size_t position(const bsoncxx::document::view&, const std::vector<std::string>&, size_t, const Filter&);
+    static Doc applyUpdate(const Doc&, const bsoncxx::document::view&, const Filter&);
+
+    static void checkUnique(Collection&, const std::string&, const bsoncxx::document::view&);
+    static void applyPut(Collection&, const Doc&);
+    static void applyDel(Collection&, const std::string&);
+    static void applyIndex(Collection&, const bsoncxx::document::view&);
+
+    static std::string record(uint8_t, const std::string&, const bsoncxx::document::view&);
+    bool logRecords(const std::string&);
+    bool replay(const std::string&, bool);
+    void compact(std::unique_lock<std::mutex>&);
+
+public:
+    EmbeddedBackend(const std::string&, Logger*);
+    ~EmbeddedBackend();
+    bool connect();
+    void find(const std::string&, const bsoncxx::document::view&, const FindOptions&,
+              const std::function<bool(const bsoncxx::document::view&)>&);
+    uint64_t count(const std::string&, const bsoncxx::document::view&);
+    bsoncxx::oid insert(const std::string&, const bsoncxx::document::view&);
+    void update(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&, bool);
+    void remove(const std::string&, const bsoncxx::document::view&);
+    void createIndex(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&);
+    std::string stats();
+};
+
+#endif //SERVER_EMBEDDEDBACKEND_H
@@ -0,0 +1,125 @@
+#include "FileCache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+mutex FileCache::cache_mutex;
+map<string, FileCache::Entry> FileCache::entries;
+list<string> FileCache::lru;
+size_t FileCache::capacity = FILE_CACHE_SIZE;
+uint64_t FileCache::hits = 0;
+uint64_t FileCache::misses = 0;
+
+FileHandle::~FileHandle() {
+    if(map != nullptr) {
+        munmap(map, mapLen);
+    }
+
+    if(fd != -1) {
+        close(fd);
+    }
+}
+
+// maps the file on first use, caller has to make sure it's not truncated while mapped (reading past end is SIGBUS)
+const uint8_t* FileHandle::mapped(size_t len) {
+    lock_guard<mutex> lock(map_mutex);
+
+    struct stat st;
+
+    if(map == nullptr && len > 0 && fstat(fd, &st) == 0 && (uint64_t) st.st_size >= len) {
+        void* m = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        if(m == MAP_FAILED) {
+            return nullptr;
+        }
+        map = (uint8_t*) m;
+        mapLen = len;
+    }
+
+    return mapLen >= len ? map : nullptr;
+}
+
+// file is opened outside of the lock, two connections missing at once just open it twice
+shared_ptr<FileHandle> FileCache::acquire(const string& key, const string& path, bool write) {
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto it = entries.find(key);
+        if(it != entries.end() && (it->second.handle->writable || !write) && it->second.handle->path == path) {
+            lru.splice(lru.begin(), lru, it->second.lruPos);
+            hits++;
+            return it->second.handle;
+        }
+        misses++;
+    }
+
+    auto handle = make_shared<FileHandle>();
+    handle->fd = open(path.c_str(), (write ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+
+    if(handle->fd == -1) {
+        return nullptr;
+    }
+
+    handle->writable = write;
+    handle->path = path;
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto it = entries.find(key);
+    if(it != entries.end()) {
+        lru.erase(it->second.lruPos);
+        entries.erase(it);
+    }
+
+    lru.push_front(key);
+    entries[key] = Entry{handle, lru.begin()};
+
+    evict();
+
+    return handle;
+}
+
+// expects cache_mutex locked
+void FileCache::evict() {
+    while(entries.size() > capacity && !lru.empty()) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+}
+
+void FileCache::invalidate(const string& key) {
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto it = entries.find(key);
+    if(it != entries.end()) {
+        lru.erase(it->second.lruPos);
+        entries.erase(it);
+    }
+}
+
+// drops handles of all files under given path (deleted directory or user home)
+void FileCache::invalidatePath(const string& prefix) {
+    lock_guard<mutex> lock(cache_mutex);
+
+    for(auto it = entries.begin(); it != entries.end();) {
+        const string& path = it->second.handle->path;
+        if(path.compare(0, prefix.size(), prefix) == 0 && (path.size() == prefix.size() || path[prefix.size()] == '/')) {
+            lru.erase(it->second.lruPos);
+            it = entries.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+void FileCache::setCapacity(size_t c) {
+    lock_guard<mutex> lock(cache_mutex);
+    capacity = c;
+    evict();
+}
+
+string FileCache::stats() {
+    lock_guard<mutex> lock(cache_mutex);
+    return to_string(entries.size()) + "/" + to_string(capacity) + " open, " + to_string(hits) + " hits, " + to_string(misses) + " misses";
+}
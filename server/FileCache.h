@@ -0,0 +1,50 @@
+#ifndef SERVER_FILECACHE_H
+#define SERVER_FILECACHE_H
+
+#include "main.h"
+
+#include <memory>
+
+// open descriptor of stored file, closed when last user releases it
+// completed files can be also read through one read-only mapping shared by all their readers
+struct FileHandle {
+    int fd = -1;
+    bool writable = false;
+    std::string path;
+
+    std::mutex map_mutex;
+    uint8_t* map = nullptr;
+    size_t mapLen = 0;
+
+    const uint8_t* mapped(size_t);
+    ~FileHandle();
+};
+
+// LRU of open descriptors shared by all connections, keyed by file id
+// data is read and written with pread/pwrite, so one handle can be used by many transfers at once
+// evicted (or invalidated) handle stays open while someone still holds it
+class FileCache {
+private:
+    struct Entry {
+        std::shared_ptr<FileHandle> handle;
+        std::list<std::string>::iterator lruPos;
+    };
+
+    static std::mutex cache_mutex;
+    static std::map<std::string, Entry> entries;
+    static std::list<std::string> lru;
+    static size_t capacity;
+    static uint64_t hits;
+    static uint64_t misses;
+
+    static void evict();
+
+public:
+    static std::shared_ptr<FileHandle> acquire(const std::string&, const std::string&, bool);
+    static void invalidate(const std::string&);
+    static void invalidatePath(const std::string&);
+    static void setCapacity(size_t);
+    static std::string stats();
+};
+
+#endif //SERVER_FILECACHE_H
@@ -0,0 +1,163 @@
+#include "FileIO.h"
+
+using namespace std;
+
+thread_local FileRing* FileRing::current = nullptr;
+
+bool FileOps::writeAll(int fd, const string& data, uint64_t offset) {
+    size_t done = 0;
+
+    while(done < data.size()) {
+        ssize_t n = pwrite(fd, data.data() + done, data.size() - done, (off_t) (offset + done));
+
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+
+        done += (size_t) n;
+    }
+
+    return true;
+}
+
+// returns as soon as write is submitted, error of any write is reported by the next write or wait
+bool FileOps::write(const shared_ptr<FileHandle>& handle, string&& data, uint64_t offset) {
+    FileRing* ring = FileRing::current;
+
+    if(ring == nullptr) {
+        return writeAll(handle->fd, data, offset);
+    }
+
+    {
+        unique_lock<mutex> lock(io_mutex);
+        io_cond.wait(lock, [this] { return inflight < FILE_IO_MAX_INFLIGHT; });
+
+        if(error != 0) {
+            errno = error;
+            return false;
+        }
+
+        inflight++;
+    }
+
+    FileOp* op = new FileOp;
+    op->fd = handle->fd;
+    op->write = true;
+    op->buf = std::move(data);
+    op->offset = offset;
+
+    // handle keeps descriptor open until the kernel is done with it
+    auto self = shared_from_this();
+    op->complete = [self, handle](FileOp* op, int res) { self->writeCompleted(op, res); };
+
+    if(ring->submitFile(op)) {
+        return true;
+    }
+
+    string buf = std::move(op->buf);
+    delete op;
+
+    {
+        lock_guard<mutex> lock(io_mutex);
+        inflight--;
+    }
+
+    return writeAll(handle->fd, buf, offset);
+}
+
+void FileOps::writeCompleted(FileOp* op, int res) {
+    lock_guard<mutex> lock(io_mutex);
+    inflight--;
+
+    if(res < 0 && error == 0) {
+        error = -res;
+    } else if(res >= 0 && (size_t) res < op->buf.size() && error == 0) {
+        // regular file ended before the whole block was written (disk full)
+        error = ENOSPC;
+    }
+
+    io_cond.notify_all();
+}
+
+// false (with errno) when any write since the last wait failed
+bool FileOps::wait() {
+    unique_lock<mutex> lock(io_mutex);
+    io_cond.wait(lock, [this] { return inflight == 0; });
+
+    if(error != 0) {
+        errno = error;
+        error = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// next chunk of download is read by the ring while the current one is being sent
+void FileOps::readAhead(const shared_ptr<FileHandle>& handle, uint64_t offset, size_t len) {
+    FileRing* ring = FileRing::current;
+
+    if(ring == nullptr || len == 0) {
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(io_mutex);
+        if(reading || (readValid && readOffset == offset)) {
+            return;
+        }
+        reading = true;
+        readValid = false;
+        readOffset = offset;
+    }
+
+    FileOp* op = new FileOp;
+    op->fd = handle->fd;
+    op->write = false;
+    op->buf.resize(len);
+    op->offset = offset;
+
+    auto self = shared_from_this();
+    op->complete = [self, handle](FileOp* op, int res) { self->readCompleted(op, res); };
+
+    if(!ring->submitFile(op)) {
+        delete op;
+        lock_guard<mutex> lock(io_mutex);
+        reading = false;
+    }
+}
+
+void FileOps::readCompleted(FileOp* op, int res) {
+    lock_guard<mutex> lock(io_mutex);
+    reading = false;
+
+    if(res >= 0) {
+        op->buf.resize((size_t) res);
+        readBuf.swap(op->buf);
+        readValid = true;
+    }
+
+    io_cond.notify_all();
+}
+
+// true when exactly this part was read ahead, otherwise caller reads it itself
+bool FileOps::takeRead(uint64_t offset, size_t len, string& res) {
+    unique_lock<mutex> lock(io_mutex);
+
+    if(readOffset != offset) {
+        return false;
+    }
+
+    io_cond.wait(lock, [this] { return !reading; });
+
+    if(!readValid || readBuf.size() != len) {
+        return false;
+    }
+
+    res.swap(readBuf);
+    readValid = false;
+    return true;
+}
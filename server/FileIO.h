@@ -0,0 +1,62 @@
+#ifndef SERVER_FILEIO_H
+#define SERVER_FILEIO_H
+
+#include "main.h"
+#include "FileCache.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+// write-behind blocks of one upload being written at once, above that upload waits for the disk
+#define FILE_IO_MAX_INFLIGHT 4
+
+// file read or write of chunk I/O, buffer belongs to the op until it's completed
+struct FileOp {
+    int fd;
+    bool write;
+    std::string buf;
+    uint64_t offset;
+    size_t done = 0;
+    // called once, with number of bytes (read can stop at end of file) or -errno
+    std::function<void(FileOp*, int)> complete;
+};
+
+// submits file ops as io_uring requests, together with socket ones, implemented by UringReactor
+class FileRing {
+public:
+    virtual ~FileRing() {}
+    // takes the op when it returns true, false when ring is stopping
+    virtual bool submitFile(FileOp*) = 0;
+
+    // ring of reactor whose connection is served by current worker, nullptr means synchronous file I/O
+    static thread_local FileRing* current;
+};
+
+// ops in flight of one upload or download, shared by copies of its UFile
+// writes are waited for before anything depends on data on disk, read is the next download chunk
+class FileOps: public std::enable_shared_from_this<FileOps> {
+private:
+    std::mutex io_mutex;
+    std::condition_variable io_cond;
+    int inflight = 0;
+    int error = 0;
+
+    bool reading = false;
+    bool readValid = false;
+    uint64_t readOffset = 0;
+    std::string readBuf;
+
+    void writeCompleted(FileOp*, int);
+    void readCompleted(FileOp*, int);
+
+public:
+    bool write(const std::shared_ptr<FileHandle>&, std::string&&, uint64_t);
+    bool wait();
+    void readAhead(const std::shared_ptr<FileHandle>&, uint64_t, size_t);
+    bool takeRead(uint64_t, size_t, std::string&);
+
+    static bool writeAll(int, const std::string&, uint64_t);
+};
+
+#endif //SERVER_FILEIO_H
@@ -0,0 +1,312 @@
+#include "FramedIO.h"
+
+using namespace std;
+
+FramedIO::FramedIO(int sock) {
+    socket = sock;
+}
+
+FramedIO::~FramedIO() {}
+
+void FramedIO::peek(size_t offset, uint8_t* out, size_t n) {
+    size_t start = (ringHead + offset) % FRAME_RING_SIZE;
+    size_t first = min(n, (size_t) FRAME_RING_SIZE - start);
+
+    memcpy(out, ring + start, first);
+    memcpy(out + first, ring, n - first);
+}
+
+void FramedIO::advance(size_t n) {
+    ringHead = (ringHead + n) % FRAME_RING_SIZE;
+    ringLen -= n;
+
+    if(ringLen == 0) {
+        ringHead = 0;
+    }
+}
+
+void FramedIO::releaseRingIfEmpty() {
+    if(ringLen == 0) {
+        ringBuf.release();
+        ring = nullptr;
+        ringHead = 0;
+    }
+}
+
+void FramedIO::releaseBigFrame() {
+    bigFrame.release();
+    bigFrameFilled = 0;
+    bigFrameActive = false;
+}
+
+// buffers next read should fill, 0 when there is no room
+int FramedIO::readBuffers(struct iovec* iov, size_t& requested) {
+    if(bigFrameActive) {
+        requested = bigFrame.size() - bigFrameFilled;
+        iov[0].iov_base = bigFrame.data() + bigFrameFilled;
+        iov[0].iov_len = requested;
+        return 1;
+    }
+
+    if(ring == nullptr) {
+        ringBuf.resize(FRAME_RING_SIZE);
+        ring = ringBuf.data();
+    }
+
+    if(ringLen == FRAME_RING_SIZE) {
+        requested = 0;
+        return 0;
+    }
+
+    int iovcnt = 1;
+    size_t tail = (ringHead + ringLen) % FRAME_RING_SIZE;
+
+    iov[0].iov_base = ring + tail;
+
+    if(tail >= ringHead) {
+        iov[0].iov_len = FRAME_RING_SIZE - tail;
+        if(ringHead > 0) {
+            iov[1].iov_base = ring;
+            iov[1].iov_len = ringHead;
+            iovcnt = 2;
+        }
+    } else {
+        iov[0].iov_len = ringHead - tail;
+    }
+
+    requested = FRAME_RING_SIZE - ringLen;
+    return iovcnt;
+}
+
+// accounts result of read into buffers from readBuffers, err is errno of failed read
+IOStatus FramedIO::completeRead(ssize_t received, size_t requested, int err) {
+    if(received > 0) {
+        if(bigFrameActive) {
+            bigFrameFilled += received;
+        } else {
+            ringLen += received;
+        }
+    }
+
+    lastReadFull = (received > 0 && (size_t) received == requested);
+
+    if(received == 0) {
+        return IO_CLOSED;
+    }
+
+    if(received < 0) {
+        lastReadFull = false;
+        releaseRingIfEmpty();
+
+        if(err == EWOULDBLOCK || err == EAGAIN || err == EINTR) {
+            return IO_AGAIN;
+        }
+
+        return IO_ERROR;
+    }
+
+    return IO_OK;
+}
+
+IOStatus FramedIO::readSome() {
+    struct iovec iov[2];
+    size_t requested;
+    int iovcnt = readBuffers(iov, requested);
+
+    if(iovcnt == 0) {
+        lastReadFull = false;
+        return IO_AGAIN;
+    }
+
+    ssize_t received = readv(socket, iov, iovcnt);
+
+    return completeRead(received, requested, errno);
+}
+
+// hands out next complete frame body, big frames are moved out without copying
+IOStatus FramedIO::nextFrame(PooledBuffer& frame, uint32_t& size) {
+    if(bigFrameActive) {
+        if(bigFrameFilled != bigFrame.size()) {
+            return IO_AGAIN;
+        }
+
+        size = (uint32_t) bigFrame.size() + FRAME_HEADER_SIZE;
+        frame = std::move(bigFrame);
+        releaseBigFrame();
+        return IO_OK;
+    }
+
+    if(ringLen < FRAME_HEADER_SIZE) {
+        releaseRingIfEmpty();
+        return IO_AGAIN;
+    }
+
+    uint8_t size_buf[FRAME_HEADER_SIZE];
+    peek(0, size_buf, FRAME_HEADER_SIZE);
+    size = parseSize(size_buf);
+
+    if(size > MAX_PACKET_SIZE || size <= FRAME_HEADER_SIZE) {
+        return IO_ERROR;
+    }
+
+    uint32_t bodySize = size - FRAME_HEADER_SIZE;
+
+    if(ringLen >= size) {
+        frame.resize(bodySize);
+        peek(FRAME_HEADER_SIZE, frame.data(), bodySize);
+        advance(size);
+        releaseRingIfEmpty();
+        return IO_OK;
+    }
+
+    if(size > FRAME_RING_SIZE) {
+        // frame won't ever fit in the ring, rest of it is received directly into its buffer
+        size_t available = ringLen - FRAME_HEADER_SIZE;
+        bigFrame.resize(bodySize);
+        peek(FRAME_HEADER_SIZE, bigFrame.data(), available);
+        advance(ringLen);
+        bigFrameFilled = available;
+        bigFrameActive = true;
+        releaseRingIfEmpty();
+    }
+
+    return IO_AGAIN;
+}
+
+OutItem::OutItem(PooledBuffer&& b): buf(std::move(b)) {
+    len = buf.size();
+}
+
+OutItem::OutItem(shared_ptr<FileHandle> f, off_t o, size_t l): file(std::move(f)) {
+    fd = file->fd;
+    offset = o;
+    len = l;
+}
+
+OutItem::OutItem(OutItem&& other): buf(std::move(other.buf)), file(std::move(other.file)) {
+    fd = other.fd;
+    offset = other.offset;
+    len = other.len;
+    other.fd = -1;
+}
+
+OutItem& OutItem::operator=(OutItem&& other) {
+    if(this != &other) {
+        buf = std::move(other.buf);
+        file = std::move(other.file);
+        fd = other.fd;
+        offset = other.offset;
+        len = other.len;
+        other.fd = -1;
+    }
+
+    return *this;
+}
+
+void FramedIO::queue(PooledBuffer&& frame) {
+    outBytes += frame.size();
+    outQueue.emplace_back(std::move(frame));
+}
+
+// handle is held until the part is sent, len bytes from offset are sent after previously queued data
+void FramedIO::queueFile(shared_ptr<FileHandle> file, off_t offset, size_t len) {
+    outBytes += len;
+    outQueue.emplace_back(std::move(file), offset, len);
+}
+
+// buffers of queued frames in sending order, at most max, stops at first file
+int FramedIO::writeBuffers(struct iovec* iov, int max) {
+    int iovcnt = 0;
+
+    for(auto it = outQueue.begin(); it != outQueue.end() && iovcnt < max && !it->isFile(); it++, iovcnt++) {
+        iov[iovcnt].iov_base = it->buf.data() + it->offset;
+        iov[iovcnt].iov_len = it->len;
+    }
+
+    return iovcnt;
+}
+
+bool FramedIO::frontFile(int& fd, off_t& offset, size_t& len) {
+    if(outQueue.empty() || !outQueue.front().isFile()) {
+        return false;
+    }
+
+    fd = outQueue.front().fd;
+    offset = outQueue.front().offset;
+    len = outQueue.front().len;
+    return true;
+}
+
+// drops sent bytes from the output queue
+void FramedIO::completeWrite(size_t sent) {
+    outBytes -= min(sent, outBytes);
+
+    while(sent > 0 && !outQueue.empty()) {
+        OutItem& item = outQueue.front();
+
+        if(sent >= item.len) {
+            sent -= item.len;
+            outQueue.pop_front();
+        } else {
+            item.offset += sent;
+            item.len -= sent;
+            sent = 0;
+        }
+    }
+}
+
+// sends all queued frames using as few syscalls as possible, file parts go through sendfile
+IOStatus FramedIO::flush() {
+    while(!outQueue.empty()) {
+        ssize_t sent;
+
+        if(outQueue.front().isFile()) {
+            if(filesSentByReactor) {
+                return IO_AGAIN;
+            }
+
+            OutItem& item = outQueue.front();
+            off_t offset = item.offset;
+
+            sent = sendfile(socket, item.fd, &offset, item.len);
+
+            if(sent == 0) {
+                // file is shorter than expected
+                errno = EIO;
+                return IO_ERROR;
+            }
+        } else {
+            struct iovec iov[FLUSH_MAX_IOV];
+            int iovcnt = writeBuffers(iov, FLUSH_MAX_IOV);
+            int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+            // headers of file frames are sent in one segment with the file
+            if((size_t) iovcnt < outQueue.size() && outQueue[iovcnt].isFile()) {
+                flags |= MSG_MORE;
+            }
+
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t) iovcnt;
+
+            sent = sendmsg(socket, &msg, flags);
+        }
+
+        if(sent < 0) {
+            if(errno == EWOULDBLOCK || errno == EAGAIN) {
+                return IO_AGAIN;
+            }
+
+            if(errno == EINTR) {
+                continue;
+            }
+
+            return IO_ERROR;
+        }
+
+        completeWrite((size_t) sent);
+    }
+
+    return IO_OK;
+}
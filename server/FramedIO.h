@@ -0,0 +1,86 @@
+#ifndef SERVER_FRAMEDIO_H
+#define SERVER_FRAMEDIO_H
+
+#include "main.h"
+#include "utils.h"
+#include "BufferPool.h"
+#include "FileCache.h"
+
+#include <deque>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_RING_SIZE POOL_MEDIUM_SIZE
+#define FLUSH_MAX_IOV 64
+
+enum IOStatus {
+    IO_OK,
+    IO_AGAIN,
+    IO_CLOSED,
+    IO_ERROR,
+};
+
+// queued output, either pooled buffer or part of a file sent straight from page cache
+struct OutItem {
+    PooledBuffer buf;
+    std::shared_ptr<FileHandle> file;
+    int fd = -1;
+    off_t offset = 0;
+    size_t len = 0;
+
+    explicit OutItem(PooledBuffer&&);
+    OutItem(std::shared_ptr<FileHandle>, off_t, size_t);
+    OutItem(OutItem&&);
+    OutItem& operator=(OutItem&&);
+    bool isFile() { return fd != -1; };
+};
+
+// per connection reader/writer of length-prefixed frames
+// input goes into ring buffer (taken from pool only while there is unprocessed data),
+// frames bigger than the ring are received directly into pooled buffer sized from the length prefix
+class FramedIO {
+private:
+    int socket;
+
+    PooledBuffer ringBuf;
+    uint8_t* ring = nullptr;
+    size_t ringHead = 0;
+    size_t ringLen = 0;
+    bool lastReadFull = false;
+
+    PooledBuffer bigFrame;
+    size_t bigFrameFilled = 0;
+    bool bigFrameActive = false;
+
+    // for buffers offset and len are advanced as they are sent, like for files
+    std::deque<OutItem> outQueue;
+    size_t outBytes = 0;
+    // set when reactor sends file parts itself (io_uring splice), flush stops before them
+    bool filesSentByReactor = false;
+
+    void peek(size_t, uint8_t*, size_t);
+    void advance(size_t);
+    void releaseRingIfEmpty();
+    void releaseBigFrame();
+
+public:
+    explicit FramedIO(int);
+    ~FramedIO();
+    IOStatus readSome();
+    int readBuffers(struct iovec*, size_t&);
+    IOStatus completeRead(ssize_t, size_t, int);
+    IOStatus nextFrame(PooledBuffer&, uint32_t&);
+    bool mayHaveMore() { return lastReadFull; };
+    void queue(PooledBuffer&&);
+    void queueFile(std::shared_ptr<FileHandle>, off_t, size_t);
+    IOStatus flush();
+    int writeBuffers(struct iovec*, int);
+    bool frontFile(int&, off_t&, size_t&);
+    void setFilesSentByReactor(bool v) { filesSentByReactor = v; };
+    void completeWrite(size_t);
+    bool hasPendingOutput() { return !outQueue.empty(); };
+    size_t pendingBytes() { return outBytes; };
+};
+
+#endif //SERVER_FRAMEDIO_H
@@ -0,0 +1,44 @@
+#ifndef SERVER_METADATABACKEND_H
+#define SERVER_METADATABACKEND_H
+
+#include "main.h"
+
+#include <bsoncxx/builder/basic/array.hpp>
+#include <bsoncxx/builder/basic/document.hpp>
+#include <bsoncxx/builder/basic/kvp.hpp>
+#include <bsoncxx/document/value.hpp>
+#include <bsoncxx/document/view.hpp>
+#include <bsoncxx/oid.hpp>
+#include <bsoncxx/string/to_string.hpp>
+#include <bsoncxx/types.hpp>
+#include <bsoncxx/types/value.hpp>
+
+#include <functional>
+
+// projection is a list of included fields (and "_id": 0), empty means whole documents
+// sortField - ascending by sortOrder 1, descending by -1, no sorting by 0
+struct FindOptions {
+    bsoncxx::document::value projection = bsoncxx::builder::basic::make_document();
+    std::string sortField;
+    int sortOrder = 0;
+    int64_t limit = 0;
+};
+
+// storage of metadata documents used by Database, all methods throw std::exception on error
+// filters and updates are MongoDB documents, Database uses only: equality, $gt, $lt, $exists, regex and
+// dotted paths into arrays in filters; $set (also with positional "$"), $unset, $inc, $push and $pull in updates
+class MetadataBackend {
+public:
+    virtual ~MetadataBackend() {};
+    virtual bool connect() = 0;
+    virtual void find(const std::string&, const bsoncxx::document::view&, const FindOptions&,
+                      const std::function<bool(const bsoncxx::document::view&)>&) = 0;
+    virtual uint64_t count(const std::string&, const bsoncxx::document::view&) = 0;
+    virtual bsoncxx::oid insert(const std::string&, const bsoncxx::document::view&) = 0;
+    virtual void update(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&, bool) = 0;
+    virtual void remove(const std::string&, const bsoncxx::document::view&) = 0;
+    virtual void createIndex(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&) = 0;
+    virtual std::string stats() = 0;
+};
+
+#endif //SERVER_METADATABACKEND_H
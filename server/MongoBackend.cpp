@@ -0,0 +1,127 @@
+#include "MongoBackend.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::make_document;
+
+MongoBackend::MongoBackend(const string& uri, const string& name, size_t poolSize, Logger* l): acquired(0), waited(0), waitTotalUs(0), waitMaxUs(0) {
+    inst = new mongocxx::instance{};
+    pool = new mongocxx::pool{mongocxx::uri{uri + "/?maxPoolSize=" + to_string(poolSize)}};
+    dbName = name;
+    logger = l;
+}
+
+MongoBackend::~MongoBackend() {
+    delete pool;
+    delete inst;
+}
+
+bool MongoBackend::connect() {
+    try {
+        auto conn = acquire();
+        conn.db.run_command(make_document(kvp("isMaster", 1)));
+        logger->info(l_id, "connected to database");
+        return true;
+    } catch (const std::exception& ex) {
+        logger->err(l_id, "error while connecting to database: " + string(ex.what()));
+    } catch (...) {
+        logger->err(l_id, "error while connecting to database: unknown error");
+    }
+
+    return false;
+}
+
+// blocks while all pooled clients are in use, time spent waiting is counted
+MongoBackend::Connection MongoBackend::acquire() {
+    auto start = chrono::steady_clock::now();
+    auto client = pool->acquire();
+    auto us = (uint64_t) chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    acquired++;
+    waitTotalUs += us;
+
+    if(us >= 1000) {
+        waited++;
+    }
+
+    uint64_t prev = waitMaxUs.load();
+    while(us > prev && !waitMaxUs.compare_exchange_weak(prev, us));
+
+    auto db = (*client)[dbName];
+    return Connection{std::move(client), std::move(db)};
+}
+
+// documents are passed to callback while the cursor (and client) still holds them
+void MongoBackend::find(const string& colName, const bsoncxx::document::view& filter, const FindOptions& options,
+                        const function<bool(const bsoncxx::document::view&)>& onDoc) {
+    mongocxx::options::find opts{};
+
+    if(!options.projection.view().empty()) {
+        opts.projection(options.projection.view());
+    }
+
+    if(options.sortOrder != 0) {
+        opts.sort(make_document(kvp(options.sortField, options.sortOrder)));
+    }
+
+    if(options.limit > 0) {
+        opts.limit(options.limit);
+    }
+
+    auto db = acquire();
+    auto cursor = db[colName].find(filter, opts);
+
+    for (auto doc_v: cursor) {
+        if(!onDoc(doc_v)) {
+            break;
+        }
+    }
+}
+
+uint64_t MongoBackend::count(const string& colName, const bsoncxx::document::view& filter) {
+    auto db = acquire();
+    return (uint64_t) db[colName].count(filter);
+}
+
+bsoncxx::oid MongoBackend::insert(const string& colName, const bsoncxx::document::view& doc) {
+    auto db = acquire();
+    auto res = db[colName].insert_one(doc);
+
+    if(!res || res->inserted_id().type() != bsoncxx::type::k_oid) {
+        throw runtime_error("insert hasn't returned inserted id");
+    }
+
+    return res->inserted_id().get_oid().value;
+}
+
+void MongoBackend::update(const string& colName, const bsoncxx::document::view& filter, const bsoncxx::document::view& update, bool many) {
+    auto db = acquire();
+
+    if(many) {
+        db[colName].update_many(filter, update);
+    } else {
+        db[colName].update_one(filter, update);
+    }
+}
+
+void MongoBackend::remove(const string& colName, const bsoncxx::document::view& filter) {
+    auto db = acquire();
+    db[colName].delete_many(filter);
+}
+
+// creating index which already exists is a no-op
+void MongoBackend::createIndex(const string& colName, const bsoncxx::document::view& keys, const bsoncxx::document::view& options) {
+    auto db = acquire();
+    db[colName].create_index(keys, options);
+}
+
+string MongoBackend::stats() {
+    uint64_t count = acquired.load();
+    uint64_t avg = count > 0 ? waitTotalUs.load() / count : 0;
+
+    return "mongo pool: " + to_string(count) + " acquired, " + to_string(waited.load()) + " waited over 1ms, avg wait " + to_string(avg)
+           + "us, max wait " + to_string(waitMaxUs.load()) + "us";
+}
@@ -0,0 +1,53 @@
+#ifndef SERVER_MONGOBACKEND_H
+#define SERVER_MONGOBACKEND_H
+
+#include "main.h"
+#include "Logger.h"
+#include "MetadataBackend.h"
+
+#include <mongocxx/instance.hpp>
+#include <mongocxx/uri.hpp>
+#include <mongocxx/client.hpp>
+#include <mongocxx/pool.hpp>
+
+#include <atomic>
+
+// metadata kept by mongod, every operation takes a client from pool
+class MongoBackend: public MetadataBackend {
+private:
+    // client taken from pool for one operation, given back when it goes out of scope
+    struct Connection {
+        mongocxx::pool::entry client;
+        mongocxx::database db;
+
+        mongocxx::collection operator[](const std::string& name) { return db[name]; };
+    };
+
+    mongocxx::instance* inst;
+    mongocxx::pool* pool;
+    std::string dbName;
+    Logger* logger;
+    std::string l_id = "DB/mongo";
+
+    std::atomic<uint64_t> acquired;
+    std::atomic<uint64_t> waited;
+    std::atomic<uint64_t> waitTotalUs;
+    std::atomic<uint64_t> waitMaxUs;
+
+    Connection acquire();
+
+public:
+    MongoBackend(const std::string&, const std::string&, size_t, Logger*);
+    ~MongoBackend();
+    bool connect();
+    void find(const std::string&, const bsoncxx::document::view&, const FindOptions&,
+              const std::function<bool(const bsoncxx::document::view&)>&);
+    uint64_t count(const std::string&, const bsoncxx::document::view&);
+    bsoncxx::oid insert(const std::string&, const bsoncxx::document::view&);
+    void update(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&, bool);
+    void remove(const std::string&, const bsoncxx::document::view&);
+    void createIndex(const std::string&, const bsoncxx::document::view&, const bsoncxx::document::view&);
+    std::string stats();
+};
+
+#endif //SERVER_MONGOBACKEND_H
@@ -0,0 +1,224 @@
+#include "Reactor.h"
+#include "FileIO.h"
+
+#include <fcntl.h>
+
+using namespace std;
+
+Reactor::Reactor(int r_id, bool* s_e, Logger* logg, WorkerPool* w_p) {
+    id = r_id;
+    should_exit = s_e;
+    logger = logg;
+    workers = w_p;
+    l_id = "reactor/" + to_string(id);
+}
+
+Reactor::~Reactor() {
+    join();
+
+    if(epfd != -1) {
+        close(epfd);
+    }
+}
+
+bool Reactor::start() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(epfd == -1) {
+        logger->err(l_id, "error while creating epoll instance", errno);
+        return false;
+    }
+
+    t = thread(&Reactor::loop, this);
+    return true;
+}
+
+void Reactor::join() {
+    if(t.joinable()) {
+        t.join();
+    }
+}
+
+// takes ownership of the socket, it's closed also when adding fails
+bool Reactor::addConnection(int sock, connection* conn) {
+    shared_ptr<Entry> e = newEntry();
+    e->fd = sock;
+    e->client = new Client(sock, conn, should_exit, logger);
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        entries[sock] = e;
+    }
+
+    if(!watch(e.get())) {
+        lock_guard<mutex> lock(entries_mutex);
+        entries.erase(sock);
+        return false;
+    }
+
+    return true;
+}
+
+shared_ptr<Reactor::Entry> Reactor::newEntry() {
+    return make_shared<Entry>();
+}
+
+bool Reactor::watch(Entry* e) {
+    int flags = fcntl(e->fd, F_GETFL, 0);
+
+    if(flags == -1 || fcntl(e->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        logger->err(l_id, "error while setting socket non-blocking", errno);
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = e;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, e->fd, &ev) == -1) {
+        logger->err(l_id, "error while adding socket to epoll", errno);
+        return false;
+    }
+
+    return true;
+}
+
+void Reactor::unwatch(Entry* e) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, e->fd, nullptr);
+}
+
+size_t Reactor::connectionCount() {
+    lock_guard<mutex> lock(entries_mutex);
+    return entries.size();
+}
+
+void Reactor::loop() {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    logger->log(l_id, "started");
+
+    while(!(*should_exit)) {
+        int nfds = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, 1000);
+
+        if(nfds == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            logger->err(l_id, "error while waiting for events", errno);
+            break;
+        }
+
+        for(int i=0; i<nfds; i++) {
+            handleEvent((Entry*) events[i].data.ptr, events[i].events);
+        }
+    }
+
+    vector<shared_ptr<Entry> > toClose;
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        for(auto& e: entries) {
+            toClose.push_back(e.second);
+        }
+    }
+
+    for(auto& e: toClose) {
+        closeEntry(e.get());
+    }
+
+    logger->log(l_id, "closed");
+}
+
+void Reactor::handleEvent(Entry* e, uint32_t ev) {
+    bool ok = !(ev & EPOLLERR);
+
+    if(ok && (ev & EPOLLOUT)) {
+        ok = e->client->onWritable();
+    }
+
+    // while there is unsent output, new commands are not read (backpressure)
+    if(ok && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !e->client->hasPendingOutput()) {
+        ok = e->client->onReadable();
+    }
+
+    if(!ok) {
+        closeEntry(e);
+        return;
+    }
+
+    if(dispatch(e)) {
+        return;
+    }
+
+    if(!e->client->onWritable() || !rearm(e)) {
+        closeEntry(e);
+    }
+}
+
+// hands queued frames (or streaming download refill) to worker pool, returns true when worker owns the entry now
+// when pool is saturated frames are answered with errors and stream is refilled here, caller has to send it
+bool Reactor::dispatch(Entry* e) {
+    if(!e->client->hasWork()) {
+        return false;
+    }
+
+    shared_ptr<Entry> ref;
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        ref = entries[e->fd];
+    }
+
+    bool submitted = workers->submit([this, ref] {
+        FileRing::current = fileRing();
+        bool ok = ref->client->processQueuedFrames();
+        FileRing::current = nullptr;
+
+        if(!ok || !rearm(ref.get())) {
+            closeEntry(ref.get());
+        }
+    });
+
+    if(!submitted) {
+        e->client->rejectQueuedFrames();
+        e->client->pushStreamChunks();
+    }
+
+    return submitted;
+}
+
+bool Reactor::rearm(Entry* e) {
+    struct epoll_event ev;
+    ev.events = EPOLLONESHOT | (e->client->hasPendingOutput() ? (uint32_t) EPOLLOUT : (uint32_t) (EPOLLIN | EPOLLRDHUP));
+    ev.data.ptr = e;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, e->fd, &ev) == -1) {
+        // entry could have been closed by reactor in the meantime
+        if(errno != ENOENT) {
+            logger->err(l_id, "error while modifying epoll events", errno);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// can be called both from reactor and worker threads
+void Reactor::closeEntry(Entry* e) {
+    shared_ptr<Entry> ref;
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        auto it = entries.find(e->fd);
+        if(it == entries.end() || it->second.get() != e) {
+            return;
+        }
+        ref = it->second;
+        entries.erase(it);
+    }
+
+    unwatch(e);
+
+    // socket is closed by Client destructor, after last worker task holding it is done
+}
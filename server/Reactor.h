@@ -0,0 +1,56 @@
+#ifndef SERVER_REACTOR_H
+#define SERVER_REACTOR_H
+
+#include "main.h"
+#include "Logger.h"
+#include "Client.h"
+#include "WorkerPool.h"
+
+#include <memory>
+
+#define REACTOR_MAX_EVENTS 256
+
+class FileRing;
+
+// one epoll loop running on its own thread, owns non-blocking client sockets
+// sockets are armed one-shot, while commands of a connection run on worker pool it gets no events
+class Reactor {
+protected:
+    struct Entry {
+        int fd;
+        Client* client;
+
+        virtual ~Entry() { delete client; };
+    };
+
+    int id;
+    int epfd = -1;
+    std::thread t;
+    bool* should_exit;
+    Logger* logger;
+    WorkerPool* workers;
+    std::string l_id;
+    std::mutex entries_mutex;
+    std::map<int, std::shared_ptr<Entry> > entries;
+
+    virtual std::shared_ptr<Entry> newEntry();
+    virtual bool watch(Entry*);
+    virtual void unwatch(Entry*);
+    virtual void loop();
+    virtual bool rearm(Entry*);
+    // where workers of this reactor's connections submit file I/O, nullptr when they do it themselves
+    virtual FileRing* fileRing() { return nullptr; }
+    void handleEvent(Entry*, uint32_t);
+    bool dispatch(Entry*);
+    void closeEntry(Entry*);
+
+public:
+    Reactor(int, bool*, Logger*, WorkerPool*);
+    virtual ~Reactor();
+    virtual bool start();
+    void join();
+    bool addConnection(int, connection*);
+    size_t connectionCount();
+};
+
+#endif //SERVER_REACTOR_H
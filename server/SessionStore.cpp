@@ -0,0 +1,100 @@
+#include "SessionStore.h"
+
+using namespace std;
+
+SessionStore::Shard SessionStore::shards[SESSION_SHARDS];
+atomic<uint64_t> SessionStore::hits(0);
+atomic<uint64_t> SessionStore::misses(0);
+
+// session ids are random bytes, so any hash spreads them evenly
+SessionStore::Shard& SessionStore::shardOf(const string& sid) {
+    return shards[hash<string>()(sid) % SESSION_SHARDS];
+}
+
+// lastUse is the time session was last used, now for new ones and persisted time for loaded ones
+void SessionStore::add(const string& sid, const string& userId, chrono::system_clock::time_point lastUse) {
+    Shard& shard = shardOf(sid);
+    lock_guard<mutex> lock(shard.shard_mutex);
+    shard.sessions[sid] = Session{userId, lastUse, lastUse};
+}
+
+// touch is set when persisted use time is old enough to be written again
+bool SessionStore::check(const string& sid, const string& userId, bool& touch) {
+    auto now = chrono::system_clock::now();
+    Shard& shard = shardOf(sid);
+    lock_guard<mutex> lock(shard.shard_mutex);
+
+    touch = false;
+
+    auto it = shard.sessions.find(sid);
+    if(it == shard.sessions.end() || it->second.userId != userId) {
+        misses++;
+        return false;
+    }
+
+    if(now - it->second.lastUse > chrono::seconds(SESSION_TTL)) {
+        shard.sessions.erase(it);
+        misses++;
+        return false;
+    }
+
+    it->second.lastUse = now;
+
+    if(now - it->second.persisted > chrono::seconds(SESSION_TOUCH_INTERVAL)) {
+        it->second.persisted = now;
+        touch = true;
+    }
+
+    hits++;
+    return true;
+}
+
+void SessionStore::remove(const string& sid) {
+    Shard& shard = shardOf(sid);
+    lock_guard<mutex> lock(shard.shard_mutex);
+    shard.sessions.erase(sid);
+}
+
+void SessionStore::removeUser(const string& userId) {
+    for(auto& shard: shards) {
+        lock_guard<mutex> lock(shard.shard_mutex);
+        for(auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+            if(it->second.userId == userId) {
+                it = shard.sessions.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+// returns number of dropped sessions
+size_t SessionStore::expire() {
+    auto threshold = chrono::system_clock::now() - chrono::seconds(SESSION_TTL);
+    size_t removed = 0;
+
+    for(auto& shard: shards) {
+        lock_guard<mutex> lock(shard.shard_mutex);
+        for(auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+            if(it->second.lastUse < threshold) {
+                it = shard.sessions.erase(it);
+                removed++;
+            } else {
+                it++;
+            }
+        }
+    }
+
+    return removed;
+}
+
+string SessionStore::stats() {
+    size_t count = 0;
+
+    for(auto& shard: shards) {
+        lock_guard<mutex> lock(shard.shard_mutex);
+        count += shard.sessions.size();
+    }
+
+    return to_string(count) + " sessions, " + to_string(hits.load()) + " hits, " + to_string(misses.load()) + " misses";
+}
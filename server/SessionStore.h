@@ -0,0 +1,41 @@
+#ifndef SERVER_SESSIONSTORE_H
+#define SERVER_SESSIONSTORE_H
+
+#include "main.h"
+
+#include <atomic>
+#include <unordered_map>
+
+#define SESSION_SHARDS 16
+
+// sessions of all users kept in memory, split into shards so RELOGINs of many connections don't wait on one lock
+// every successful check moves the expiry (sliding TTL), expired sessions are dropped on check and by expire()
+class SessionStore {
+private:
+    struct Session {
+        std::string userId;
+        std::chrono::system_clock::time_point lastUse;
+        std::chrono::system_clock::time_point persisted;
+    };
+
+    struct Shard {
+        std::mutex shard_mutex;
+        std::unordered_map<std::string, Session> sessions;
+    };
+
+    static Shard shards[SESSION_SHARDS];
+    static std::atomic<uint64_t> hits;
+    static std::atomic<uint64_t> misses;
+
+    static Shard& shardOf(const std::string&);
+
+public:
+    static void add(const std::string&, const std::string&, std::chrono::system_clock::time_point);
+    static bool check(const std::string&, const std::string&, bool&);
+    static void remove(const std::string&);
+    static void removeUser(const std::string&);
+    static size_t expire();
+    static std::string stats();
+};
+
+#endif //SERVER_SESSIONSTORE_H
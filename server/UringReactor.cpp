@@ -0,0 +1,464 @@
+#include "UringReactor.h"
+
+#ifdef HAVE_LIBURING
+
+#include <sys/eventfd.h>
+#include <fcntl.h>
+
+using namespace std;
+
+UringReactor::UringEntry::~UringEntry() {
+    if(pipeFds[0] != -1) {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+    }
+}
+
+UringReactor::UringReactor(int r_id, bool* s_e, Logger* logg, WorkerPool* w_p): Reactor(r_id, s_e, logg, w_p) {
+    l_id = "uring-reactor/" + to_string(id);
+    wakeOp.type = OP_WAKE;
+    wakeOp.entry = nullptr;
+}
+
+UringReactor::~UringReactor() {
+    join();
+
+    if(ringReady) {
+        io_uring_queue_exit(&ring);
+    }
+
+    if(wakeFd != -1) {
+        close(wakeFd);
+    }
+}
+
+// fails when kernel has no io_uring support, caller falls back to epoll
+bool UringReactor::start() {
+    int res = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0);
+
+    if(res < 0) {
+        logger->warn(l_id, string("io_uring unavailable: ") + strerror(-res));
+        return false;
+    }
+
+    ringReady = true;
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+
+    if(wakeFd == -1) {
+        logger->err(l_id, "error while creating eventfd", errno);
+        return false;
+    }
+
+    t = thread(&UringReactor::loop, this);
+    return true;
+}
+
+shared_ptr<Reactor::Entry> UringReactor::newEntry() {
+    shared_ptr<UringEntry> e = make_shared<UringEntry>();
+    e->readOp.type = OP_READ;
+    e->readOp.entry = e.get();
+    e->writeOp.type = OP_WRITE;
+    e->writeOp.entry = e.get();
+    return e;
+}
+
+// socket stays blocking, waiting for readiness is done by the kernel
+bool UringReactor::watch(Entry* e) {
+    e->client->setFilesSentByReactor(true);
+    return post(e);
+}
+
+// on reactor thread requests still in flight are completed by shutting the socket down,
+// entry is freed with the last completion
+void UringReactor::unwatch(Entry* e) {
+    UringEntry* ue = static_cast<UringEntry*>(e);
+    ue->closed = true;
+
+    if(ue->inflight > 0) {
+        shutdown(e->fd, SHUT_RDWR);
+    }
+}
+
+// called by workers, socket is armed again by reactor thread
+bool UringReactor::rearm(Entry* e) {
+    return post(e);
+}
+
+FileRing* UringReactor::fileRing() {
+    return this;
+}
+
+// called by workers, op is turned into a request by reactor thread with the next batch
+bool UringReactor::submitFile(FileOp* op) {
+    {
+        lock_guard<mutex> lock(posted_mutex);
+        if(stopping) {
+            return false;
+        }
+        postedFiles.push_back(op);
+    }
+
+    uint64_t one = 1;
+
+    if(write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        logger->err(l_id, "error while waking reactor", errno);
+    }
+
+    return true;
+}
+
+bool UringReactor::post(Entry* e) {
+    shared_ptr<Entry> ref;
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        auto it = entries.find(e->fd);
+        if(it == entries.end() || it->second.get() != e) {
+            return false;
+        }
+        ref = it->second;
+    }
+
+    {
+        lock_guard<mutex> lock(posted_mutex);
+        posted.push_back(ref);
+    }
+
+    uint64_t one = 1;
+
+    if(write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        logger->err(l_id, "error while waking reactor", errno);
+    }
+
+    return true;
+}
+
+struct io_uring_sqe* UringReactor::getSqe() {
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+
+    if(sqe == nullptr) {
+        // submission queue full, push what is there to the kernel
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+
+    return sqe;
+}
+
+void UringReactor::submitWake() {
+    struct io_uring_sqe* sqe = getSqe();
+
+    if(sqe == nullptr) {
+        logger->err(l_id, "no free submission queue entry for eventfd");
+        return;
+    }
+
+    io_uring_prep_read(sqe, wakeFd, &wakeBuf, sizeof(wakeBuf), 0);
+    io_uring_sqe_set_data(sqe, &wakeOp);
+    pendingOps++;
+}
+
+// also submits the rest of op after short read or write
+void UringReactor::submitFileOp(FileOp* file) {
+    struct io_uring_sqe* sqe = getSqe();
+
+    if(sqe == nullptr) {
+        logger->err(l_id, "no free submission queue entry for file");
+        file->complete(file, -EAGAIN);
+        delete file;
+        return;
+    }
+
+    Op* op = new Op;
+    op->type = OP_FILE;
+    op->entry = nullptr;
+    op->file = file;
+
+    if(file->write) {
+        io_uring_prep_write(sqe, file->fd, file->buf.data() + file->done, (unsigned int) (file->buf.size() - file->done),
+                            file->offset + file->done);
+    } else {
+        io_uring_prep_read(sqe, file->fd, &file->buf[file->done], (unsigned int) (file->buf.size() - file->done),
+                           file->offset + file->done);
+    }
+
+    io_uring_sqe_set_data(sqe, op);
+    pendingOps++;
+}
+
+// same rules as epoll reactor: pending output is sent before next commands are read
+void UringReactor::arm(const shared_ptr<Entry>& ref) {
+    UringEntry* ue = static_cast<UringEntry*>(ref.get());
+
+    if(ue->closed) {
+        return;
+    }
+
+    if(ue->inPipe > 0 || ue->client->hasPendingOutput()) {
+        if(!ue->writing && !submitWrite(ue)) {
+            closeEntry(ue);
+            return;
+        }
+    } else if(!ue->reading) {
+        int iovcnt = ue->client->readBuffers(ue->readIov, ue->readRequested);
+
+        if(iovcnt == 0) {
+            logger->err(l_id, "receive buffer full without complete frame");
+            closeEntry(ue);
+            return;
+        }
+
+        struct io_uring_sqe* sqe = getSqe();
+
+        if(sqe == nullptr) {
+            logger->err(l_id, "no free submission queue entry for read");
+            closeEntry(ue);
+            return;
+        }
+
+        memset(&ue->readMsg, 0, sizeof(ue->readMsg));
+        ue->readMsg.msg_iov = ue->readIov;
+        ue->readMsg.msg_iovlen = (size_t) iovcnt;
+
+        io_uring_prep_recvmsg(sqe, ue->fd, &ue->readMsg, 0);
+        io_uring_sqe_set_data(sqe, &ue->readOp);
+        ue->reading = true;
+        ue->inflight++;
+        pendingOps++;
+    }
+
+    if(ue->inflight > 0) {
+        ue->self = ref;
+    }
+}
+
+// file parts go file -> pipe -> socket with two splices, rest of output with sendmsg
+bool UringReactor::submitWrite(UringEntry* ue) {
+    int fileFd;
+    off_t offset;
+    size_t len;
+    bool file = ue->inPipe == 0 && ue->client->frontFile(fileFd, offset, len);
+
+    if(file && ue->pipeFds[0] == -1 && pipe2(ue->pipeFds, O_CLOEXEC) == -1) {
+        logger->err(l_id, "error while creating pipe", errno);
+        return false;
+    }
+
+    struct io_uring_sqe* sqe = getSqe();
+
+    if(sqe == nullptr) {
+        logger->err(l_id, "no free submission queue entry for write");
+        return false;
+    }
+
+    if(ue->inPipe > 0) {
+        io_uring_prep_splice(sqe, ue->pipeFds[0], -1, ue->fd, -1, (unsigned int) ue->inPipe, 0);
+        ue->writeKind = WRITE_PIPE_OUT;
+    } else if(file) {
+        io_uring_prep_splice(sqe, fileFd, offset, ue->pipeFds[1], -1, (unsigned int) min(len, (size_t) URING_SPLICE_CHUNK), 0);
+        ue->writeKind = WRITE_FILE_IN;
+    } else {
+        memset(&ue->writeMsg, 0, sizeof(ue->writeMsg));
+        ue->writeMsg.msg_iov = ue->writeIov;
+        ue->writeMsg.msg_iovlen = (size_t) ue->client->writeBuffers(ue->writeIov, URING_MAX_IOV);
+
+        io_uring_prep_sendmsg(sqe, ue->fd, &ue->writeMsg, MSG_NOSIGNAL);
+        ue->writeKind = WRITE_MSG;
+    }
+
+    io_uring_sqe_set_data(sqe, &ue->writeOp);
+    ue->writing = true;
+    ue->inflight++;
+    pendingOps++;
+    return true;
+}
+
+bool UringReactor::onWriteCompleted(UringEntry* ue, int res) {
+    if(ue->writeKind == WRITE_MSG) {
+        return ue->client->onSent(res < 0 ? -1 : res, res < 0 ? -res : 0);
+    }
+
+    if(res == 0 && ue->writeKind == WRITE_FILE_IN) {
+        // file is shorter than expected
+        return ue->client->onSent(-1, EIO);
+    }
+
+    if(res < 0) {
+        return ue->client->onSent(-1, -res);
+    }
+
+    if(ue->writeKind == WRITE_FILE_IN) {
+        // bytes in the pipe are already taken out of the output queue
+        ue->inPipe = (size_t) res;
+        return ue->client->onSent(res, 0);
+    }
+
+    ue->inPipe -= (size_t) res;
+    return true;
+}
+
+void UringReactor::handleCompletion(Op* op, int res) {
+    pendingOps--;
+
+    if(op->type == OP_FILE) {
+        FileOp* file = op->file;
+        delete op;
+
+        if(res > 0 && file->done + res < file->buf.size()) {
+            file->done += res;
+            submitFileOp(file);
+            return;
+        }
+
+        file->complete(file, res < 0 ? res : (int) (file->done + res));
+        delete file;
+        return;
+    }
+
+    if(op->type == OP_WAKE) {
+        vector<shared_ptr<Entry> > toArm;
+        vector<FileOp*> files;
+
+        {
+            lock_guard<mutex> lock(posted_mutex);
+            toArm.swap(posted);
+            files.swap(postedFiles);
+        }
+
+        for(auto file: files) {
+            submitFileOp(file);
+        }
+
+        for(auto& ref: toArm) {
+            arm(ref);
+        }
+
+        if(!(*should_exit)) {
+            submitWake();
+        }
+        return;
+    }
+
+    UringEntry* ue = op->entry;
+
+    // bookkeeping is done first, after dispatch the entry belongs to a worker
+    shared_ptr<Entry> ref = ue->self;
+    ue->inflight--;
+
+    if(ue->inflight == 0) {
+        ue->self.reset();
+    }
+
+    if(op->type == OP_READ) {
+        ue->reading = false;
+    } else {
+        ue->writing = false;
+    }
+
+    if(ue->closed) {
+        return;
+    }
+
+    bool ok;
+
+    if(op->type == OP_READ) {
+        ok = ue->client->onReceived(res < 0 ? -1 : res, ue->readRequested, res < 0 ? -res : 0);
+    } else {
+        ok = onWriteCompleted(ue, res);
+    }
+
+    if(!ok) {
+        closeEntry(ue);
+        return;
+    }
+
+    if(dispatch(ue)) {
+        return;
+    }
+
+    arm(ref);
+}
+
+void UringReactor::reap() {
+    struct io_uring_cqe* cqe;
+    unsigned head;
+    unsigned count = 0;
+
+    io_uring_for_each_cqe(&ring, head, cqe) {
+        handleCompletion((Op*) io_uring_cqe_get_data(cqe), cqe->res);
+        count++;
+    }
+
+    io_uring_cq_advance(&ring, count);
+}
+
+void UringReactor::loop() {
+    logger->log(l_id, "started");
+
+    submitWake();
+
+    while(!(*should_exit)) {
+        struct io_uring_cqe* cqe;
+        struct __kernel_timespec ts = {1, 0};
+
+        io_uring_submit(&ring);
+
+        int res = io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+
+        if(res < 0 && res != -ETIME && res != -EINTR) {
+            logger->err(l_id, "error while waiting for completions", -res);
+            break;
+        }
+
+        reap();
+    }
+
+    vector<shared_ptr<Entry> > toClose;
+
+    {
+        lock_guard<mutex> lock(entries_mutex);
+        for(auto& e: entries) {
+            toClose.push_back(e.second);
+        }
+    }
+
+    for(auto& e: toClose) {
+        closeEntry(e.get());
+    }
+
+    toClose.clear();
+
+    // file ops posted from now on are done by workers themselves, ones not submitted yet are cancelled
+    vector<FileOp*> files;
+
+    {
+        lock_guard<mutex> lock(posted_mutex);
+        stopping = true;
+        files.swap(postedFiles);
+    }
+
+    for(auto file: files) {
+        file->complete(file, -ECANCELED);
+        delete file;
+    }
+
+    // kernel may still write into buffers of closed connections, wait for their completions
+    uint64_t one = 1;
+    if(write(wakeFd, &one, sizeof(one)) != sizeof(one)) {
+        logger->err(l_id, "error while completing wake-up read", errno);
+    }
+
+    for(int i=0; i<10 && pendingOps > 0; i++) {
+        struct io_uring_cqe* cqe;
+        struct __kernel_timespec ts = {0, 100000000};
+
+        io_uring_submit(&ring);
+        io_uring_wait_cqe_timeout(&ring, &cqe, &ts);
+        reap();
+    }
+
+    logger->log(l_id, "closed");
+}
+
+#endif //HAVE_LIBURING
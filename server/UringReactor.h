@@ -0,0 +1,101 @@
+#ifndef SERVER_URINGREACTOR_H
+#define SERVER_URINGREACTOR_H
+
+#include "Reactor.h"
+#include "FileIO.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#define URING_QUEUE_DEPTH 4096
+#define URING_MAX_IOV FLUSH_MAX_IOV
+// file parts are spliced through a pipe, default pipe capacity
+#define URING_SPLICE_CHUNK 65536
+
+// reactor submitting socket reads and writes as io_uring requests, completions of all
+// connections are reaped in batches, so one io_uring_enter serves many transfers
+// ring is used only by the reactor thread, other threads post re-arms through eventfd
+// workers of its connections post file reads and writes of chunk I/O the same way, see FileOps
+class UringReactor : public Reactor, public FileRing {
+private:
+    enum OpType {
+        OP_READ,
+        OP_WRITE,
+        OP_WAKE,
+        OP_FILE,
+    };
+
+    enum WriteKind {
+        WRITE_MSG,
+        WRITE_FILE_IN,
+        WRITE_PIPE_OUT,
+    };
+
+    struct UringEntry;
+
+    struct Op {
+        OpType type;
+        UringEntry* entry;
+        FileOp* file = nullptr;
+    };
+
+    struct UringEntry : public Entry {
+        Op readOp;
+        Op writeOp;
+        struct iovec readIov[2];
+        struct msghdr readMsg;
+        size_t readRequested = 0;
+        struct iovec writeIov[URING_MAX_IOV];
+        struct msghdr writeMsg;
+        WriteKind writeKind = WRITE_MSG;
+        int pipeFds[2] = {-1, -1};
+        size_t inPipe = 0;
+        int inflight = 0;
+        bool reading = false;
+        bool writing = false;
+        bool closed = false;
+        // keeps entry alive while kernel still uses its buffers
+        std::shared_ptr<Entry> self;
+
+        ~UringEntry();
+    };
+
+    struct io_uring ring;
+    bool ringReady = false;
+    int wakeFd = -1;
+    uint64_t wakeBuf = 0;
+    Op wakeOp;
+    size_t pendingOps = 0;
+    std::mutex posted_mutex;
+    std::vector<std::shared_ptr<Entry> > posted;
+    std::vector<FileOp*> postedFiles;
+    bool stopping = false;
+
+    std::shared_ptr<Entry> newEntry() override;
+    bool watch(Entry*) override;
+    void unwatch(Entry*) override;
+    void loop() override;
+    bool rearm(Entry*) override;
+    FileRing* fileRing() override;
+
+    bool post(Entry*);
+    void arm(const std::shared_ptr<Entry>&);
+    bool submitWrite(UringEntry*);
+    bool onWriteCompleted(UringEntry*, int);
+    void submitWake();
+    void submitFileOp(FileOp*);
+    void reap();
+    void handleCompletion(Op*, int);
+    struct io_uring_sqe* getSqe();
+
+public:
+    UringReactor(int, bool*, Logger*, WorkerPool*);
+    ~UringReactor() override;
+    bool start() override;
+    bool submitFile(FileOp*) override;
+};
+
+#endif //HAVE_LIBURING
+
+#endif //SERVER_URINGREACTOR_H
@@ -1,14 +1,16 @@
 #include "User.h"
+#include "utils.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fstream>
 #include <functional>
+#include <fcntl.h>
 
-using namespace mongocxx;
 using std::map;
 using std::vector;
 
-using bsoncxx::builder::basic::make_array;
+using bsoncxx::builder::basic::kvp;
+using bsoncxx::builder::basic::make_document;
 
 User::User(oid& id1, UserManager& u_m): id(id1), user_manager(u_m), authorized(false), valid(true), currentInFileValid(false) {}
 
@@ -99,13 +101,13 @@ bool User::logout(string& sid) {
 }
 
 
-bool User::listFilesinPath(const string& path, vector<UFile>& res) {
-    return user_manager.listFilesinPath(id, path, res);
+bool User::listFilesinPath(const string& path, vector<UFile>& res, const string& after, uint32_t limit) {
+    return user_manager.listFilesinPath(id, path, res, after, limit);
 }
 
 // also adds directory
 uint8_t User::addFile(UFile& file) {
-    currentInFileValid = false;
+    endUpload();
     if(file.filename[0] != '/') {
         return ADD_FILE_WRONG_DIR;
     }
@@ -131,14 +133,23 @@ uint8_t User::addFile(UFile& file) {
             UFile tmp_file;
             if(user_manager.getYourFileMetadata(id, file.filename, tmp_file, FILE_REGULAR)) {
                 if(!tmp_file.isValid && tmp_file.size == file.size && tmp_file.hash == file.hash) {
-                    uint64_t spaceNeeded = tmp_file.size - tmp_file.lastValid;
-                    uint64_t availableSpace;
-                    if(!user_manager.getFreeSpace(id, availableSpace) || availableSpace < spaceNeeded) {
-                        return ADD_FILE_NO_SPACE;
+                    // space of parallel upload in progress is already reserved by its registry entry
+                    uint64_t spaceNeeded = 0;
+                    if(!user_manager.isParallelUploadActive(tmp_file.id)) {
+                        spaceNeeded = tmp_file.size - tmp_file.lastValid;
+                        if(!user_manager.reserveSpace(id, spaceNeeded)) {
+                            return ADD_FILE_NO_SPACE;
+                        }
                     }
                     currentInFile = tmp_file;
                     currentInFile.owner = id;
+                    currentInFile.flushedValid = tmp_file.lastValid;
+                    currentInFile.diskValid = tmp_file.lastValid;
+                    currentInFile.syncedValid = tmp_file.lastValid;
+                    currentInFile.lastFlush = std::chrono::steady_clock::now();
+                    currentInFile.reserved = spaceNeeded;
                     currentInFileValid = true;
+                    user_manager.preallocate(currentInFile);
                     return ADD_FILE_CONTINUE_OK;
                 }
             }
@@ -149,24 +160,35 @@ uint8_t User::addFile(UFile& file) {
 
     oid fileId;
 
+    // whole declared size is reserved before the file is created
+    if(file.type == FILE_REGULAR && !user_manager.reserveSpace(id, file.size)) {
+        return ADD_FILE_NO_SPACE;
+    }
+
     if(user_manager.addNewFile(id, file, dir, fileId)) {
         if(file.type == FILE_REGULAR) {
-            uint64_t availableSpace;
-            if(!user_manager.getFreeSpace(id, availableSpace) || availableSpace < file.size) {
-                return ADD_FILE_NO_SPACE;
-            }
-
             currentInFile = file;
             currentInFile.isValid = false;
             currentInFile.lastValid = 0;
             currentInFile.id = fileId;
             currentInFile.owner = id;
+            currentInFile.flushedValid = 0;
+            currentInFile.diskValid = 0;
+            currentInFile.syncedValid = 0;
+            currentInFile.lastFlush = std::chrono::steady_clock::now();
+            currentInFile.reserved = file.size;
             currentInFileValid = true;
+            user_manager.preallocate(currentInFile);
         }
 
         return ADD_FILE_OK;
     }
 
+    if(file.type == FILE_REGULAR) {
+        uint64_t reserved = file.size;
+        user_manager.releaseSpace(id, reserved);
+    }
+
     return ADD_FILE_INTERNAL_ERROR;
 }
 
@@ -178,29 +200,99 @@ bool User::isCurrentInFileValid() {
     return currentInFileValid;
 }
 
-bool User::addFileChunk(const string& chunk) {
+uint8_t User::addFileChunk(const string& chunk) {
     if(!currentInFileValid) {
-        return false;
-    }
-
-    uint64_t freeSpace;
-    if(!user_manager.getFreeSpace(id, freeSpace) || freeSpace < chunk.size()) {
-        return false;
+        return ADD_FILE_NOT_STARTED;
     }
 
     if(currentInFile.size < currentInFile.lastValid + chunk.size()) {
-        return false;
+        return ADD_FILE_TOO_BIG;
     }
 
-    if(!user_manager.addFileChunk(currentInFile, chunk)) {
-        return false;
+    if(!user_manager.addFileChunk(currentInFile, chunk, writeBehind)) {
+        return ADD_FILE_INTERNAL_ERROR;
     }
 
     if(currentInFile.size != currentInFile.lastValid) {
+        return ADD_FILE_OK;
+    }
+
+    if(!user_manager.flushUpload(currentInFile, writeBehind)) {
+        return ADD_FILE_INTERNAL_ERROR;
+    }
+
+    bool valid = user_manager.validateFile(currentInFile);
+
+    user_manager.releaseSpace(id, currentInFile.reserved);
+
+    return valid ? ADD_FILE_OK : ADD_FILE_WRONG_HASH;
+}
+
+// writes progress of unfinished sequential upload and gives back its reservation
+// called before next METADATA and when connection is closed, resumed upload reserves again
+bool User::endUpload() {
+    if(!currentInFileValid) {
         return true;
     }
 
-    return user_manager.validateFile(currentInFile);
+    bool ok = true;
+
+    if(!currentParallel && !currentInFile.isValid) {
+        ok = user_manager.flushUpload(currentInFile, writeBehind);
+    }
+
+    string().swap(writeBehind);
+
+    user_manager.releaseSpace(id, currentInFile.reserved);
+
+    currentInFileValid = false;
+    currentParallel.reset();
+
+    return ok;
+}
+
+bool User::reconcileUpload() {
+    return currentInFileValid && user_manager.reconcileUpload(currentInFile);
+}
+
+// joins (or starts) parallel upload of current file, fails when it was already started sequentially
+bool User::startParallelUpload() {
+    if(!currentInFileValid) {
+        return false;
+    }
+
+    currentParallel = user_manager.joinParallelUpload(currentInFile);
+
+    return currentParallel != nullptr;
+}
+
+bool User::isParallelUpload() {
+    return currentInFileValid && user_manager.hasParallelUpload(currentInFile);
+}
+
+uint8_t User::addFileRange(uint64_t offset, const string& chunk) {
+    if(!currentInFileValid || !currentParallel) {
+        return ADD_FILE_NOT_STARTED;
+    }
+
+    uint8_t wyn = user_manager.addFileRange(*currentParallel, offset, chunk);
+
+    std::lock_guard<std::mutex> lock(currentParallel->mutex);
+    currentInFile.lastValid = currentParallel->file.lastValid;
+    currentInFile.isValid = currentParallel->file.isValid;
+
+    return wyn;
+}
+
+bool User::getReceivedRanges(string& bitmap) {
+    if(!currentParallel) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(currentParallel->mutex);
+    bitmap.assign(currentParallel->ranges.begin(), currentParallel->ranges.end());
+
+    return true;
 }
 
 bool User::isAdmin() {
@@ -261,7 +353,7 @@ bool User::changeUserPasswd(const string& username, const string& new_passwd) {
     return user_manager.runAsUser(username, [&new_passwd, this](oid& id) -> bool {return user_manager.setPasswd(id, new_passwd);});
 }
 
-bool User::initFileDownload(const string& filename, const uint64_t pos, string& chunk) {
+bool User::openFileDownload(const string& filename, const uint64_t pos) {
     currentOutFileValid = false;
     if(!user_manager.yourFileExists(id, filename)) {
         return false;
@@ -277,11 +369,13 @@ bool User::initFileDownload(const string& filename, const uint64_t pos, string&
 
     currentOutFileValid = true;
     currentOutFile.lastValid = pos;
+    user_manager.startDownload(currentOutFile);
 
-    return getFileChunk(chunk);
+    return true;
 }
 
-bool User::initSharedFileDownload(const string& filename, const string& ownerUsername, const string& hash, const uint64_t pos, string& chunk) {
+bool User::openSharedFileDownload(const string& filename, const string& ownerUsername, const string& hash, const uint64_t pos) {
+    currentOutFileValid = false;
     oid ownerId, fileId;
     if(!user_manager.getUserId(ownerUsername, ownerId)) {
         return false;
@@ -297,9 +391,7 @@ bool User::initSharedFileDownload(const string& filename, const string& ownerUse
         return false;
     }
 
-    UFile file;
-
-    if(!user_manager.getYourFileMetadata(ownerId, realFilename, file, FILE_REGULAR)) {
+    if(!user_manager.getYourFileMetadata(ownerId, realFilename, currentOutFile, FILE_REGULAR)) {
         return false;
     }
 
@@ -309,8 +401,38 @@ bool User::initSharedFileDownload(const string& filename, const string& ownerUse
 
     currentOutFileValid = true;
     currentOutFile.lastValid = pos;
+    user_manager.startDownload(currentOutFile);
+
+    return true;
+}
+
+// like getFileChunk, but only says which part of which file to send, without reading it
+bool User::getFileSegment(uint32_t maxLen, std::shared_ptr<FileHandle>& file, uint64_t& offset, uint32_t& len) {
+    if(!currentOutFileValid) {
+        return false;
+    }
+
+    file = FileCache::acquire(currentOutFile.id.to_string(), currentOutFile.realPath, false);
+    if(!file) {
+        return false;
+    }
+
+    user_manager.adviseReadAhead(currentOutFile, file->fd);
+
+    offset = currentOutFile.lastValid;
+    len = (uint32_t) ((currentOutFile.size - offset > maxLen) ? maxLen : (currentOutFile.size - offset));
+
+    currentOutFile.lastValid += len;
+
+    if(currentOutFile.lastValid == currentOutFile.size) {
+        currentOutFileValid = false;
+    }
+
+    return true;
+}
 
-    return getFileChunk(chunk);
+const UFile& User::getCurrentOutFileMetadata() {
+    return currentOutFile;
 }
 
 bool User::getFileChunk(string& chunk) {
@@ -416,44 +538,192 @@ void UserManager::garbageCollectorMain(std::condition_variable& g_cond, bool& sh
     while (!should_exit) {
         logger.log("UserManager", "running garbage collector");
         collectOldUnfinished();
+        expireSessions();
         std::unique_lock<std::mutex> lock(g_mutex);
         g_cond.wait_for(lock, std::chrono::minutes(5));
     }
 }
 
+// rows decoded straight from cursor, see Database::findRows
+static const FieldDecoder<URecord> USER_RECORD_FIELDS[] = {
+        {"username", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.username); }},
+        {"name", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.name); }},
+        {"surname", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.surname); }},
+        {"homeDir", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.homeDir); }},
+        {"password", [](const bsoncxx::document::element& el, URecord& u) { return Database::readBinary(el, u.passwordHash); }},
+        {"role", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.role); }},
+        {"totalSpace", [](const bsoncxx::document::element& el, URecord& u) { return Database::read(el, u.totalSpace); }},
+};
+
+// freeSpace is kept in usedSpace until the whole row is read
+static const FieldDecoder<UDetails> USER_DETAILS_FIELDS[] = {
+        {"username", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.username); }},
+        {"name", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.name); }},
+        {"surname", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.surname); }},
+        {"role", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.role); }},
+        {"totalSpace", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.totalSpace); }},
+        {"freeSpace", [](const bsoncxx::document::element& el, UDetails& u) { return Database::read(el, u.usedSpace); }},
+};
+
+static const FieldDecoder<UFile> FILE_FIELDS[] = {
+        {"_id", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.id); }},
+        {"owner", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.owner); }},
+        {"filename", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.filename); }},
+        {"size", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.size); }},
+        {"creationDate", [](const bsoncxx::document::element& el, UFile& f) { return Database::readDate(el, f.creation_date); }},
+        {"type", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.type); }},
+        {"hash", [](const bsoncxx::document::element& el, UFile& f) { return Database::readBinary(el, f.hash); }},
+        {"isValid", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.isValid); }},
+        {"lastValid", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.lastValid); }},
+        {"sharedWith", [](const bsoncxx::document::element& el, UFile& f) { return Database::readNotEmpty(el, f.isShared); }},
+};
+
+// bytes stored for file, summed when path is deleted
+static const FieldDecoder<UFile> SIZE_FIELDS[] = {
+        {"lastValid", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.lastValid); }},
+};
+
+// owner, filename and lastChunkTime of unfinished uploads
+static const FieldDecoder<UFile> UNFINISHED_FIELDS[] = {
+        {"owner", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.owner); }},
+        {"filename", [](const bsoncxx::document::element& el, UFile& f) { return Database::read(el, f.filename); }},
+};
+
+std::mutex UserManager::users_mutex;
+std::map<string, URecord> UserManager::userRecords;
+std::map<string, oid> UserManager::userIds;
+std::map<string, uint64_t> UserManager::userGenerations;
+uint64_t UserManager::userIdsGeneration = 0;
+
+// copy of cached record, missing one is loaded from database with one query
+bool UserManager::getUserRecord(oid& id, URecord& res) {
+    uint64_t generation;
+
+    {
+        std::lock_guard<std::mutex> lock(users_mutex);
+        auto it = userRecords.find(id.to_string());
+        if(it != userRecords.end()) {
+            res = it->second;
+            return true;
+        }
+        generation = userGenerations[id.to_string()];
+    }
+
+    URecord rec;
+    bool found = false;
+
+    if(!db.findRows<URecord>("users", make_document(kvp("_id", id)), USER_RECORD_FIELDS, [&rec, &found](URecord& row) {
+        rec = row;
+        found = true;
+        return false;
+    }) || !found || rec.username.empty()) {
+        return false;
+    }
+
+    res = rec;
+
+    std::lock_guard<std::mutex> lock(users_mutex);
+    // changed while it was read, next call reads it again
+    if(userGenerations[id.to_string()] != generation) {
+        return true;
+    }
+    userRecords[id.to_string()] = rec;
+    userIds[rec.username] = id;
+
+    return true;
+}
+
+void UserManager::invalidateUser(oid& id) {
+    std::lock_guard<std::mutex> lock(users_mutex);
+    userGenerations[id.to_string()]++;
+    userIdsGeneration++;
+    auto it = userRecords.find(id.to_string());
+    if(it != userRecords.end()) {
+        userIds.erase(it->second.username);
+        userRecords.erase(it);
+    }
+}
+
 bool UserManager::getName(oid& id, string& res) {
-    return db.getField("users", "name", id, res);
+    URecord rec;
+    if(!getUserRecord(id, rec)) {
+        return false;
+    }
+
+    res = rec.name;
+    return true;
 }
 
 bool UserManager::getSurname(oid& id, string& res) {
-    return db.getField("users", "surname", id, res);
+    URecord rec;
+    if(!getUserRecord(id, rec)) {
+        return false;
+    }
+
+    res = rec.surname;
+    return true;
 }
 
 bool UserManager::getHomeDir(oid& id, string& res) {
-    return db.getField("users", "homeDir", id, res);
+    URecord rec;
+    if(!getUserRecord(id, rec)) {
+        return false;
+    }
+
+    res = rec.homeDir;
+    return true;
 }
 
 bool UserManager::setName(oid& id, string& res) {
-    return db.setField("users", "name", id, res);
+    bool ok = db.setField("users", "name", id, res);
+    invalidateUser(id);
+    return ok;
 }
 
 bool UserManager::getUserRole(oid& id, uint64_t& role) {
-    return db.getField("users", "role", id, (int64_t&)role);
+    URecord rec;
+    if(!getUserRecord(id, rec)) {
+        return false;
+    }
+
+    role = rec.role;
+    return true;
 }
 
 bool UserManager::getUserId(const string& username, oid& id) {
-    return db.getId("users", "username", username, id);
+    uint64_t generation;
+
+    {
+        std::lock_guard<std::mutex> lock(users_mutex);
+        auto it = userIds.find(username);
+        if(it != userIds.end()) {
+            id = it->second;
+            return true;
+        }
+        generation = userIdsGeneration;
+    }
+
+    if(!db.getId("users", "username", username, id)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(users_mutex);
+    // some user was changed or deleted while it was looked up, it could be this one
+    if(userIdsGeneration == generation) {
+        userIds[username] = id;
+    }
+
+    return true;
 }
 
 bool UserManager::getPasswdHash(oid& id, string& res) {
-    const uint8_t* tmp_b;
-    uint32_t tmp_s;
-    if(db.getField("users", "password", id, tmp_b, tmp_s)) {
-        res = string((const char*) tmp_b, tmp_s);
-        return true;
+    URecord rec;
+    if(!getUserRecord(id, rec) || rec.passwordHash.empty()) {
+        return false;
     }
 
-    return false;
+    res = rec.passwordHash;
+    return true;
 }
 
 bool UserManager::checkPasswd(oid& id, const string& passwd) {
@@ -481,57 +751,137 @@ bool UserManager::setPasswd(oid& id, const string& passwd) {
     SHA512((const uint8_t*) passwd.c_str(), passwd.size(), digest);
 
     string hash((char*)digest, SHA512_DIGEST_LENGTH);
+    delete[] digest;
+
+    bool ok = db.setField("users", "password", id, (const uint8_t*) hash.c_str(), (uint32_t) hash.size());
+    invalidateUser(id);
+    return ok;
+}
+
+std::once_flag UserManager::sessions_loaded;
+
+// time in users collection is the last persisted use of session, expired ones are skipped
+void UserManager::loadSessions() {
+    if(!SESSION_PERSIST) {
+        return;
+    }
+
+    auto threshold = std::chrono::system_clock::now() - std::chrono::seconds(SESSION_TTL);
+    size_t count = 0;
+
+    bool ok = db.findDocs("users", make_document(kvp("sids", make_document(kvp("$exists", true)))), [&count, threshold](const bsoncxx::document::view& doc) {
+        auto id = doc["_id"];
+        auto sids = doc["sids"];
+
+        if(id.type() != bsoncxx::type::k_oid || sids.type() != bsoncxx::type::k_array) {
+            return;
+        }
+
+        for(auto entry: sids.get_array().value) {
+            if(entry.type() != bsoncxx::type::k_document) {
+                continue;
+            }
 
-    return db.setField("users", "password", id, (const uint8_t*) hash.c_str(), (uint32_t) hash.size());
+            auto sid = entry.get_document().value["sid"];
+            auto time = entry.get_document().value["time"];
+
+            if(sid.type() != bsoncxx::type::k_binary || time.type() != bsoncxx::type::k_date) {
+                continue;
+            }
+
+            std::chrono::system_clock::time_point lastUse(time.get_date().value);
+            if(lastUse < threshold) {
+                continue;
+            }
+
+            SessionStore::add(string((const char*) sid.get_binary().bytes, sid.get_binary().size), id.get_oid().value.to_string(), lastUse);
+            count++;
+        }
+    });
+
+    if(ok) {
+        logger.info("UserManager", "loaded " + std::to_string(count) + " sessions");
+    } else {
+        logger.warn("UserManager", "couldn't load sessions, users have to log in again");
+    }
+}
+
+void UserManager::expireSessions() {
+    size_t removed = SessionStore::expire();
+
+    if(removed > 0) {
+        logger.log("UserManager", "expired " + std::to_string(removed) + " sessions");
+    }
+
+    if(SESSION_PERSIST) {
+        auto threshold = std::chrono::system_clock::now() - std::chrono::seconds(SESSION_TTL);
+        db.updateMany("users", make_document(kvp("sids.time", make_document(kvp("$lt", bsoncxx::types::b_date(threshold))))),
+                      make_document(kvp("$pull", make_document(kvp("sids", make_document(kvp("time", make_document(
+                              kvp("$lt", bsoncxx::types::b_date(threshold))
+                      ))))))));
+    }
 }
 
 bool UserManager::addSid(oid& id, string& sid) {
-    return db.pushValToArr("users", "sids", id, make_document(
+    std::call_once(sessions_loaded, &UserManager::loadSessions, this);
+
+    auto now = std::chrono::system_clock::now();
+
+    if(SESSION_PERSIST && !db.pushValToArr("users", "sids", id, make_document(
             kvp("sid", Database::stringToBinary(sid)),
-            kvp("time", bsoncxx::types::b_date(std::chrono::system_clock::now()))
-    ));
+            kvp("time", bsoncxx::types::b_date(now))
+    ))) {
+        return false;
+    }
+
+    SessionStore::add(sid, id.to_string(), now);
+    return true;
 }
 
+// answered from memory, database is written only when session use time is refreshed there
 bool UserManager::checkSid(oid& id, string& sid) {
-    uint64_t tmp_l = 0;
-    return (db.countField("users", "sids.sid", id, (const uint8_t*) sid.c_str(), sid.size(), tmp_l) && tmp_l == 1);
+    std::call_once(sessions_loaded, &UserManager::loadSessions, this);
+
+    bool touch;
+    if(!SessionStore::check(sid, id.to_string(), touch)) {
+        return false;
+    }
+
+    if(SESSION_PERSIST && touch) {
+        db.updateMany("users", make_document(kvp("_id", id), kvp("sids.sid", Database::stringToBinary(sid))),
+                      make_document(kvp("$set", make_document(kvp("sids.$.time", bsoncxx::types::b_date(std::chrono::system_clock::now()))))));
+    }
+
+    return true;
 }
 
 bool UserManager::removeSid(oid& id, string &sid) {
-    return db.removeFieldFromArray("users", "sids", id, make_document(kvp("sid", Database::stringToBinary(sid))));
-}
+    SessionStore::remove(sid);
 
-bool UserManager::parseUserDetails(map<string, bsoncxx::types::value>& usr, UDetails& tmp_u) {
-    try {
-        tmp_u.username = bsoncxx::string::to_string(usr.find("username")->second.get_utf8().value);
-        tmp_u.name = bsoncxx::string::to_string(usr.find("name")->second.get_utf8().value);
-        tmp_u.surname = bsoncxx::string::to_string(usr.find("surname")->second.get_utf8().value);
-        tmp_u.role = (uint8_t) usr.find("role")->second.get_int64().value;
-        tmp_u.totalSpace = (uint64_t) usr.find("totalSpace")->second.get_int64().value;
-        uint64_t freeSpace = (uint64_t) usr.find("freeSpace")->second.get_int64().value;
-        tmp_u.usedSpace = tmp_u.totalSpace - freeSpace;
-    } catch (const std::exception& ex) {
-        logger.err(l_id, "error while parsing user details: " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger.err(l_id, "error while parsing user details: unknown error");
-        return false;
+    if(!SESSION_PERSIST) {
+        return true;
     }
-    return true;
+
+    return db.removeFieldFromArray("users", "sids", id, make_document(kvp("sid", Database::stringToBinary(sid))));
 }
 
+// answered from user record and quota ledger, without database once both are loaded
 bool UserManager::getUserDetails(oid id, UDetails& userDetails) {
-    map<string, bsoncxx::types::value> mmap;
-    vector<string> fields{"username", "surname", "name", "role", "totalSpace", "freeSpace"};
-    for(string field: fields) {
-        mmap.emplace(field, bsoncxx::types::value(bsoncxx::types::b_null{}));
-    }
+    URecord rec;
+    uint64_t freeSpace;
 
-    if(!db.getFields("users", id, mmap)) {
+    if(!getUserRecord(id, rec) || !getFreeSpace(id, freeSpace)) {
         return false;
     }
 
-    return parseUserDetails(mmap, userDetails);
+    userDetails.username = rec.username;
+    userDetails.name = rec.name;
+    userDetails.surname = rec.surname;
+    userDetails.role = (uint8_t) rec.role;
+    userDetails.totalSpace = rec.totalSpace;
+    userDetails.usedSpace = rec.totalSpace - freeSpace;
+
+    return true;
 }
 
 bool UserManager::registerUser(UDetails& user, const string& password, bool& userTaken) {
@@ -580,35 +930,23 @@ bool UserManager::registerUser(UDetails& user, const string& password, bool& use
 }
 
 bool UserManager::listAllUsers(std::vector<UDetails>& res) {
-    map<bsoncxx::oid, map<string, bsoncxx::types::value> > mmap;
-    vector<string> fields{"username", "surname", "name", "role", "totalSpace", "freeSpace"};
+    return db.findRows<UDetails>("users", make_document(), USER_DETAILS_FIELDS, [&res](UDetails& usr) {
+        usr.usedSpace = usr.totalSpace - usr.usedSpace;
+        res.emplace_back(std::move(usr));
+        return true;
+    });
+}
 
-    if(!db.getFields("users", fields, mmap)) {
-        return false;
-    }
+// files are sorted by name, only those after given name are listed (at most limit of them, 0 - all)
+bool UserManager::listFilesinPath(oid& id, const string& path, vector<UFile>& files, const string& after, uint32_t limit) {
+    // owner is the same for every listed file, so it's taken from user record instead of joined per file
+    URecord owner;
 
-    for(auto &usr: mmap) {
-        UDetails tmp_u;
-        if(parseUserDetails(usr.second, tmp_u)) {
-            res.emplace_back(tmp_u);
-        } else {
-            return false;
-        }
+    if(!getUserRecord(id, owner)) {
+        return false;
     }
 
-    return true;
-}
-
-bool UserManager::listFilesinPath(oid& id, const string& path, vector<UFile>& files) {
-    map<string, map<string, bsoncxx::types::value> > mmap;
-    vector<string> fields;
-    fields.emplace_back("filename");
-    fields.emplace_back("size");
-    fields.emplace_back("creationDate");
-    fields.emplace_back("ownerName");
-    fields.emplace_back("type");
-    fields.emplace_back("hash");
-    fields.emplace_back("isShared");
+    string ownerName = owner.name + " " + owner.surname;
 
     string parsedPath = path;
 
@@ -616,45 +954,20 @@ bool UserManager::listFilesinPath(oid& id, const string& path, vector<UFile>& fi
         parsedPath.push_back('/');
     }
 
-    mongocxx::pipeline stages;
-
-    stages.match(make_document(kvp("owner", id), kvp("isValid", true), kvp("filename", bsoncxx::types::b_regex("^"+parsedPath+"[^/]*[^/]$"))));
-    stages.lookup(make_document(kvp("from", "users"), kvp("localField", "owner"), kvp("foreignField", "_id"), kvp("as", "ownerTMP")));
-    stages.unwind("$ownerTMP");
-    stages.add_fields(make_document(kvp("ownerName", make_document(kvp("$concat", make_array("$ownerTMP.name", " ", "$ownerTMP.surname"))))));
-    stages.add_fields(make_document(kvp("isShared", make_document(kvp("$and", make_array(
-            make_document(kvp("$eq", make_array(make_document(kvp("$type", "$sharedWith")), "array"))),
-            make_document(kvp("$gt", make_array(make_document(kvp("$size", "$sharedWith")), 0)))
-    ))))));
-    stages.project(make_document(kvp("ownerTMP", 0), kvp("_id", 0)));
-
-    if(!db.getFieldsAdvanced("files", stages, fields, mmap)) {
-        return false;
-    }
-
-    try {
-        for(std::pair<string, map<string, bsoncxx::types::value> > usr: mmap) {
-
-            UFile tmp;
-            tmp.filename = usr.first;
-            tmp.size = (uint64_t) usr.second.find("size")->second.get_int64();
-            tmp.creation_date = (uint64_t) usr.second.find("creationDate")->second.get_date().to_int64();
-            tmp.owner_name = bsoncxx::string::to_string(usr.second.find("ownerName")->second.get_utf8().value);
-            tmp.type = (uint8_t) usr.second.find("type")->second.get_int64().value;
-            tmp.hash = string((const char*) usr.second.find("hash")->second.get_binary().bytes, usr.second.find("hash")->second.get_binary().size);
-            tmp.isShared = usr.second.find("isShared")->second.get_bool();
+    auto filter = after.empty() ? make_document(kvp("owner", id), kvp("parentDir", parsedPath), kvp("isValid", true))
+                                : make_document(kvp("owner", id), kvp("parentDir", parsedPath), kvp("isValid", true),
+                                                kvp("filename", make_document(kvp("$gt", after))));
 
-            files.emplace_back(tmp);
-        }
-    } catch (const std::exception& ex) {
-        logger.err(l_id, "error while parsing file list: " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger.err(l_id, "error while parsing file list: unknown error");
-        return false;
-    }
+    FindOptions opts;
+    opts.sortField = "filename";
+    opts.sortOrder = 1;
+    opts.limit = limit;
 
-    return true;
+    return db.findRows<UFile>("files", std::move(filter), std::move(opts), FILE_FIELDS, [&files, &ownerName](UFile& file) {
+        file.owner_name = ownerName;
+        files.emplace_back(std::move(file));
+        return true;
+    });
 }
 
 bsoncxx::types::b_utf8 UserManager::toUTF8(string& s) {
@@ -696,6 +1009,7 @@ bool UserManager::addNewFile(oid& id, UFile& file, string& dir, oid& newId) {
 
     if(file.type == FILE_REGULAR) {
         doc.append(kvp("filename", toUTF8(file.filename)));
+        doc.append(kvp("parentDir", parentDir(file.filename)));
         doc.append(kvp("size", toINT64(file.size)));
         doc.append(kvp("creationDate", currDate()));
         doc.append(kvp("type", toINT64(FILE_REGULAR)));
@@ -703,6 +1017,8 @@ bool UserManager::addNewFile(oid& id, UFile& file, string& dir, oid& newId) {
         doc.append(kvp("isValid", toBool(false)));
         doc.append(kvp("lastValid", toINT64(0)));
         doc.append(kvp("owner", toOID(id)));
+        // garbage collector finds abandoned uploads by it, even ones which never got a chunk
+        doc.append(kvp("lastChunkTime", currDate()));
 
         string homeDir;
 
@@ -730,6 +1046,7 @@ bool UserManager::addNewFile(oid& id, UFile& file, string& dir, oid& newId) {
     } else if(file.type == FILE_DIR) {
         string tmp = "";
         doc.append(kvp("filename", toUTF8(file.filename)));
+        doc.append(kvp("parentDir", parentDir(file.filename)));
         doc.append(kvp("size", toINT64(0)));
         doc.append(kvp("creationDate", currDate()));
         doc.append(kvp("type", toINT64(FILE_DIR)));
@@ -785,146 +1102,431 @@ bool UserManager::yourFileIsDir(oid &id, const string &path) {
 }
 
 bool UserManager::getYourFileMetadata(oid& id, const string& filename, UFile& file, uint8_t type) {
-    map<string, map<string, bsoncxx::types::value> > mmap;
-    vector<string> fields;
-    fields.emplace_back("filename");
-    fields.emplace_back("size");
-    fields.emplace_back("creationDate");
-    fields.emplace_back("ownerName");
-    fields.emplace_back("ownerUsername");
-    fields.emplace_back("type");
-    fields.emplace_back("hash");
-    fields.emplace_back("isValid");
-    fields.emplace_back("isShared");
-    fields.emplace_back("_id");
-    if(type == FILE_REGULAR) {
-        fields.emplace_back("lastValid");
-    }
-    
-    mongocxx::pipeline stages;
+    FindOptions opts;
+    opts.limit = 2;
 
-    stages.match(make_document(kvp("owner", id), kvp("filename", filename), kvp("type", type)));
-    stages.lookup(make_document(kvp("from", "users"), kvp("localField", "owner"), kvp("foreignField", "_id"), kvp("as", "ownerTMP")));
-    stages.unwind("$ownerTMP");
-    stages.add_fields(make_document(kvp("ownerName", make_document(kvp("$concat", make_array("$ownerTMP.name", " ", "$ownerTMP.surname")))),
-                                    kvp("ownerUsername", "$ownerTMP.username")));
-    stages.add_fields(make_document(kvp("isShared", make_document(kvp("$and", make_array(
-            make_document(kvp("$eq", make_array(make_document(kvp("$type", "$sharedWith")), "array"))),
-            make_document(kvp("$gt", make_array(make_document(kvp("$size", "$sharedWith")), 0)))
-    ))))));
-    stages.project(make_document(kvp("ownerTMP", 0)));
+    URecord owner;
 
-    if(!db.getFieldsAdvanced("files", stages, fields, mmap)) {
-        return false;
-    }
-    
-    if(mmap.size() != 1) {
+    if(!getUserRecord(id, owner)) {
         return false;
     }
 
-    try {
-        auto tmp_file = *(mmap.begin());
-
-        file.filename = bsoncxx::string::to_string(tmp_file.second.find("filename")->second.get_utf8().value);
-        file.size = (uint64_t) tmp_file.second.find("size")->second.get_int64().value;
-        file.creation_date = (uint64_t) tmp_file.second.find("creationDate")->second.get_date().to_int64();
-        file.owner_name = bsoncxx::string::to_string(tmp_file.second.find("ownerName")->second.get_utf8().value);
-        file.type = (uint8_t) tmp_file.second.find("type")->second.get_int64().value;
-        file.hash = string((const char*) tmp_file.second.find("hash")->second.get_binary().bytes, tmp_file.second.find("hash")->second.get_binary().size);
-        file.isValid = tmp_file.second.find("isValid")->second.get_bool();
-        file.id = tmp_file.second.find("_id")->second.get_oid().value;
-        file.isShared = tmp_file.second.find("isShared")->second.get_bool();
-        file.owner = id;
-        if(type == FILE_REGULAR) {
-            file.lastValid = (uint64_t) tmp_file.second.find("lastValid")->second.get_int64();
-        }
-
-        string homeDir;
-
-        if(!getHomeDir(id, homeDir)) {
-            return false;
-        }
+    UFile found;
+    int count = 0;
 
-        file.realPath = root_path + homeDir + file.filename;
-    } catch (const std::exception& ex) {
-        logger.err(l_id, "error while parsing file metadata: " + string(ex.what()));
+    if(!db.findRows<UFile>("files", make_document(kvp("owner", id), kvp("filename", filename), kvp("type", type)), std::move(opts),
+                           FILE_FIELDS, [&found, &count](UFile& row) {
+        found = std::move(row);
+        count++;
+        return true;
+    })) {
         return false;
-    } catch (...) {
-        logger.err(l_id, "error while parsing file metadata: unknown error");
+    }
+
+    if(count != 1) {
         return false;
     }
 
+    file.filename = found.filename;
+    file.size = found.size;
+    file.creation_date = found.creation_date;
+    file.owner_name = owner.name + " " + owner.surname;
+    file.type = found.type;
+    file.hash = found.hash;
+    file.isValid = found.isValid;
+    file.id = found.id;
+    file.isShared = found.isShared;
+    file.owner = id;
+    if(type == FILE_REGULAR) {
+        file.lastValid = found.lastValid;
+    }
+
+    file.realPath = root_path + owner.homeDir + file.filename;
+
     return true;
 }
 
-bool UserManager::addFileChunk(UFile& file, const string& chunk) {
-    std::fstream fs;
-    if(file.lastValid == 0) {
-        fs.open(file.realPath, std::ios::out | std::ios::binary | std::ios::trunc);
-    } else {
-        fs.open(file.realPath, std::ios::out | std::ios::binary | std::ios::in);
-    }
-    if(!fs.is_open()) {
+bool UserManager::addFileChunk(UFile& file, const string& chunk, string& buffered) {
+    if(!file.hashing && !initHashState(file)) {
         return false;
     }
-    fs.seekp(file.lastValid, std::ios::beg);
 
-    fs.write(chunk.c_str(), chunk.size());
-    if(fs.bad()) {
+    auto handle = FileCache::acquire(file.id.to_string(), file.realPath, true);
+    if(!handle) {
+        logger.err(l_id, "error while opening file for upload", errno);
         return false;
     }
 
-    fs.close();
+    // upload started from the beginning drops whatever was written before
+    struct stat st;
+    if(file.lastValid == 0 && fstat(handle->fd, &st) == 0 && st.st_size > 0) {
+        if(ftruncate(handle->fd, 0) == -1) {
+            return false;
+        }
+        preallocate(file);
+    }
 
-    file.lastValid += chunk.size();
+    // data up to last WRITE_BEHIND_SIZE boundary goes to disk in one write, the rest waits in buffered
+    uint64_t end = file.lastValid + chunk.size();
+    uint64_t aligned = end / (WRITE_BEHIND_SIZE) * (WRITE_BEHIND_SIZE);
 
-    if(db.incField("files", file.id, "lastValid", chunk.size())) {
-        return updateLastChunkTime(file) && changeFreeSpace(file.owner, -chunk.size());
-    }
+    if(aligned > file.diskValid) {
+        size_t fromChunk = aligned - file.diskValid - buffered.size();
+        bool written;
 
-    return false;
-}
+        // on io_uring reactor the block is only submitted, flushUpload waits for it before syncing
+        if(FileRing::current != nullptr) {
+            if(!file.io) {
+                file.io = std::make_shared<FileOps>();
+            }
 
-bool UserManager::validateFile(UFile& file) {
-    uint8_t hash[FILE_HASH_SIZE];
-    SHA_CTX sha1;
-    SHA1_Init(&sha1);
-    const int bufSize = 32768;
-    uint8_t* buffer = new uint8_t[bufSize];
+            string block = std::move(buffered);
+            block.append(chunk, 0, fromChunk);
+            written = file.io->write(handle, std::move(block), file.diskValid);
+        } else {
+            struct iovec iov[2];
+            iov[0].iov_base = (void*) buffered.data();
+            iov[0].iov_len = buffered.size();
+            iov[1].iov_base = (void*) chunk.data();
+            iov[1].iov_len = fromChunk;
 
-    std::ifstream is (file.realPath, std::ios::binary | std::ios::in);
-    if(!is.is_open()) {
-        deleteFile(file.owner, file.filename);
-        return false;
-    }
+            written = writeAt(handle->fd, iov, 2, file.diskValid);
+        }
 
-    is.seekg (0, is.end);
-    uint64_t length = is.tellg();
-    is.seekg (0, is.beg);
+        if(!written) {
+            logger.err(l_id, "error while writing upload chunk", errno);
+            return false;
+        }
 
-    if(length != file.size) {
-        deleteFile(file.owner, file.filename);
-        return false;
+        file.diskValid = aligned;
+        buffered.assign(chunk, fromChunk, string::npos);
+    } else {
+        buffered.append(chunk);
     }
 
-    do {
-        is.read((char*) buffer, bufSize);
-        if(is.bad()) {
-            break;
-        }
-        SHA1_Update(&sha1, buffer, is.gcount());
-    } while(!is.eof());
+    SHA1_Update(&file.hashState, chunk.c_str(), chunk.size());
 
-    delete buffer;
+    file.lastValid = end;
 
-    if(!is.eof()) {
+    if(file.lastValid - file.flushedValid >= UPLOAD_FLUSH_BYTES
+       || std::chrono::steady_clock::now() - file.lastFlush >= std::chrono::seconds(UPLOAD_FLUSH_INTERVAL)) {
+        return flushUpload(file, buffered);
+    }
+
+    return true;
+}
+
+// reserves disk space for the whole declared size, so the file isn't fragmented by growing chunk by chunk
+// file length stays the same (it's used to reconcile progress after crash)
+void UserManager::preallocate(UFile& file) {
+    if(file.size == 0) {
+        return;
+    }
+
+    auto handle = FileCache::acquire(file.id.to_string(), file.realPath, true);
+
+    if(handle && fallocate(handle->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) file.size) == -1 && errno != EOPNOTSUPP) {
+        logger.warn(l_id, "error while preallocating file: " + string(strerror(errno)));
+    }
+}
+
+// makes data written so far durable according to UPLOAD_SYNC_POLICY, finished upload is always synced
+bool UserManager::syncUpload(UFile& file, int fd, bool finished) {
+    if(file.diskValid == file.syncedValid) {
+        return true;
+    }
+
+    int policy = UPLOAD_SYNC_POLICY;
+
+    if(policy == UPLOAD_SYNC_NONE) {
+        return true;
+    }
+
+    if(policy == UPLOAD_SYNC_PERIODIC) {
+        if(!finished && file.diskValid - file.syncedValid < UPLOAD_SYNC_BYTES) {
+            return true;
+        }
+        if(fdatasync(fd) == -1) {
+            logger.err(l_id, "error while syncing uploaded file", errno);
+            return false;
+        }
+    } else if(!groupSync(fd)) {
+        logger.err(l_id, "error while syncing uploads", errno);
+        return false;
+    }
+
+    file.syncedValid = file.diskValid;
+
+    return true;
+}
+
+std::mutex UserManager::sync_mutex;
+std::condition_variable UserManager::sync_cond;
+uint64_t UserManager::syncRequested = 0;
+uint64_t UserManager::syncCompleted = 0;
+bool UserManager::syncRunning = false;
+bool UserManager::syncFailed = false;
+
+// group commit, one syncfs covers every upload which asked for it before the sync started
+// uploads arriving meanwhile wait for the next round, led by one of them
+bool UserManager::groupSync(int fd) {
+    std::unique_lock<std::mutex> lock(sync_mutex);
+    uint64_t ticket = ++syncRequested;
+
+    while(syncCompleted < ticket) {
+        if(syncRunning) {
+            sync_cond.wait(lock);
+            continue;
+        }
+
+        syncRunning = true;
+        uint64_t covered = syncRequested;
+
+        lock.unlock();
+        bool ok = syncfs(fd) == 0;
+        lock.lock();
+
+        syncRunning = false;
+        syncCompleted = covered;
+        syncFailed = !ok;
+        sync_cond.notify_all();
+    }
+
+    return !syncFailed;
+}
+
+// writes buffered data and progress of sequential upload (lastValid, hash checkpoint, last chunk time) in one update
+// checkpoint holds its own length, so it's never used for a different prefix than it covers
+bool UserManager::flushUpload(UFile& file, string& buffered) {
+    int64_t diff = file.lastValid - file.flushedValid;
+
+    if(diff == 0) {
+        return true;
+    }
+
+    auto handle = FileCache::acquire(file.id.to_string(), file.realPath, true);
+    if(!handle) {
+        logger.err(l_id, "error while opening file for upload", errno);
+        return false;
+    }
+
+    if(file.io && !file.io->wait()) {
+        logger.err(l_id, "error while writing upload chunk", errno);
+        return false;
+    }
+
+    if(!buffered.empty()) {
+        if(!writeAt(handle->fd, buffered, file.diskValid)) {
+            logger.err(l_id, "error while writing upload chunk", errno);
+            return false;
+        }
+        file.diskValid += buffered.size();
+        buffered.clear();
+    }
+
+    // progress in database never gets ahead of data written to disk
+    if(!syncUpload(file, handle->fd, file.lastValid == file.size)) {
+        return false;
+    }
+
+    file.lastChunkTime = std::chrono::system_clock::now();
+
+    if(!db.updateDoc("files", file.id, make_document(
+            kvp("$inc", make_document(kvp("lastValid", diff))),
+            kvp("$set", make_document(
+                    kvp("hashState", hashCheckpoint(file)),
+                    kvp("lastChunkTime", bsoncxx::types::b_date(file.lastChunkTime))))))) {
+        return false;
+    }
+
+    file.flushedValid = file.lastValid;
+    file.lastFlush = std::chrono::steady_clock::now();
+
+    return commitSpace(file.owner, diff, file.reserved);
+}
+
+// after crash database can be behind (or ahead of) data on disk, file length wins
+bool UserManager::reconcileUpload(UFile& file) {
+    struct stat st;
+    if(stat(file.realPath.c_str(), &st) != 0) {
+        return false;
+    }
+
+    uint64_t onDisk = std::min((uint64_t) st.st_size, file.size);
+
+    if((uint64_t) st.st_size > file.size && truncate(file.realPath.c_str(), file.size) != 0) {
+        return false;
+    }
+
+    file.flushedValid = file.lastValid;
+    file.diskValid = file.lastValid;
+    file.syncedValid = file.lastValid;
+    file.lastFlush = std::chrono::steady_clock::now();
+
+    if(onDisk == file.lastValid) {
+        return true;
+    }
+
+    logger.log(l_id, "upload progress differs from file on disk, continuing from " + std::to_string(onDisk));
+
+    int64_t diff = onDisk - file.lastValid;
+
+    if(!db.incField("files", file.id, "lastValid", diff)) {
+        return false;
+    }
+
+    if(!(diff > 0 ? commitSpace(file.owner, diff, file.reserved) : changeFreeSpace(file.owner, -diff))) {
+        return false;
+    }
+
+    file.lastValid = onDisk;
+    file.flushedValid = onDisk;
+    file.diskValid = onDisk;
+    file.syncedValid = onDisk;
+
+    return true;
+}
+
+// sha1 of the first lastValid bytes stops at the last full block, the rest of them is hashed again from disk
+// only the chaining values are stored, by name and not as raw SHA_CTX, whose layout is private to OpenSSL
+bsoncxx::document::value UserManager::hashCheckpoint(const UFile& file) {
+    const SHA_CTX& ctx = file.hashState;
+
+    return make_document(
+            kvp("version", HASH_CHECKPOINT_VERSION),
+            kvp("bytes", (int64_t) (file.lastValid / SHA_CBLOCK * SHA_CBLOCK)),
+            kvp("h", [&ctx](bsoncxx::builder::basic::sub_array arr) {
+                for(SHA_LONG h: {ctx.h0, ctx.h1, ctx.h2, ctx.h3, ctx.h4}) {
+                    arr.append((int64_t) h);
+                }
+            }));
+}
+
+// returns number of bytes the restored digest covers, 0 (and fresh digest) for missing or unknown checkpoint
+uint64_t UserManager::restoreHashState(const bsoncxx::document::view& doc, SHA_CTX& ctx) {
+    SHA1_Init(&ctx);
+
+    auto version = doc["version"];
+    auto bytes = doc["bytes"];
+    auto h = doc["h"];
+
+    if(!version || version.type() != bsoncxx::type::k_int32 || version.get_int32().value != HASH_CHECKPOINT_VERSION
+       || !bytes || bytes.type() != bsoncxx::type::k_int64 || bytes.get_int64().value < 0
+       || bytes.get_int64().value % SHA_CBLOCK != 0 || !h || h.type() != bsoncxx::type::k_array) {
+        return 0;
+    }
+
+    SHA_LONG vals[5];
+    size_t count = 0;
+
+    for(auto el: h.get_array().value) {
+        if(count == 5 || el.type() != bsoncxx::type::k_int64) {
+            return 0;
+        }
+        vals[count++] = (SHA_LONG) el.get_int64().value;
+    }
+
+    if(count != 5) {
+        return 0;
+    }
+
+    uint64_t bits = (uint64_t) bytes.get_int64().value * 8;
+
+    ctx.h0 = vals[0];
+    ctx.h1 = vals[1];
+    ctx.h2 = vals[2];
+    ctx.h3 = vals[3];
+    ctx.h4 = vals[4];
+    ctx.Nl = (SHA_LONG) (bits & 0xffffffff);
+    ctx.Nh = (SHA_LONG) (bits >> 32);
+
+    return (uint64_t) bytes.get_int64().value;
+}
+
+bool UserManager::initHashState(UFile& file) {
+    if(file.lastValid != 0) {
+        return loadHashState(file);
+    }
+
+    SHA1_Init(&file.hashState);
+    file.hashing = true;
+
+    return true;
+}
+
+// resumed upload continues from checkpointed digest, only data written after the checkpoint is read
+bool UserManager::loadHashState(UFile& file) {
+    uint64_t from = 0;
+
+    SHA1_Init(&file.hashState);
+
+    if(!db.findDocs("files", make_document(kvp("_id", file.id)), [this, &file, &from](const bsoncxx::document::view& doc) {
+        auto state = doc["hashState"];
+        if(state && state.type() == bsoncxx::type::k_document) {
+            from = restoreHashState(state.get_document().value, file.hashState);
+        }
+    })) {
+        return false;
+    }
+
+    if(from == 0 || from > file.lastValid) {
+        logger.log(l_id, "no usable hash checkpoint for resumed upload, hashing uploaded part");
+        SHA1_Init(&file.hashState);
+        from = 0;
+    }
+
+    file.hashing = hashFile(file, from, file.lastValid, file.hashState);
+
+    return file.hashing;
+}
+
+// continues sha1 with bytes [from, to) of the file
+bool UserManager::hashFile(UFile& file, uint64_t from, uint64_t to, SHA_CTX& sha1) {
+    std::ifstream is (file.realPath, std::ios::binary | std::ios::in);
+    if(!is.is_open()) {
+        return false;
+    }
+
+    is.seekg(from, is.beg);
+
+    uint64_t length = to - from;
+
+    const int bufSize = 32768;
+    uint8_t* buffer = new uint8_t[bufSize];
+
+    while(length > 0) {
+        is.read((char*) buffer, std::min((uint64_t) bufSize, length));
+        if(is.gcount() <= 0) {
+            break;
+        }
+        SHA1_Update(&sha1, buffer, is.gcount());
+        length -= is.gcount();
+    }
+
+    delete[] buffer;
+
+    return length == 0;
+}
+
+bool UserManager::validateFile(UFile& file) {
+    uint8_t hash[FILE_HASH_SIZE];
+    SHA_CTX sha1;
+
+    struct stat st;
+    if(stat(file.realPath.c_str(), &st) != 0 || (uint64_t) st.st_size != file.size) {
         deleteFile(file.owner, file.filename);
         return false;
     }
 
-    SHA1_Final(hash, &sha1);
+    // sequential upload has the digest ready, other files (parallel upload) are read once more
+    if(file.hashing && file.lastValid == file.size) {
+        sha1 = file.hashState;
+    } else if(!SHA1_Init(&sha1) || !hashFile(file, 0, file.size, sha1)) {
+        deleteFile(file.owner, file.filename);
+        return false;
+    }
 
-    is.close();
+    SHA1_Final(hash, &sha1);
 
     for(int i=0; i<FILE_HASH_SIZE; i++) {
         if((uint8_t) file.hash[i] != hash[i]) {
@@ -938,11 +1540,319 @@ bool UserManager::validateFile(UFile& file) {
         return false;
     }
 
+    db.unsetField("files", "hashState", file.id);
+
     file.isValid = true;
 
     return true;
 }
 
+std::mutex UserManager::uploads_mutex;
+std::map<string, std::shared_ptr<ParallelUpload> > UserManager::parallelUploads;
+
+std::shared_ptr<ParallelUpload> UserManager::joinParallelUpload(UFile& file) {
+    // resumed upload mustn't be collected before its first chunk arrives
+    if(!db.setFieldCurrentDate("files", "lastChunkTime", file.id, file.lastChunkTime)) {
+        logger.err(l_id, "error while touching joined parallel upload");
+    }
+
+    std::lock_guard<std::mutex> lock(uploads_mutex);
+
+    auto it = parallelUploads.find(file.id.to_string());
+    if(it != parallelUploads.end()) {
+        releaseSpace(file.owner, file.reserved);
+        return it->second;
+    }
+
+    auto up = std::make_shared<ParallelUpload>();
+    up->file = file;
+    up->file.reserved = 0;
+    up->file.flushedValid = up->file.diskValid = up->file.syncedValid = file.lastValid;
+    up->lastTouch = std::chrono::steady_clock::now();
+    up->blocks = (file.size + PARALLEL_BLOCK_SIZE - 1) / (PARALLEL_BLOCK_SIZE);
+    up->ranges.assign((up->blocks + 7) / 8, 0);
+
+    vector<uint8_t> stored;
+
+    if(db.getField("files", "ranges", file.id, stored) && stored.size() == up->ranges.size()) {
+        up->ranges = stored;
+        for(uint64_t i=0; i<up->blocks; i++) {
+            if(up->ranges[i / 8] & (1 << (i % 8))) {
+                up->received++;
+            }
+        }
+    } else if(file.lastValid != 0) {
+        // sequential upload doesn't track blocks, it has to be continued the same way
+        return nullptr;
+    } else if(!db.setField("files", "ranges", file.id, up->ranges.data(), (uint32_t) up->ranges.size())) {
+        return nullptr;
+    }
+
+    // first connection hands its reservation over to the registry, others give theirs back
+    up->file.reserved = file.reserved;
+    file.reserved = 0;
+
+    parallelUploads[file.id.to_string()] = up;
+
+    return up;
+}
+
+bool UserManager::isParallelUploadActive(oid& fileId) {
+    std::lock_guard<std::mutex> lock(uploads_mutex);
+    return parallelUploads.find(fileId.to_string()) != parallelUploads.end();
+}
+
+// forgets parallel upload of deleted file, so its reservation doesn't outlive it
+void UserManager::dropParallelUpload(oid& fileId) {
+    std::shared_ptr<ParallelUpload> up;
+
+    {
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        auto it = parallelUploads.find(fileId.to_string());
+        if(it == parallelUploads.end()) {
+            return;
+        }
+        up = it->second;
+        parallelUploads.erase(it);
+    }
+
+    std::lock_guard<std::mutex> lock(up->mutex);
+    up->dropped = true;
+    releaseSpace(up->file.owner, up->file.reserved);
+}
+
+bool UserManager::hasParallelUpload(UFile& file) {
+    {
+        std::lock_guard<std::mutex> lock(uploads_mutex);
+        if(parallelUploads.find(file.id.to_string()) != parallelUploads.end()) {
+            return true;
+        }
+    }
+
+    vector<uint8_t> stored;
+
+    return db.getField("files", "ranges", file.id, stored);
+}
+
+// writes chunk at its offset, blocks received before are not counted (nor written) again
+// file is validated once, by the connection which delivers the last missing block
+// under PERIODIC policy written data is synced once enough of it piles up, other policies sync every flush
+static bool syncDue(const UFile& file) {
+    int policy = UPLOAD_SYNC_POLICY;
+    return policy != UPLOAD_SYNC_PERIODIC || file.diskValid - file.syncedValid >= UPLOAD_SYNC_BYTES;
+}
+
+// called with up.mutex held
+static bool progressDue(const ParallelUpload& up) {
+    if(up.received == up.blocks && !up.finished) {
+        return true;
+    }
+
+    if(up.file.lastValid != up.file.flushedValid && syncDue(up.file)) {
+        return true;
+    }
+
+    return std::chrono::steady_clock::now() - up.lastTouch >= std::chrono::seconds(PARALLEL_TOUCH_INTERVAL);
+}
+
+bool UserManager::syncParallelUpload(int fd) {
+    int policy = UPLOAD_SYNC_POLICY;
+
+    if(policy == UPLOAD_SYNC_NONE) {
+        return true;
+    }
+
+    if(policy == UPLOAD_SYNC_PERIODIC) {
+        if(fdatasync(fd) == -1) {
+            logger.err(l_id, "error while syncing uploaded file", errno);
+            return false;
+        }
+    } else if(!groupSync(fd)) {
+        logger.err(l_id, "error while syncing uploads", errno);
+        return false;
+    }
+
+    return true;
+}
+
+uint8_t UserManager::addFileRange(ParallelUpload& up, uint64_t offset, const string& chunk) {
+    uint64_t end = offset + chunk.size();
+
+    if(offset % (PARALLEL_BLOCK_SIZE) != 0 || end > up.file.size
+       || (chunk.size() % (PARALLEL_BLOCK_SIZE) != 0 && end != up.file.size)) {
+        return ADD_FILE_WRONG_RANGE;
+    }
+
+    uint64_t first = offset / (PARALLEL_BLOCK_SIZE);
+    uint64_t last = (end + PARALLEL_BLOCK_SIZE - 1) / (PARALLEL_BLOCK_SIZE);
+
+    {
+        std::lock_guard<std::mutex> lock(up.mutex);
+        if(up.dropped) {
+            return ADD_FILE_INTERNAL_ERROR;
+        }
+        bool missing = false;
+        for(uint64_t i=first; i<last && !missing; i++) {
+            missing = !(up.ranges[i / 8] & (1 << (i % 8)));
+        }
+        if(!missing) {
+            return ADD_FILE_OK;
+        }
+    }
+
+    auto handle = FileCache::acquire(up.file.id.to_string(), up.file.realPath, true);
+    if(!handle) {
+        logger.err(l_id, "error while opening file for parallel upload", errno);
+        return ADD_FILE_INTERNAL_ERROR;
+    }
+
+    if(!writeAt(handle->fd, chunk, offset)) {
+        logger.err(l_id, "error while writing parallel upload chunk", errno);
+        return ADD_FILE_INTERNAL_ERROR;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(up.mutex);
+
+        // deleted meanwhile, its reservation is already released
+        if(up.dropped) {
+            return ADD_FILE_INTERNAL_ERROR;
+        }
+
+        int64_t newBytes = 0;
+        for(uint64_t i=first; i<last; i++) {
+            if(!(up.ranges[i / 8] & (1 << (i % 8)))) {
+                up.ranges[i / 8] |= (1 << (i % 8));
+                up.received++;
+                newBytes += std::min((uint64_t) PARALLEL_BLOCK_SIZE, up.file.size - i * (PARALLEL_BLOCK_SIZE));
+            }
+        }
+
+        if(newBytes == 0) {
+            return ADD_FILE_OK;
+        }
+
+        up.file.lastValid += newBytes;
+        up.file.diskValid += newBytes;
+
+        // progress of this chunk is picked up by the connection flushing now
+        if(up.flushing || !progressDue(up)) {
+            return ADD_FILE_OK;
+        }
+
+        up.flushing = true;
+    }
+
+    return flushParallelUpload(up, handle->fd);
+}
+
+// sync and database writes are done without up.mutex, from a copy of bitmap taken under it
+// every block marked in the copy was written before, so sync done after taking it covers them
+// loops while other connections bring more progress which is due
+uint8_t UserManager::flushParallelUpload(ParallelUpload& up, int fd) {
+    while(true) {
+        vector<uint8_t> ranges;
+        uint64_t lastValid, diskValid, fromReserved = 0;
+        int64_t unflushed;
+        bool completing, persist;
+
+        {
+            std::lock_guard<std::mutex> lock(up.mutex);
+
+            if(up.dropped || !progressDue(up)) {
+                up.flushing = false;
+                return up.dropped ? ADD_FILE_INTERNAL_ERROR : ADD_FILE_OK;
+            }
+
+            completing = up.received == up.blocks && !up.finished;
+            persist = up.file.lastValid != up.file.flushedValid && (completing || syncDue(up.file));
+
+            lastValid = up.file.lastValid;
+            diskValid = up.file.diskValid;
+            unflushed = lastValid - up.file.flushedValid;
+
+            if(persist) {
+                ranges = up.ranges;
+                fromReserved = std::min((uint64_t) unflushed, up.file.reserved);
+                up.file.reserved -= fromReserved;
+            }
+        }
+
+        auto now = std::chrono::system_clock::now();
+        bool ok;
+
+        if(persist) {
+            bsoncxx::types::b_binary bitmap{};
+            bitmap.bytes = ranges.data();
+            bitmap.size = (uint32_t) ranges.size();
+
+            // bitmap in database never marks blocks which aren't synced yet (unless UPLOAD_SYNC_NONE)
+            ok = syncParallelUpload(fd)
+                 && db.updateDoc("files", up.file.id, make_document(
+                            kvp("$inc", make_document(kvp("lastValid", unflushed))),
+                            kvp("$set", make_document(
+                                    kvp("ranges", bitmap),
+                                    kvp("lastChunkTime", bsoncxx::types::b_date(now))))))
+                 && commitSpace(up.file.owner, (uint64_t) unflushed, fromReserved);
+        } else {
+            // nothing synced to persist yet, only keep garbage collector away
+            ok = db.setField("files", "lastChunkTime", up.file.id, bsoncxx::types::value{bsoncxx::types::b_date(now)});
+        }
+
+        UFile file;
+
+        {
+            std::lock_guard<std::mutex> lock(up.mutex);
+
+            // part of reservation which wasn't charged goes back, or is released with dropped upload
+            up.file.reserved += fromReserved;
+            if(up.dropped) {
+                releaseSpace(up.file.owner, up.file.reserved);
+            }
+
+            if(!ok) {
+                up.flushing = false;
+                return ADD_FILE_INTERNAL_ERROR;
+            }
+
+            up.lastTouch = std::chrono::steady_clock::now();
+            up.file.lastChunkTime = now;
+
+            if(persist) {
+                up.file.flushedValid = lastValid;
+                up.file.syncedValid = std::max(up.file.syncedValid, diskValid);
+            }
+
+            if(!completing) {
+                continue;
+            }
+
+            up.finished = true;
+            up.flushing = false;
+            file = up.file;
+        }
+
+        bool valid = validateFile(file);
+
+        if(valid) {
+            db.unsetField("files", "ranges", file.id);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(up.mutex);
+            up.file.isValid = valid;
+            releaseSpace(up.file.owner, up.file.reserved);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex);
+            parallelUploads.erase(file.id.to_string());
+        }
+
+        return valid ? ADD_FILE_OK : ADD_FILE_WRONG_HASH;
+    }
+}
+
 bool UserManager::runAsUser(const string& username, std::function<bool(oid&)> fun) {
     oid tmp_id;
     if(!getUserId(username, tmp_id)) {
@@ -981,9 +1891,26 @@ bool UserManager::deleteUser(const string& username) {
         return false;
     }
 
+    FileCache::invalidatePath(realPath);
+    ContentCache::invalidatePath(realPath);
+
     db.removeByOid("files", "owner", id);
     db.removeByOid("users", "_id", id);
 
+    invalidateUser(id);
+
+    {
+        std::lock_guard<std::mutex> lock(users_mutex);
+        userIds.erase(username);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(quota_mutex);
+        quotas.erase(id.to_string());
+    }
+
+    SessionStore::removeUser(id.to_string());
+
     bsoncxx::types::b_oid id_obj;
     id_obj.value = id;
     db.removeFieldFromArrays("files", "sharedWith", "userId", bsoncxx::types::value{id_obj});
@@ -1007,33 +1934,32 @@ bool UserManager::deleteFile(oid& id, const string& path) {
 
     remove(realPath.c_str());
 
+    FileCache::invalidate(details.id.to_string());
+    ContentCache::invalidate(details.id.to_string());
+
     db.removeByOid("files", "_id", details.id);
 
+    dropParallelUpload(details.id);
+
     changeFreeSpace(id, details.lastValid);
 
     return true;
 }
 
 bool UserManager::deletePath(oid& id, const string& path) {
-    map<string, map<string, bsoncxx::types::value> > mmap;
-    vector<string> fields;
-    fields.emplace_back("totalSize");
-
     string parsedPath = path;
 
     if(parsedPath[parsedPath.size()-1] != '/') {
         parsedPath.push_back('/');
     }
 
-    mongocxx::pipeline stages;
-
-    stages.match(make_document(kvp("owner", id), kvp("type", FILE_REGULAR), kvp("filename", bsoncxx::types::b_regex("^"+parsedPath))));
-    stages.group(make_document(kvp("_id", bsoncxx::types::b_null{}), kvp("totalSize", make_document(kvp("$sum", "$lastValid")))));
-    stages.project(make_document(kvp("_id", 0)));
-
     uint64_t totalSize = 0;
 
-    if(!db.sumFieldAdvanced("files", "totalSize", stages, totalSize)) {
+    if(!db.findRows<UFile>("files", make_document(kvp("owner", id), kvp("type", FILE_REGULAR), kvp("filename", bsoncxx::types::b_regex("^"+parsedPath))),
+                           SIZE_FIELDS, [&totalSize](UFile& file) {
+        totalSize += file.lastValid;
+        return true;
+    })) {
         return false;
     }
 
@@ -1050,6 +1976,9 @@ bool UserManager::deletePath(oid& id, const string& path) {
         return false;
     }
 
+    FileCache::invalidatePath(realPath);
+    ContentCache::invalidatePath(realPath);
+
     db.deleteDocs("files", make_document(kvp("owner", id), kvp("filename", bsoncxx::types::b_regex("^"+parsedPath+"($|(/.+))"))));
 
     string dir = parsedPath.substr(0, parsedPath.rfind('/'));
@@ -1065,23 +1994,144 @@ bool UserManager::deletePath(oid& id, const string& path) {
 
 bool UserManager::getFileChunk(UFile& file, string& chunk) {
     uint64_t toRead = (file.size - file.lastValid > OUT_FILE_CHUNK_SIZE) ? OUT_FILE_CHUNK_SIZE : (file.size - file.lastValid);
-    chunk.resize(toRead);
-    std::fstream fs;
-    fs.open(file.realPath, std::ios::in | std::ios::binary);
-    if(!fs.is_open()) {
-        return false;
+
+    if(file.content) {
+        chunk.assign(*file.content, file.lastValid, toRead);
+        file.lastValid += toRead;
+        return true;
     }
-    fs.seekg(file.lastValid, std::ios::beg);
 
-    fs.read(&chunk[0], toRead);
-    if(fs.bad() || fs.tellg() != file.lastValid + toRead) {
+    auto handle = FileCache::acquire(file.id.to_string(), file.realPath, false);
+    if(!handle) {
         return false;
     }
 
-    fs.close();
+    adviseReadAhead(file, handle->fd);
+
+    // completed files don't change, so all their readers can copy straight from one mapping
+    const uint8_t* map = (DOWNLOAD_MMAP && file.isValid) ? handle->mapped(file.size) : nullptr;
+
+    if(map != nullptr) {
+        chunk.assign((const char*) map + file.lastValid, toRead);
+        file.lastValid += toRead;
+        return true;
+    }
+
+    if(!file.io || !file.io->takeRead(file.lastValid, toRead, chunk)) {
+        chunk.resize(toRead);
+
+        size_t done = 0;
+        while(done < toRead) {
+            ssize_t n = pread(handle->fd, &chunk[done], toRead - done, file.lastValid + done);
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                // file is shorter than its metadata says
+                return false;
+            }
+            done += n;
+        }
+    }
 
     file.lastValid += toRead;
 
+    // on io_uring reactor next chunk is read while this one is being sent
+    if(FileRing::current != nullptr && file.lastValid < file.size) {
+        if(!file.io) {
+            file.io = std::make_shared<FileOps>();
+        }
+        file.io->readAhead(handle, file.lastValid, std::min((uint64_t) OUT_FILE_CHUNK_SIZE, file.size - file.lastValid));
+    }
+
+    return true;
+}
+
+// whole download is going to be read in order, popular files are served from memory
+void UserManager::startDownload(UFile& file) {
+    if(file.isValid) {
+        file.content = ContentCache::get(file.id.to_string(), file.hash, file.realPath, file.size);
+        if(file.content) {
+            return;
+        }
+    }
+
+    auto handle = FileCache::acquire(file.id.to_string(), file.realPath, false);
+
+    if(handle) {
+        posix_fadvise(handle->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+// keeps WILLNEED hint ahead of download position, window follows rate at which the download goes
+void UserManager::adviseReadAhead(UFile& file, int fd) {
+    uint64_t pos = file.lastValid;
+
+    if(file.readAheadEnd != 0 && pos + file.readAheadWindow / 2 < file.readAheadEnd) {
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    if(file.readAheadEnd == 0) {
+        file.readAheadWindow = READAHEAD_MIN;
+    } else {
+        uint64_t ms = std::max((int64_t) 1, (int64_t) std::chrono::duration_cast<std::chrono::milliseconds>(now - file.readAheadTime).count());
+        uint64_t rate = (pos - file.readAheadPos) * 1000 / ms;
+        file.readAheadWindow = std::min(std::max(rate * READAHEAD_SECONDS, (uint64_t) READAHEAD_MIN), (uint64_t) READAHEAD_MAX);
+    }
+
+    uint64_t from = std::max(pos, file.readAheadEnd);
+    uint64_t to = std::min(pos + file.readAheadWindow, file.size);
+
+    if(to > from) {
+        posix_fadvise(fd, (off_t) from, (off_t) (to - from), POSIX_FADV_WILLNEED);
+    }
+
+    file.readAheadEnd = std::max(to, pos + 1);
+    file.readAheadPos = pos;
+    file.readAheadTime = now;
+}
+
+bool UserManager::writeAt(int fd, const string& data, uint64_t offset) {
+    struct iovec iov;
+    iov.iov_base = (void*) data.data();
+    iov.iov_len = data.size();
+
+    return writeAt(fd, &iov, 1, offset);
+}
+
+// writes whole iovecs (which are modified) at given offset, retrying short writes
+bool UserManager::writeAt(int fd, struct iovec* iov, int iovcnt, uint64_t offset) {
+    while(iovcnt > 0) {
+        if(iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+
+        ssize_t n = pwritev(fd, iov, iovcnt, (off_t) offset);
+        if(n == -1 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+
+        offset += n;
+
+        while(n > 0) {
+            size_t part = std::min((size_t) n, iov->iov_len);
+            iov->iov_base = (uint8_t*) iov->iov_base + part;
+            iov->iov_len -= part;
+            n -= part;
+            if(iov->iov_len == 0) {
+                iov++;
+                iovcnt--;
+            }
+        }
+    }
+
     return true;
 }
 
@@ -1108,62 +2158,39 @@ bool UserManager::unshareWith(oid& fileId, oid& userId) {
 }
 
 bool UserManager::listSharedWithUser(oid& id, vector<UFile>& list) {
-    map<string, map<string, bsoncxx::types::value> > mmap;
-    vector<string> fields;
-    fields.emplace_back("filename");
-    fields.emplace_back("size");
-    fields.emplace_back("creationDate");
-    fields.emplace_back("ownerName");
-    fields.emplace_back("ownerUsername");
-    fields.emplace_back("hash");
-    fields.emplace_back("type");
-
-    mongocxx::pipeline stages;
-
-    stages.match(make_document(kvp("sharedWith.userId", id), kvp("isValid", true), kvp("type", FILE_REGULAR)));
-    stages.lookup(make_document(kvp("from", "users"), kvp("localField", "owner"), kvp("foreignField", "_id"), kvp("as", "ownerTMP")));
-    stages.unwind("$ownerTMP");
-    stages.add_fields(make_document(kvp("ownerName", make_document(kvp("$concat", make_array("$ownerTMP.name", " ", "$ownerTMP.surname")))),
-                                    kvp("ownerUsername", "$ownerTMP.username")));
-    stages.project(make_document(kvp("ownerTMP", 0), kvp("_id", 0)));
-
-    if(!db.getFieldsAdvanced("files", stages, fields, mmap)) {
-        return false;
-    }
-
-    try {
-        for(std::pair<string, map<string, bsoncxx::types::value> > usr: mmap) {
-            UFile tmp;
-            tmp.filename = usr.first.substr(usr.first.rfind('/') + 1);
-            tmp.size = (uint64_t) usr.second.find("size")->second.get_int64();
-            tmp.creation_date = (uint64_t) usr.second.find("creationDate")->second.get_date().to_int64();
-            tmp.owner_name = bsoncxx::string::to_string(usr.second.find("ownerName")->second.get_utf8().value);
-            tmp.owner_username = bsoncxx::string::to_string(usr.second.find("ownerUsername")->second.get_utf8().value);
-            tmp.type = (uint8_t) usr.second.find("type")->second.get_int64().value;
-            tmp.hash = string((const char*) usr.second.find("hash")->second.get_binary().bytes, usr.second.find("hash")->second.get_binary().size);
-            tmp.isShared = true;
-
-            list.emplace_back(tmp);
+    FindOptions opts;
+    opts.sortField = "filename";
+    opts.sortOrder = 1;
+
+    // owners are resolved from user records, once per owner and not per shared file
+    map<string, URecord> owners;
+
+    return db.findRows<UFile>("files", make_document(kvp("sharedWith.userId", id), kvp("isValid", true), kvp("type", FILE_REGULAR)),
+                              std::move(opts), FILE_FIELDS, [this, &list, &owners](UFile& file) {
+        auto owner = owners.find(file.owner.to_string());
+
+        if(owner == owners.end()) {
+            URecord rec;
+            if(!getUserRecord(file.owner, rec)) {
+                return true;
+            }
+            owner = owners.emplace(file.owner.to_string(), rec).first;
         }
-    } catch (const std::exception& ex) {
-        logger.err(l_id, "error while parsing shared file list: " + string(ex.what()));
-        return false;
-    } catch (...) {
-        logger.err(l_id, "error while parsing shared file list: unknown error");
-        return false;
-    }
 
-    return true;
+        file.filename = file.filename.substr(file.filename.rfind('/') + 1);
+        file.owner_name = owner->second.name + " " + owner->second.surname;
+        file.owner_username = owner->second.username;
+        file.isShared = true;
+
+        list.emplace_back(std::move(file));
+        return true;
+    });
 }
 
 bool UserManager::getFileFilename(oid& fileId, string& res) {
     return db.getField("files", "filename", fileId, res);
 }
 
-bool UserManager::updateLastChunkTime(UFile& file) {
-    return db.setFieldCurrentDate("files", "lastChunkTime", file.id, file.lastChunkTime);
-}
-
 bool UserManager::removeAllUnfinishedForUser(oid& id) {
     vector<string> filesToDel;
 
@@ -1191,21 +2218,23 @@ bool UserManager::collectOldUnfinished() {
     std::chrono::system_clock::time_point thresholdTime
             = std::chrono::system_clock::time_point(curr - std::chrono::minutes(GARBAGE_COLLECTOR_TRESHOLD_MINUTES));
 
-    map<string, map<string, bsoncxx::types::value> > mmap;
+    vector<UFile> unfinished;
 
-    if(!db.getFields("files", make_document(
+    if(!db.findRows<UFile>("files", make_document(
             kvp("isValid", false),
             kvp("type", FILE_REGULAR),
             kvp("lastChunkTime", make_document(kvp("$lt", bsoncxx::types::b_date(thresholdTime))))
-    ), vector<string>{"filename", "owner"}, mmap)){
+    ), UNFINISHED_FIELDS, [&unfinished](UFile& file) {
+        unfinished.emplace_back(std::move(file));
+        return true;
+    })) {
         return false;
     }
 
-    logger.info(l_id, "deleting " + std::to_string(mmap.size()) + " old unfinished files");
+    logger.info(l_id, "deleting " + std::to_string(unfinished.size()) + " old unfinished files");
 
-    for(auto& file: mmap) {
-        oid id = file.second.find("owner")->second.get_oid().value;
-        if(!deleteFile(id, file.first)) {
+    for(auto& file: unfinished) {
+        if(!deleteFile(file.owner, file.filename)) {
             return false;
         }
     }
@@ -1214,49 +2243,167 @@ bool UserManager::collectOldUnfinished() {
 }
 
 bool UserManager::getTotalSpace(oid& id, uint64_t& res) {
-    return db.getField("users", "totalSpace", id, (int64_t&) res);
+    URecord rec;
+    if(!getUserRecord(id, rec)) {
+        return false;
+    }
+
+    res = rec.totalSpace;
+    return true;
+}
+
+std::mutex UserManager::quota_mutex;
+std::map<string, UserManager::Quota> UserManager::quotas;
+
+// expects quota_mutex locked, free space is read from database only first time user is seen
+// the read is done with the lock released, entry added meanwhile by another thread is kept
+// this process is the only writer of freeSpace, so cached value stays accurate
+UserManager::Quota* UserManager::getQuota(oid& id, std::unique_lock<std::mutex>& lock) {
+    auto it = quotas.find(id.to_string());
+    if(it != quotas.end()) {
+        return &it->second;
+    }
+
+    lock.unlock();
+
+    int64_t freeSpace;
+    bool found = db.getField("users", "freeSpace", id, freeSpace);
+
+    lock.lock();
+
+    if(!found) {
+        return nullptr;
+    }
+
+    Quota q;
+    q.freeSpace = freeSpace;
+    q.reserved = 0;
+
+    return &quotas.emplace(id.to_string(), q).first->second;
 }
 
 bool UserManager::getFreeSpace(oid& id, uint64_t& res) {
-    return db.getField("users", "freeSpace", id, (int64_t&) res);
+    std::unique_lock<std::mutex> lock(quota_mutex);
+    Quota* q = getQuota(id, lock);
+    if(q == nullptr) {
+        return false;
+    }
+
+    res = (uint64_t) std::max(q->freeSpace, (int64_t) 0);
+    return true;
+}
+
+// fails when free space not reserved by other uploads is smaller than needed
+bool UserManager::reserveSpace(oid& id, uint64_t size) {
+    std::unique_lock<std::mutex> lock(quota_mutex);
+    Quota* q = getQuota(id, lock);
+    if(q == nullptr || q->freeSpace - (int64_t) q->reserved < (int64_t) size) {
+        return false;
+    }
+
+    q->reserved += size;
+    return true;
+}
+
+void UserManager::releaseSpace(oid& id, uint64_t& reserved) {
+    if(reserved == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(quota_mutex);
+    auto it = quotas.find(id.to_string());
+    if(it != quotas.end()) {
+        it->second.reserved -= std::min(reserved, it->second.reserved);
+    }
+
+    reserved = 0;
+}
+
+// charges written bytes, moving them out of upload's reservation
+bool UserManager::commitSpace(oid& id, uint64_t size, uint64_t& reserved) {
+    if(!db.incField("users", id, "freeSpace", -(int64_t) size)) {
+        return false;
+    }
+
+    uint64_t fromReserved = std::min(size, reserved);
+    reserved -= fromReserved;
+
+    std::lock_guard<std::mutex> lock(quota_mutex);
+    auto it = quotas.find(id.to_string());
+    if(it != quotas.end()) {
+        it->second.freeSpace -= size;
+        it->second.reserved -= std::min(fromReserved, it->second.reserved);
+    }
+
+    return true;
 }
 
 bool UserManager::setTotalSpace(oid& id, uint64_t& newVal) {
-    return db.setField("users", "totalSpace", id, (int64_t&) newVal);
+    bool ok = db.setField("users", "totalSpace", id, (int64_t&) newVal);
+    invalidateUser(id);
+    return ok;
 }
 
 bool UserManager::changeFreeSpace(oid& id, int64_t diff) {
-    return db.incField("users", id, "freeSpace", diff);
+    if(!db.incField("users", id, "freeSpace", diff)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(quota_mutex);
+    auto it = quotas.find(id.to_string());
+    if(it != quotas.end()) {
+        it->second.freeSpace += diff;
+    }
+
+    return true;
 }
 
 
+// usernames come from user records instead of joining users collection
 bool UserManager::shareInfo(oid& fileId, vector<string>& res) {
-    mongocxx::pipeline stages;
+    vector<oid> userIds;
 
-    stages.match(make_document(kvp("_id", fileId)));
-    stages.lookup(make_document(kvp("from", "users"), kvp("localField", "sharedWith.userId"), kvp("foreignField", "_id"), kvp("as", "sharedTMP")));
-    stages.project(make_document(kvp("sharedWith", make_document(kvp("$map", make_document(
-            kvp("input", "$sharedTMP"),
-            kvp("as", "users"),
-            kvp("in", "$$users.username")
-    )))), kvp("_id", 0)));
-    stages.unwind("$sharedWith");
+    if(!db.findDocs("files", make_document(kvp("_id", fileId)), [&userIds](const bsoncxx::document::view& doc) {
+        auto shared = doc["sharedWith"];
 
-    return db.getFieldMAdvanced("files", "sharedWith", stages, res);
+        if(shared.type() != bsoncxx::type::k_array) {
+            return;
+        }
+
+        for(auto entry: shared.get_array().value) {
+            if(entry.type() == bsoncxx::type::k_document && entry.get_document().value["userId"].type() == bsoncxx::type::k_oid) {
+                userIds.push_back(entry.get_document().value["userId"].get_oid().value);
+            }
+        }
+    })) {
+        return false;
+    }
+
+    for(auto& userId: userIds) {
+        URecord rec;
+
+        if(getUserRecord(userId, rec)) {
+            res.push_back(rec.username);
+        }
+    }
+
+    return true;
 }
 
 bool UserManager::getWarningList(oid& id, vector<string>& list) {
-    mongocxx::pipeline stages;
+    if(db.findDocs("users", make_document(kvp("_id", id)), [&list](const bsoncxx::document::view& doc) {
+        auto warnings = doc["warnings"];
 
-    stages.match(make_document(kvp("_id", id)));
-    stages.project(make_document(kvp("warning", make_document(kvp("$map", make_document(
-            kvp("input", "$warnings"),
-            kvp("as", "warn"),
-            kvp("in", "$$warn.body")
-    )))), kvp("_id", 0)));
-    stages.unwind("$warning");
+        if(warnings.type() != bsoncxx::type::k_array) {
+            return;
+        }
 
-    if(db.getFieldMAdvanced("users", "warning", stages, list)) {
+        for(auto warning: warnings.get_array().value) {
+            if(warning.type() == bsoncxx::type::k_document && warning.get_document().value["body"].type() == bsoncxx::type::k_utf8) {
+                list.push_back(bsoncxx::string::to_string(warning.get_document().value["body"].get_utf8().value));
+            }
+        }
+    })) {
         return db.setField("users", "warnings", id, bsoncxx::types::value{bsoncxx::types::b_array{}});
     }
 
@@ -3,9 +3,15 @@
 
 #include <openssl/rand.h>
 #include <ftw.h>
+#include <memory>
+#include <sys/uio.h>
 
 #include "main.h"
 #include "Database.h"
+#include "FileCache.h"
+#include "FileIO.h"
+#include "ContentCache.h"
+#include "SessionStore.h"
 
 #define FILE_REGULAR 1
 #define FILE_DIR 2
@@ -17,6 +23,12 @@
 #define ADD_FILE_FILE_EXISTS 4
 #define ADD_FILE_EMPTY_NAME 5
 #define ADD_FILE_CONTINUE_OK 6
+#define ADD_FILE_NOT_STARTED 7
+#define ADD_FILE_TOO_BIG 8
+#define ADD_FILE_WRONG_HASH 9
+#define ADD_FILE_WRONG_RANGE 10
+#define ADD_FILE_SEQUENTIAL 11
+#define ADD_FILE_PARALLEL 12
 
 #define FILE_HASH_SIZE SHA_DIGEST_LENGTH
 
@@ -24,6 +36,34 @@
 #define USER_ADMIN 2
 
 #define OUT_FILE_CHUNK_SIZE 2048
+// completed files are read through shared mapping (see FileHandle) instead of pread
+#define DOWNLOAD_MMAP 1
+// downloads ask kernel to read ahead about READAHEAD_SECONDS of data at the rate they are going
+#define READAHEAD_MIN (256*1024)
+#define READAHEAD_MAX (16*1024*1024)
+#define READAHEAD_SECONDS 1
+// chunks sent with sendfile, there is no copy so they can be much bigger
+#define ZERO_COPY_CHUNK_SIZE (1024*1024)
+
+// parallel upload tracks received data in blocks of this size, chunks have to be aligned to it
+#define PARALLEL_BLOCK_SIZE (1024*1024)
+// seconds between lastChunkTime updates of parallel upload whose progress isn't persisted meanwhile
+#define PARALLEL_TOUCH_INTERVAL 60
+
+// sequential upload progress is written to database after this many bytes or seconds
+#define UPLOAD_FLUSH_BYTES (16*1024*1024)
+#define UPLOAD_FLUSH_INTERVAL 2
+// sequential upload is written in aligned blocks of this size, smaller chunks are collected in memory
+#define WRITE_BEHIND_SIZE (1024*1024)
+
+// durability of uploaded data before progress is written to database
+#define UPLOAD_SYNC_NONE 0      // left to the kernel
+#define UPLOAD_SYNC_PERIODIC 1  // fdatasync of the file every UPLOAD_SYNC_BYTES
+#define UPLOAD_SYNC_GROUP 2     // syncfs shared by all uploads flushing at the same time
+#define UPLOAD_SYNC_POLICY UPLOAD_SYNC_PERIODIC
+#define UPLOAD_SYNC_BYTES (64*1024*1024)
+// format of sha1 checkpoint of sequential upload, one written by other version is ignored and file is hashed again
+#define HASH_CHECKPOINT_VERSION 1
 
 #define GARBAGE_COLLECTOR_TRESHOLD_MINUTES 30
 
@@ -48,6 +88,53 @@ struct UFile {
     string realPath;
     bool isShared;
     std::chrono::system_clock::time_point lastChunkTime;
+    // SHA1 of the first lastValid bytes, kept up to date by sequential upload
+    SHA_CTX hashState;
+    bool hashing = false;
+    // part of lastValid (and hashState) already written to database
+    uint64_t flushedValid = 0;
+    // part written to disk (rest is in write-behind buffer) and part known to be durable
+    uint64_t diskValid = 0;
+    uint64_t syncedValid = 0;
+    std::chrono::steady_clock::time_point lastFlush;
+    // quota still reserved for the part not written yet
+    uint64_t reserved = 0;
+    // download read-ahead, see UserManager::adviseReadAhead
+    uint64_t readAheadEnd = 0;
+    uint64_t readAheadWindow = 0;
+    uint64_t readAheadPos = 0;
+    std::chrono::steady_clock::time_point readAheadTime;
+    // contents of popular file held for the whole download, see ContentCache
+    std::shared_ptr<const string> content;
+    // write-behind blocks and download read-ahead submitted to io_uring, see FileOps
+    std::shared_ptr<FileOps> io;
+};
+
+// file uploaded out of order by several connections at once, shared by all of them
+struct ParallelUpload {
+    std::mutex mutex;
+    UFile file;
+    // bit per PARALLEL_BLOCK_SIZE block, same bitmap is stored in "ranges" field of the file
+    vector<uint8_t> ranges;
+    uint64_t blocks = 0;
+    uint64_t received = 0;
+    bool finished = false;
+    // one connection at a time syncs and persists progress of all of them
+    bool flushing = false;
+    std::chrono::steady_clock::time_point lastTouch;
+    // file was deleted (also by garbage collector) while connections still hold it
+    bool dropped = false;
+};
+
+// user document fields which don't change often, cached by UserManager
+struct URecord {
+    string username;
+    string name;
+    string surname;
+    string homeDir;
+    string passwordHash;
+    uint64_t role = 0;
+    uint64_t totalSpace = 0;
 };
 
 struct UDetails {
@@ -67,6 +154,9 @@ private:
     bool valid;
     bool currentInFileValid;
     UFile currentInFile;
+    std::shared_ptr<ParallelUpload> currentParallel;
+    // chunks of sequential upload not written to disk yet, see WRITE_BEHIND_SIZE
+    string writeBehind;
 
     bool currentOutFileValid = false;
     UFile currentOutFile;
@@ -88,11 +178,17 @@ public:
     bool addUsername(const string&);
     bool isValid() { return valid; };
     bool isAuthorized() { return authorized; };
-    bool listFilesinPath(const string&, vector<UFile>&);
+    bool listFilesinPath(const string&, vector<UFile>&, const string& = "", uint32_t = 0);
     const UFile& getCurrentInFileMetadata();
     bool isCurrentInFileValid();
     uint8_t addFile(UFile&);
-    bool addFileChunk(const string&);
+    uint8_t addFileChunk(const string&);
+    bool endUpload();
+    bool reconcileUpload();
+    bool startParallelUpload();
+    bool isParallelUpload();
+    uint8_t addFileRange(uint64_t, const string&);
+    bool getReceivedRanges(string&);
     bool isAdmin();
     bool getYourStats(UDetails&);
     bool deleteFile(const string&);
@@ -100,8 +196,11 @@ public:
     bool changePasswd(const string&, const string&);
     bool changeUserPasswd(const string&, const string&);
     bool getFileChunk(string&);
-    bool initFileDownload(const string&, uint64_t, string&);
-    bool initSharedFileDownload(const string& filename, const string& ownerUsername, const string& hash, const uint64_t pos, string& chunk);
+    bool openFileDownload(const string&, uint64_t);
+    bool getFileSegment(uint32_t, std::shared_ptr<FileHandle>&, uint64_t&, uint32_t&);
+    bool isCurrentOutFileValid() { return currentOutFileValid; };
+    const UFile& getCurrentOutFileMetadata();
+    bool openSharedFileDownload(const string& filename, const string& ownerUsername, const string& hash, const uint64_t pos);
     bool shareWith(const string& filename, const string& username);
     bool unshareWith(const string& filename, const string& username);
     bool listShared(vector<UFile>&);
@@ -125,8 +224,46 @@ private:
 
     string l_id = "UserManager";
 
+    // instance is copied by main, so the registry can't be a regular member
+    static std::mutex uploads_mutex;
+    static std::map<string, std::shared_ptr<ParallelUpload> > parallelUploads;
+
+    // free space of users seen by this process, accepted uploads reserve what they still have to write
+    struct Quota {
+        int64_t freeSpace;
+        uint64_t reserved;
+    };
+    static std::mutex quota_mutex;
+    static std::map<string, Quota> quotas;
+    Quota* getQuota(oid&, std::unique_lock<std::mutex>&);
+
+    // user records (and username -> id) shared by all connections, loaded with one query
+    // every change of cached fields goes through UserManager, which drops the record
+    static std::mutex users_mutex;
+    static std::map<string, URecord> userRecords;
+    static std::map<string, oid> userIds;
+    // bumped by invalidateUser, record read while it changed is not cached
+    static std::map<string, uint64_t> userGenerations;
+    // bumped by every invalidateUser, username -> id found while it changed is not cached
+    static uint64_t userIdsGeneration;
+    bool getUserRecord(oid&, URecord&);
+    void invalidateUser(oid&);
+
+    // sessions persisted in users collection are read once, before first RELOGIN is checked
+    static std::once_flag sessions_loaded;
+    void loadSessions();
+    void expireSessions();
+
+    static std::mutex sync_mutex;
+    static std::condition_variable sync_cond;
+    static uint64_t syncRequested;
+    static uint64_t syncCompleted;
+    static bool syncRunning;
+    static bool syncFailed;
+    bool groupSync(int);
+    bool syncUpload(UFile&, int, bool);
+
     explicit UserManager(Database&, Logger&);
-    bool parseUserDetails(std::map<string, bsoncxx::types::value>&, UDetails&);
     bool getPasswdHash(oid&, string&);
     void garbageCollectorMain(std::condition_variable&, bool&);
 
@@ -159,23 +296,44 @@ public:
     bool deleteFile(oid&, const string&);
     bool deletePath(oid&, const string&);
 
-    bool listFilesinPath(oid&, const string&, vector<UFile>&);
+    bool listFilesinPath(oid&, const string&, vector<UFile>&, const string& = "", uint32_t = 0);
     bool addNewFile(oid&, UFile&, string&, oid&);
     bool getYourFileMetadata(oid&, const string&, UFile&, uint8_t);
-    bool addFileChunk(UFile&, const string&);
+    bool addFileChunk(UFile&, const string&, string&);
+    void preallocate(UFile&);
     bool validateFile(UFile&);
+    bool flushUpload(UFile&, string&);
+    bool reconcileUpload(UFile&);
+    bool initHashState(UFile&);
+    bool loadHashState(UFile&);
+    bool hashFile(UFile&, uint64_t, uint64_t, SHA_CTX&);
+    static bsoncxx::document::value hashCheckpoint(const UFile&);
+    static uint64_t restoreHashState(const bsoncxx::document::view&, SHA_CTX&);
+    std::shared_ptr<ParallelUpload> joinParallelUpload(UFile&);
+    bool hasParallelUpload(UFile&);
+    bool isParallelUploadActive(oid&);
+    void dropParallelUpload(oid&);
+    uint8_t addFileRange(ParallelUpload&, uint64_t, const string&);
+    uint8_t flushParallelUpload(ParallelUpload&, int);
+    bool syncParallelUpload(int);
     bool getFileChunk(UFile&, string&);
+    void startDownload(UFile&);
+    void adviseReadAhead(UFile&, int);
+    static bool writeAt(int, const string&, uint64_t);
+    static bool writeAt(int, struct iovec*, int, uint64_t);
     bool getFileId(oid&, const string&, oid&);
     bool getFileIdAdvanced(oid& ownerId, const string& filename, const string& hash, oid&);
     bool shareWith(oid& fileId, oid& userId);
     bool unshareWith(oid& fileId, oid& userId);
     bool listSharedWithUser(oid&, vector<UFile>&);
     bool getFileFilename(oid&, string&);
-    bool updateLastChunkTime(UFile&);
     bool collectOldUnfinished();
     bool removeAllUnfinishedForUser(oid&);
     bool setTotalSpace(oid&, uint64_t&);
     bool changeFreeSpace(oid&, int64_t);
+    bool reserveSpace(oid&, uint64_t);
+    void releaseSpace(oid&, uint64_t&);
+    bool commitSpace(oid&, uint64_t, uint64_t&);
     bool shareInfo(oid& fileId, vector<string>&);
     bool getWarningList(oid&, vector<string>&);
     bool addWarning(oid&, const string&);
@@ -0,0 +1,83 @@
+#include "WorkerPool.h"
+
+using namespace std;
+
+WorkerPool::WorkerPool(size_t threadCount, size_t maxQueuedTasks, Logger* logg) {
+    maxQueued = maxQueuedTasks;
+    logger = logg;
+
+    for(size_t i=0; i<threadCount; i++) {
+        threads.emplace_back(&WorkerPool::workerMain, this, (int) i);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+bool WorkerPool::submit(function<void()>&& task) {
+    {
+        lock_guard<mutex> lock(tasks_mutex);
+
+        if(stopping || tasks.size() >= maxQueued) {
+            return false;
+        }
+
+        tasks.emplace_back(std::move(task));
+    }
+
+    tasks_cond.notify_one();
+    return true;
+}
+
+// remaining tasks are dropped, not executed
+void WorkerPool::stop() {
+    {
+        lock_guard<mutex> lock(tasks_mutex);
+        stopping = true;
+    }
+
+    tasks_cond.notify_all();
+
+    for(auto& t: threads) {
+        if(t.joinable()) {
+            t.join();
+        }
+    }
+
+    deque<function<void()> > dropped;
+
+    {
+        lock_guard<mutex> lock(tasks_mutex);
+        dropped.swap(tasks);
+    }
+}
+
+size_t WorkerPool::queued() {
+    lock_guard<mutex> lock(tasks_mutex);
+    return tasks.size();
+}
+
+void WorkerPool::workerMain(int id) {
+    logger->log("worker/" + to_string(id), "started");
+
+    while(true) {
+        function<void()> task;
+
+        {
+            unique_lock<mutex> lock(tasks_mutex);
+            tasks_cond.wait(lock, [this] { return stopping || !tasks.empty(); });
+
+            if(stopping) {
+                break;
+            }
+
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task();
+    }
+
+    logger->log("worker/" + to_string(id), "closed");
+}
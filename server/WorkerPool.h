@@ -0,0 +1,32 @@
+#ifndef SERVER_WORKERPOOL_H
+#define SERVER_WORKERPOOL_H
+
+#include "main.h"
+#include "Logger.h"
+
+#include <deque>
+#include <functional>
+
+// fixed set of threads executing queued tasks, queue is bounded so overload is visible to the caller
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()> > tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cond;
+    size_t maxQueued;
+    bool stopping = false;
+    Logger* logger;
+
+    void workerMain(int);
+
+public:
+    WorkerPool(size_t, size_t, Logger*);
+    ~WorkerPool();
+    bool submit(std::function<void()>&&);
+    void stop();
+    size_t queued();
+    size_t size() { return threads.size(); };
+};
+
+#endif //SERVER_WORKERPOOL_H
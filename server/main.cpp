@@ -4,8 +4,20 @@
 #include "Logger.h"
 #include "Database.h"
 #include "User.h"
-
-list<connection*> connections;
+#include "Reactor.h"
+#include "UringReactor.h"
+#include "BufferPool.h"
+#include "FileCache.h"
+#include "ContentCache.h"
+#include "SessionStore.h"
+#include "WorkerPool.h"
+#include "Acceptor.h"
+
+vector<Acceptor*> acceptors;
+vector<Reactor*> reactors;
+WorkerPool* workers = nullptr;
+// acceptors and workers are changed by server thread while console commands read them
+std::mutex server_mutex;
 
 using namespace std;
 
@@ -24,141 +36,112 @@ void sig_handler(int signo)
     }
 }
 
-void process(int sock, connection* conn) {
-
-    int optval = 1;
-    socklen_t optlen = sizeof(optval);
-
-    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen);
-
-    optval = 2;
-
-    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &optval, optlen);
-
-    optval = 10;
+void server() {
+    unsigned int reactorCount = REACTOR_THREADS;
 
-    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &optval, optlen);
+    if(reactorCount == 0) {
+        reactorCount = thread::hardware_concurrency();
+    }
 
-    optval = 5;
+    if(reactorCount == 0) {
+        reactorCount = 1;
+    }
 
-    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &optval, optlen);
+    unsigned int workerCount = WORKER_THREADS;
 
-    Client client(sock, conn, &should_exit, &logger);
+    if(workerCount == 0) {
+        workerCount = reactorCount * 2;
+    }
 
-    client.loop();
+    {
+        lock_guard<mutex> lock(server_mutex);
+        workers = new WorkerPool(workerCount, WORKER_QUEUE_SIZE, &logger);
+    }
 
-    logger.info("PROCESS", "closed process, fd was " + to_string(sock));
+    logger.info("server", "started " + to_string(workers->size()) + " worker threads");
 
-    close(sock);
+    bool useUring = USE_IO_URING;
 
-    conn->running = false;
-}
+    for(unsigned int i=0; i<reactorCount; i++) {
+        Reactor* reactor = nullptr;
 
-void server() {
-    int sock;
-    unsigned int length;
-    struct sockaddr_in server;
+#ifdef HAVE_LIBURING
+        if(useUring) {
+            reactor = new UringReactor(i, &should_exit, &logger, workers);
+            if(!reactor->start()) {
+                logger.warn("server", "falling back to epoll reactors");
+                delete reactor;
+                reactor = nullptr;
+                useUring = false;
+            }
+        }
+#endif
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    int optval = 1;
-    socklen_t optlen = sizeof(optval);
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval, optlen);
+        if(reactor == nullptr) {
+            reactor = new Reactor(i, &should_exit, &logger, workers);
+            if(!reactor->start()) {
+                delete reactor;
+                should_exit = true;
+                break;
+            }
+        }
 
-    if (sock == -1) {
-        logger.err("server", "error while opening stream socket", errno);
-        should_exit = true;
-        return;
+        reactors.push_back(reactor);
     }
 
-    /* dowiaz adres do gniazda */
+    logger.info("server", "started " + to_string(reactors.size()) + " reactor threads");
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(52137);
-    if (bind(sock, (struct sockaddr *) &server, sizeof server) == -1) {
-        logger.err("server", "error while binding stream socket", errno);
-        should_exit = true;
-        return;
-    }
+    unsigned int acceptorCount = ACCEPTOR_THREADS;
 
-    /* wydrukuj na konsoli przydzielony port */
-    length = sizeof(server);
-    if (getsockname(sock,(struct sockaddr *) &server, &length) == -1) {
-        logger.err("server", "getting socket name", errno);
-        should_exit = true;
-        return;
+    if(acceptorCount == 0) {
+        acceptorCount = reactorCount;
     }
-    logger.info("server", "Socket port #" + to_string(ntohs(server.sin_port)));
-
-    listen(sock, 50);
-
-    fd_set set;
-    struct timeval timeout;
-    int rv;
 
-    logger.log("SERVER", "My fd is " + to_string(sock));
-
-    do {
-        FD_ZERO(&set); /* clear the set */
-        FD_SET(sock, &set); /* add our file descriptor to the set */
-        timeout.tv_sec = 2;
-        timeout.tv_usec = 0;
-        rv = select(sock + 1, &set, nullptr, nullptr, &timeout);
-
-        if (rv == -1) {
+    for(unsigned int i=0; i<acceptorCount && !should_exit; i++) {
+        Acceptor* acceptor = new Acceptor(i, &should_exit, &logger, &reactors);
+        if(!acceptor->listenOn(LISTEN_PORT) || !acceptor->start()) {
+            delete acceptor;
+            should_exit = true;
             break;
-        } else if (rv != 0) {
-            struct sockaddr_in clientaddr;
-            unsigned int len = sizeof(clientaddr);
-
-            int msgsock = accept(sock, (struct sockaddr *) &clientaddr, &len);
+        }
+        lock_guard<mutex> lock(server_mutex);
+        acceptors.push_back(acceptor);
+    }
 
-            logger.log("SERVER", "accepted " + to_string(sock) + " to " + to_string(msgsock));
+    logger.info("server", "Socket port #" + to_string(LISTEN_PORT) + ", " + to_string(acceptors.size()) + " acceptor threads");
 
-            if (msgsock == -1)
-                logger.err("server", "error while accepting connection", errno);
-            else {
-                string conn(inet_ntoa(clientaddr.sin_addr));
-                logger.info("server", "accepted connection from " + conn + ":" + to_string(ntohs(clientaddr.sin_port)));
+    for(auto acceptor: acceptors) {
+        acceptor->join();
+    }
 
-                connection* new_connection = new connection;
-                new_connection->encryption = DEFAULT_ENCRYPTION_ALGORITHM;
-                new_connection->hash_algorithm = DEFAULT_HASHING_ALGORITHM;
-                string tmp_addr;
-                tmp_addr = inet_ntoa(clientaddr.sin_addr);
-                tmp_addr.copy(new_connection->addr, tmp_addr.size());
-                new_connection->addr[tmp_addr.size()] = 0;
-                new_connection->port = (int) ntohs(clientaddr.sin_port);
-                new_connection->running = true;
+    logger.info("server", "closing all connections");
 
-                connections.push_back(new_connection);
+    for(auto reactor: reactors) {
+        reactor->join();
+    }
 
-                new_connection->t = thread(process, msgsock, new_connection);
-            }
-        }
+    // tasks still running can re-arm sockets in reactors, so pool is stopped before reactors are deleted
+    if(workers != nullptr) {
+        workers->stop();
+        lock_guard<mutex> lock(server_mutex);
+        delete workers;
+        workers = nullptr;
+    }
 
-        for(auto it=connections.begin(); it != connections.end();) {
-            if(!((*it)->running)) {
-                (*it)->t.join();
-                delete (*it);
-                it = connections.erase(it);
-                logger.log("server", "connection removed");
-            } else {
-                it++;
-            }
-        }
+    for(auto reactor: reactors) {
+        delete reactor;
+    }
 
-    } while(!should_exit);
+    reactors.clear();
 
-    logger.info("server", "closing all connections");
+    // clients release their connections into acceptors, so these go last
+    lock_guard<mutex> lock(server_mutex);
 
-    for(auto it=connections.begin(); it != connections.end();) {
-        (*it)->t.join();
-        delete (*it);
-        it = connections.erase(it);
+    for(auto acceptor: acceptors) {
+        delete acceptor;
     }
 
-    close(sock);
+    acceptors.clear();
 
     logger.info("server", "closed main server process");
 }
@@ -188,14 +171,37 @@ int main(int argc, char **argv) {
                 should_exit = true;
                 break;
             } else if (cmd == "list") {
-                logger.info("main", "There are " + to_string(connections.size()) + " active connections");
-                for (auto &connection : connections) {
-                    string conn(connection->addr);
-                    conn += ":" + to_string(connection->port);
-                    logger.info("main", conn);
+                logger.info("main", "There are " + to_string(Acceptor::connectionCount()) + " active connections");
+                size_t waiting = 0;
+                lock_guard<mutex> lock(server_mutex);
+                for (auto acceptor : acceptors) {
+                    vector<string> conns;
+                    acceptor->listConnections(conns);
+                    for (auto& conn : conns) {
+                        logger.info("main", conn);
+                    }
+                    waiting += acceptor->pendingCount();
+                }
+                if (waiting > 0) {
+                    logger.info("main", to_string(waiting) + " connections waiting for admission");
+                }
+                if (workers != nullptr) {
+                    logger.info("main", to_string(workers->queued()) + " command batches waiting for worker");
+                }
+            } else if (cmd == "mem") {
+                uint64_t rss = getRSS();
+                size_t active = Acceptor::connectionCount();
+                logger.info("main", "RSS: " + to_string(rss / 1024) + " KiB");
+                if (active > 0) {
+                    logger.info("main", "RSS per connection: " + to_string(rss / active / 1024) + " KiB (" + to_string(active) + " connections)");
                 }
+                logger.info("main", "buffer pool: " + BufferPool::stats());
+                logger.info("main", "file cache: " + FileCache::stats());
+                logger.info("main", "content cache: " + ContentCache::stats());
+                logger.info("main", "sessions: " + SessionStore::stats());
+                logger.info("main", "database: " + db.stats());
             } else if (cmd == "help") {
-                logger.info("main", "Available commands:\n  exit - closes server\n  list - lists active connections\n  users - list registered users");
+                logger.info("main", "Available commands:\n  exit - closes server\n  list - lists active connections\n  mem - memory usage per connection\n  users - list registered users");
             } else if (cmd == "users") {
                 logger.info("main", "All users:");
                 vector<UDetails> users;
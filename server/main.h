@@ -39,20 +39,56 @@
 
 #include "protbuf/messages.pb.h"
 
-#define MAX_CONNECTIONS 20
+#define LISTEN_PORT 52137
+#define LISTEN_BACKLOG 1024
 
-#define MAX_PACKET_SIZE 1024*1024*4+100
+// 0 - one acceptor thread (and SO_REUSEPORT socket) per core
+#define ACCEPTOR_THREADS 0
+
+// connections served at once, above that accepted sockets wait in admission queue
+#define MAX_CONNECTIONS 50000
+// per acceptor
+#define MAX_PENDING_CONNECTIONS 1024
+// seconds a connection may wait for admission before it is rejected
+#define ADMISSION_TIMEOUT 10
+
+// 0 - one reactor thread per core
+#define REACTOR_THREADS 0
+// reactors submit socket I/O (and file I/O of uploads and downloads, see FileOps) to io_uring when built with liburing
+// and kernel supports it, otherwise epoll is used
+#define USE_IO_URING 1
+
+// threads executing commands, 0 - two per core
+#define WORKER_THREADS 0
+// batches of commands waiting for a worker, above that commands are rejected
+#define WORKER_QUEUE_SIZE 4096
+// open file descriptors kept by file cache (files being uploaded or downloaded)
+#define FILE_CACHE_SIZE 1024
+// memory for contents of frequently downloaded files and biggest file which can be kept there
+#define CONTENT_CACHE_SIZE (256*1024*1024)
+#define CONTENT_CACHE_MAX_FILE (16*1024*1024)
+// seconds after last use when session id stops being accepted by RELOGIN
+#define SESSION_TTL (7*24*60*60)
+// sessions are also written to users collection, so they survive restart
+#define SESSION_PERSIST 1
+// seconds between writes of session use time to database
+#define SESSION_TOUCH_INTERVAL (60*60)
+
+#define MAX_PACKET_SIZE (1024*1024*4+100)
 
 #define DEFAULT_ENCRYPTION_ALGORITHM StorageCloud::EncryptionAlgorithm::NOENCRYPTION
 #define DEFAULT_HASHING_ALGORITHM StorageCloud::HashAlgorithm::H_SHA512
 
+class Acceptor;
+
 struct connection {
-    std::thread t;
     char addr[25];
     int port;
     StorageCloud::EncryptionAlgorithm encryption;
     StorageCloud::HashAlgorithm hash_algorithm;
-    bool running;
+    Acceptor* acceptor;
+    // position in acceptor's registry, for O(1) removal
+    std::list<connection*>::iterator registryPos;
 };
 
 #endif //SERVER_MAIN_H
@@ -98,4 +98,33 @@ char getch() {
 
     tcsetattr(STDIN_FILENO, TCSANOW, &t_old);
     return (char) ch;
-}
\ No newline at end of file
+}
+
+// resident set size of this process in bytes
+uint64_t getRSS() {
+    long pages = 0, resident = 0;
+    ::FILE* f = fopen("/proc/self/statm", "r");
+
+    if(f == nullptr) {
+        return 0;
+    }
+
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+
+    fclose(f);
+    return (uint64_t) resident * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+// directory holding given file, with trailing slash like paths listed by LIST_FILES ("/a/b" -> "/a/")
+// empty for root itself, so it's never listed in any directory
+std::string parentDir(const std::string& filename) {
+    size_t pos = filename.rfind('/');
+
+    if(pos == std::string::npos || pos == filename.size() - 1) {
+        return "";
+    }
+
+    return filename.substr(0, pos + 1);
+}
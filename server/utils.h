@@ -18,5 +18,7 @@ void encrypt(StorageCloud::EncryptionAlgorithm, const uint8_t*, uint32_t, uint8_
 void decrypt(StorageCloud::EncryptionAlgorithm, const uint8_t*, uint32_t, uint8_t**, uint32_t*);
 
 char getch();
+uint64_t getRSS();
+std::string parentDir(const std::string&);
 
 #endif //SERVER_MESSAGES_H